@@ -0,0 +1,16 @@
+; list building: consing up lists, append in a loop and a reverse by
+; append, which copies all its arguments, the last one too, every time
+(defun iota (n acc)
+  (cond ((= n 0) acc)
+        (t (iota (- n 1) (cons n acc)))))
+(defun rev (l)
+  (cond ((null l) nil)
+        (t (append (rev (cdr l)) (list (car l))))))
+(defun grow (n acc)
+  (cond ((= n 0) acc)
+        (t (grow (- n 1) (append (iota 10 nil) acc)))))
+(defun repeat (n)
+  (cond ((= n 0) nil)
+        (t (progn (rev (iota 400 nil)) (grow 300 nil)
+                  (repeat (- n 1))))))
+(repeat 10)
@@ -0,0 +1,25 @@
+; marking a million element list, a million deep tree and a wide tree.
+; make check runs this under --gc-stress, with and without pointer
+; reversal; stress is off while building and walking them, or every
+; allocation would mark them all, and on for the collections between
+(gc-tune 'stress 0)
+(defun build (i acc) (cond ((= i 0) acc) (t (build (- i 1) (cons i acc)))))
+(defun nest (i acc) (cond ((= i 0) acc) (t (nest (- i 1) (cons acc i)))))
+(defun tree (d) (cond ((= d 0) 1) (t (cons (tree (- d 1)) (tree (- d 1))))))
+(label long (build 1000000 nil))
+(label deep (nest 1000000 nil))
+(label wide (tree 16))
+
+; gc-tune makes its alist under stress too, a few dozen collections
+(gc-tune 'stress 1)
+(gc)
+(gc-tune 'stress 0)
+
+; all still there, and not left reversed
+(defun len (x n) (cond ((consp x) (len (cdr x) (+ n 1))) (t n)))
+(defun sum (x n) (cond ((consp x) (sum (cdr x) (+ n (car x)))) (t n)))
+(defun depth (x n) (cond ((consp x) (depth (car x) (+ n 1))) (t n)))
+(defun leaves (x) (cond ((consp x) (+ (leaves (car x)) (leaves (cdr x)))) (t x)))
+(print (len long 0) (sum long 0))
+(print (depth deep 0) (cdr deep))
+(print (leaves wide))
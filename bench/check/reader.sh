@@ -0,0 +1,66 @@
+#!/bin/sh
+# Reads input nested 100000 deep and lists a million long, from an
+# mmap'd file and from a pipe, and prints them back.  Fails if lisp
+# crashes or gets any of them wrong.
+# usage: bench/check/reader.sh [lisp binary]
+LISP=${1:-./lisp}
+DIR=${TMPDIR:-/tmp}/reader-check.$$
+trap 'rm -rf $DIR' EXIT
+mkdir -p $DIR
+
+awk -v deep=100000 -v long=1000000 'BEGIN {
+	print "(defun depth (x n) (cond ((consp x) (depth (car x) (+ n 1))) (t n)))";
+	print "(defun len (x n) (cond ((consp x) (len (cdr x) (+ n 1))) (t n)))";
+	print "(defun quotes (x n) " \
+	      "(cond ((consp x) (quotes (car (cdr x)) (+ n 1))) (t n)))";
+	s = "";
+	for (i = 0; i < deep; i++)
+		s = s "(";
+	s = s "x";
+	for (i = 0; i < deep; i++)
+		s = s ")";
+	print "(label d (quote " s "))";
+	print "(print (depth d 0))";
+	q = "";
+	for (i = 0; i < deep; i++)
+		q = q "\x27";
+	print "(label q " q "x)";
+	print "(print (quotes q 0))";
+	printf "(label l (quote (";
+	for (i = 0; i < long; i++)
+		printf " %d", i;
+	print ")))";
+	print "(print (len l 0))";
+	printf "(label p (quote (";
+	for (i = 0; i < long; i++)
+		printf " (%d . s%d)", i, i;
+	print " . end)))";
+	print "(print (len p 0) (car (car (cdr p))))";
+	print "(print d)";
+	print "(print l)";
+}' > $DIR/in.lsp
+
+# print leaves a space after each value; label evaluates one quote away
+awk -v deep=100000 -v long=1000000 'BEGIN {
+	printf "%d \n%d \n%d \n%d 1 \n", deep, deep - 1, long, long;
+	for (i = 0; i < deep; i++)
+		printf "(";
+	printf "x";
+	for (i = 0; i < deep; i++)
+		printf ")";
+	printf " \n(";
+	for (i = 0; i < long; i++)
+		printf "%s%d", i ? " " : "", i;
+	printf ") \n";
+}' > $DIR/expected
+
+status=0
+$LISP $DIR/in.lsp > $DIR/file.out || status=1
+$LISP < $DIR/in.lsp > $DIR/pipe.out || status=1
+for f in file pipe; do
+	if ! diff -q $DIR/expected $DIR/$f.out > /dev/null; then
+		echo "reader check: reading from a $f went wrong" >&2
+		status=1
+	fi
+done
+exit $status
@@ -0,0 +1,19 @@
+; tail calls must run in constant C stack: make check runs this under
+; a small stack limit, where any of the loops recursing would crash
+(defun count (i acc)
+  (cond ((= i 0) acc)
+        (t (count (- i 1) (+ acc 1)))))
+(print (count 10000000 0))
+
+; through the last operand of and, or and progn
+(defun count-and (i) (cond ((= i 0) 'and) (t (and t (count-and (- i 1))))))
+(defun count-or (i) (cond ((= i 0) 'or) (t (or nil (count-or (- i 1))))))
+(defun count-progn (i) (cond ((= i 0) 'progn) (t (progn i (count-progn (- i 1))))))
+(print (count-and 1000000) (count-or 1000000) (count-progn 1000000))
+
+; mutual recursion, and a macro expansion in tail position
+(defun even (i) (cond ((= i 0) t) (t (odd (- i 1)))))
+(defun odd (i) (cond ((= i 0) nil) (t (even (- i 1)))))
+(defmacro again (i) `(count-let (- ,i 1)))
+(defun count-let (i) (let ((j i)) (cond ((= j 0) 'let) (t (again j)))))
+(print (even 1000001) (count-let 1000000))
@@ -0,0 +1,26 @@
+; errors are reported and evaluation carries on with the next form
+unbound
+(car 1)
+(car unbound)
+(+ 1 'a)
+(+ unbound 1)
+(undefined-function 1 2)
+(1 2 3)
+(defun two (a b) (list a b))
+(two 1)
+(two 1 2 3)
+(two 1 2)
+(defun deep-error (i) (cond ((= i 0) (car 'x)) (t (deep-error (- i 1)))))
+(deep-error 100)
+(quotient 1 0)
+(remainder 5 0)
+(vector-ref (vector 1 2) 2)
+(vector-ref 'x 0)
+(substring "abc" 2 1)
+(string-length 'x)
+(concat "a" 1)
+(make-vector -1 0)
+(cons 1)
+(setcar 'x 1)
+(gc-tune 'no-such-setting 1)
+(list 'still 'running)
@@ -0,0 +1,31 @@
+; macros, expanded at each call site, cached and redefined
+(defmacro unless (c x) `(cond (,c nil) (t ,x)))
+(unless nil 42)
+(unless t 42)
+(defmacro swap (a b) `(list ,b ,a))
+(swap 1 2)
+(defmacro my-and (a . rest) (cond ((eq rest nil) a) (t `(cond (,a (my-and ,@rest)) (t nil)))))
+(my-and 1 2 3)
+(my-and 1 nil 3)
+(defmacro twice (x) `(progn ,x ,x))
+(label n 0)
+(twice (set n (+ n 1)))
+n
+(defun use-unless (x) (unless x 'no))
+(list (use-unless nil) (use-unless t))
+(defmacro unless (c x) `(cond (,c 'redefined) (t ,x)))
+(list (use-unless nil) (use-unless t))
+(macroexpand-1 '(swap a b))
+(macroexpand '(my-and a b))
+`(1 ,(+ 1 1) ,@(list 3 4) 5)
+(let ((a 1) (b 2)) (swap a b))
+(defmacro with-x (v . body) `(let ((x ,v)) ,@body))
+(with-x 5 (* x x))
+(defun loop-macro (i acc) (cond ((= i 0) acc) (t (with-x i (loop-macro (- x 1) (+ acc x))))))
+(loop-macro 1000 0)
+; a macro defined after the function calling it gets the source form
+(defun use-later (x) (later x))
+(defmacro later (a) (cond ((eq a 'x) ''source) (t ''evaluated)))
+(use-later 5)
+(label use-later-2 (λ (x) (list (later x) (later (car x)))))
+(use-later-2 '(6))
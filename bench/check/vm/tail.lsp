@@ -0,0 +1,26 @@
+; tail calls through every form that has a tail position
+(defun count (i acc) (cond ((= i 0) acc) (t (count (- i 1) (+ acc 1)))))
+(count 100000 0)
+(defun count-and (i) (cond ((= i 0) 'and) (t (and t (count-and (- i 1))))))
+(defun count-or (i) (cond ((= i 0) 'or) (t (or nil (count-or (- i 1))))))
+(defun count-progn (i) (cond ((= i 0) 'progn) (t (progn i (count-progn (- i 1))))))
+(list (count-and 10000) (count-or 10000) (count-progn 10000))
+(defun even (i) (cond ((= i 0) t) (t (odd (- i 1)))))
+(defun odd (i) (cond ((= i 0) nil) (t (even (- i 1)))))
+(list (even 10001) (odd 10001))
+(defun count-let (i) (let ((j (- i 1))) (cond ((< j 0) 'let) (t (count-let j)))))
+(count-let 10000)
+; a closure called in tail position, and one returned
+(defun adder (n) (λ (x) (+ x n)))
+(label add3 (adder 3))
+(defun apply-n (f i x) (cond ((= i 0) x) (t (apply-n f (- i 1) (f x)))))
+(apply-n add3 1000 0)
+(label counter (let ((n 0)) (λ () (set n (+ n 1)))))
+(counter)
+(counter)
+; the value of the last expression of a body, and of empty forms
+((λ (x) x x (* x 2)) 21)
+(cond (nil 1))
+(and)
+(or)
+(progn 1 2 3)
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Compares two outputs of bench/run.sh, workload by workload: median
+# times and their ratio, then the change in bytes allocated and RSS.
+# usage: bench/compare.sh old.tsv new.tsv
+[ $# -eq 2 ] || { echo "usage: $0 old.tsv new.tsv" >&2; exit 1; }
+awk -F '\t' '
+/^#/ { next }
+FNR == NR { ms[$1] = $2; bytes[$1] = $5; rss[$1] = $6; next }
+$1 in ms {
+	if (!header++)
+		printf "%-12s %10s %10s %8s %9s %9s\n", "name", "old ms",
+			"new ms", "speedup", "bytes", "rss";
+	printf "%-12s %10.1f %10.1f %7.2fx %+8.1f%% %+8.1f%%\n", $1,
+		ms[$1], $2, $2 ? ms[$1] / $2 : 0,
+		bytes[$1] ? 100 * ($5 - bytes[$1]) / bytes[$1] : 0,
+		rss[$1] ? 100 * ($6 - rss[$1]) / rss[$1] : 0;
+}' "$1" "$2"
@@ -0,0 +1,16 @@
+; factorial of 10000, as a loop of small times big multiplications and
+; as a product tree, whose big times big products go through Karatsuba
+(defun fact (n acc)
+  (cond ((= n 0) acc)
+        (t (fact (- n 1) (* n acc)))))
+(defun prod (lo hi)
+  (cond ((< (- hi lo) 4) (fact-range lo hi 1))
+        (t ((lambda (mid) (* (prod lo mid) (prod (+ mid 1) hi)))
+            (quotient (+ lo hi) 2)))))
+(defun fact-range (lo hi acc)
+  (cond ((< hi lo) acc)
+        (t (fact-range lo (- hi 1) (* hi acc)))))
+(label f (fact 10000 1))
+(= f (prod 1 10000))
+(remainder f 1000000007)
+f
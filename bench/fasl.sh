@@ -0,0 +1,45 @@
+#!/bin/sh
+# fasl-read and fasl-write against reading and printing the same data
+# as text, SIZE_MB of it (100 by default).  Each time is the best of
+# three runs with the startup, and for the writers the time to get the
+# data in, taken off.  fasl-write keeps shared structure, which print
+# only does with *print-circle*, so printing is timed both ways.
+# usage: bench/fasl.sh [lisp binary]
+LISP=${1:-./lisp}
+SIZE_MB=${SIZE_MB:-100}
+DIR=${TMPDIR:-/tmp}/fasl-bench.$$
+trap 'rm -rf $DIR' EXIT
+mkdir -p $DIR
+. $(dirname $0)/lib.sh
+
+{
+	echo "(label d (quote ("
+	gen_forms -v mb=$SIZE_MB -v width=20 -v quote=0 -v digits=6 -v big=1
+	echo ")))"
+} > $DIR/data.lsp
+: > $DIR/empty.lsp
+echo "(fasl-write d (quote $DIR/data.fasl))" > $DIR/write.lsp
+echo "(label d (fasl-read (quote $DIR/data.fasl)))" > $DIR/read.lsp
+echo "(print d)" > $DIR/print.lsp
+echo "(label *print-circle* t)" > $DIR/circle.lsp
+
+base=$(best 3 $LISP $DIR/empty.lsp)
+text_read=$(best 3 $LISP $DIR/data.lsp)
+$LISP $DIR/data.lsp $DIR/write.lsp || exit 1
+fasl_write=$(best 3 $LISP $DIR/data.lsp $DIR/write.lsp)
+fasl_read=$(best 3 $LISP $DIR/read.lsp)
+text_write=$(best 3 $LISP $DIR/read.lsp $DIR/print.lsp)
+circle_write=$(best 3 $LISP $DIR/read.lsp $DIR/circle.lsp $DIR/print.lsp)
+
+awk -v text=$(wc -c < $DIR/data.lsp) -v fasl=$(wc -c < $DIR/data.fasl) \
+    -v base=$base -v tr=$text_read -v fw=$fasl_write \
+    -v fr=$fasl_read -v tw=$text_write -v cw=$circle_write 'BEGIN {
+	fw -= tr; tw -= fr; cw -= fr; tr -= base; fr -= base;
+	printf "fasl: text %.1f MB, fasl %.1f MB\n", text / 1e6, fasl / 1e6;
+	printf "fasl: read  text %.3f s, fasl %.3f s, %.1fx\n",
+		tr / 1e6, fr / 1e6, tr / fr;
+	printf "fasl: write text %.3f s, fasl %.3f s, %.1fx\n",
+		tw / 1e6, fw / 1e6, tw / fw;
+	printf "fasl: write text with *print-circle* %.3f s, %.1fx\n",
+		cw / 1e6, cw / fw;
+}'
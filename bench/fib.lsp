@@ -0,0 +1,5 @@
+; doubly recursive fib: calls, fixnum arithmetic and cond
+(defun fib (n)
+  (cond ((< n 2) n)
+        (t (+ (fib (- n 1)) (fib (- n 2))))))
+(fib 25)
@@ -0,0 +1,11 @@
+; a loop whose body is nested lets, each a macro call expanding to a
+; lambda application
+(defun step (i acc)
+  (let ((a (+ i 1))
+        (b (* i 2)))
+    (let ((c (- b a)))
+      (+ acc c))))
+(defun loop (i acc)
+  (cond ((= i 0) acc)
+        (t (loop (- i 1) (step i acc)))))
+(loop 100000 0)
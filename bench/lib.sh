@@ -0,0 +1,76 @@
+# Helpers sourced by the bench scripts: timing and the generated data.
+
+now() { date +%s%N; }
+
+# Best wall time in microseconds of n runs of the command, whose
+# output is dropped and whose stdin is empty
+# usage: best n command...
+best() {
+	n=$1
+	shift
+	min=
+	for k in $(seq $n); do
+		s=$(now); "$@" < /dev/null > /dev/null; e=$(now)
+		t=$(( (e - s) / 1000 ))
+		[ -z "$min" ] || [ $t -lt $min ] && min=$t
+	done
+	echo $min
+}
+
+# Prints forms of random data, one a line, each
+#   pre(quote (form-i (sym-j int float (nested (list k)) . -j)...))post
+# with width items.  Set as awk variables with -v: n forms (20000), or
+# forms until mb megabytes, width (12), pre and post ("" each), quote=0
+# to leave out the quote, digits of the floats (3), and big=1 to put a
+# bignum in every 100th form.  The same settings give the same data.
+# usage: gen_forms [-v var=value]...
+gen_forms() {
+	awk "$@" 'BEGIN {
+		if (n == "" && mb == "") n = 20000;
+		if (width == "") width = 12;
+		if (quote == "") quote = 1;
+		if (digits == "") digits = 3;
+		item = " (sym-%d %d %." digits "f (nested (list %d)) . %d)";
+		srand(1);
+		for (i = 0; n != "" ? i < n : size < mb * 1e6; i++) {
+			s = sprintf("(form-%d", i);
+			for (j = 0; j < width; j++)
+				s = s sprintf(item, j, int(rand() * 1000000),
+					rand() * 100, i * j, -j);
+			if (big && i % 100 == 0)
+				s = s sprintf(" %d%09d%09d", i + 1, i, j);
+			s = s ")";
+			if (quote)
+				s = "(quote " s ")";
+			print pre s post;
+			size += length(s) + 1;
+		}
+	}'
+}
+
+# Prints n function and n macro definitions
+# usage: gen_defs n
+gen_defs() {
+	awk -v n=$1 'BEGIN {
+		for (i = 0; i < n; i++) {
+			printf "(defun f%d (x y) (cond ((< x %d) (+ x y)) " \
+			       "(t (f%d (- x 1) (* y 2)))))\n", i, i % 7, i;
+			printf "(defmacro m%d (a . b) `(cond (,a (list %d ,@b)) " \
+			       "(t nil)))\n", i, i;
+		}
+	}'
+}
+
+# Prints a quoted list of n unique symbols, then 1000 forms that each
+# read one of them again
+# usage: gen_symbols n
+gen_symbols() {
+	awk -v n=$1 'BEGIN {
+		printf "(label syms (quote (";
+		for (i = 0; i < n; i++)
+			printf "%ssym-%d", i % 16 ? " " : "\n", i;
+		print ")))";
+		for (i = 0; i < 1000; i++)
+			printf "(atom (quote sym-%d))\n", int(i * n / 1000);
+	}'
+}
@@ -0,0 +1,20 @@
+; cons memory: four lists of 200000 kept live, one of them of floats,
+; and one more reversal thrown away; bench/lists.sh reports the heap
+(defun iota (n acc)
+  (cond ((= n 0) acc)
+        (t (iota (- n 1) (cons n acc)))))
+(defun rev (l acc)
+  (cond ((null l) acc)
+        (t (rev (cdr l) (cons (car l) acc)))))
+(defun squares (l acc)
+  (cond ((null l) acc)
+        (t (squares (cdr l) (cons (* (car l) (car l)) acc)))))
+(defun halves (l acc)
+  (cond ((null l) acc)
+        (t (halves (cdr l) (cons (/ (car l) 2.0) acc)))))
+(label a (iota 200000 nil))
+(label b (rev a nil))
+(label c (squares b nil))
+(label d (halves c nil))
+(null (rev a nil))
+(null (gc))
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Heap taken by conses: runs bench/lists.lsp under the tree walker and
+# the bytecode vm, best of three, and reports the live and freed bytes
+# after its last collection and the peak RSS, from --gc-report.
+# usage: bench/lists.sh [lisp binary]
+LISP=${1:-./lisp}
+LISTS=$(dirname $0)/lists.lsp
+REPORT=${TMPDIR:-/tmp}/lists-bench.$$
+trap 'rm -f $REPORT' EXIT
+. $(dirname $0)/lib.sh
+
+for m in "" --vm; do
+	time=$(best 3 $LISP $m $LISTS)
+	$LISP $m --gc-report $LISTS 2> $REPORT > /dev/null
+	awk -v name=${m:-walker} -v time=$time '
+	/ freed, / { gsub(/[(]/, ""); freed = $4; live = $9 }
+	/peak rss/ { rss = $4 }
+	END {
+		printf "lists: %-6s live %9d bytes, freed %10d bytes, " \
+			"peak rss %6.1f MB, %.0f ms\n", name, live, freed,
+			rss / 1024, time / 1000;
+	}' $REPORT
+done
@@ -0,0 +1,11 @@
+; nested map over a 300 element list, a closure made per outer element
+(defun iota (n acc)
+  (cond ((= n 0) acc)
+        (t (iota (- n 1) (cons n acc)))))
+(label l (iota 300 nil))
+(defun table (l)
+  (map (λ (x) (map (λ (y) (* x y)) l)) l))
+(defun repeat (n)
+  (cond ((= n 0) nil)
+        (t (progn (table l) (repeat (- n 1))))))
+(repeat 5)
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Printer throughput in MB/s: the same generated data, about 10 MB
+# printed, is read and printed back, then read and dropped; the
+# difference is the time spent printing.
+# usage: bench/printer.sh [lisp binary]
+LISP=${1:-./lisp}
+DATA=${TMPDIR:-/tmp}/printer-bench.$$.lsp
+QUIET=${TMPDIR:-/tmp}/printer-quiet.$$.lsp
+trap 'rm -f $DATA $QUIET' EXIT
+. $(dirname $0)/lib.sh
+
+gen_forms -v n=2000 -v width=100 > $DATA
+gen_forms -v n=2000 -v width=100 -v pre="(atom " -v post=")" > $QUIET
+
+size=$($LISP < $DATA | wc -c)
+printing=$(best 5 sh -c "$LISP < $DATA")
+quiet=$(best 5 sh -c "$LISP < $QUIET")
+awk -v size=$size -v printing=$printing -v quiet=$quiet 'BEGIN {
+	printf "printer: %.1f MB\n", size / 1e6;
+	printf "printer: %.1f MB/s\n", size / (printing - quiet);
+}'
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Reader throughput in MB/s on a generated file of about 12 MB, read
+# from an mmap'd file argument and from stdin.  Each form is
+# (atom '<datum>), so evaluating and printing cost next to nothing.
+# usage: bench/reader.sh [lisp binary]
+LISP=${1:-./lisp}
+DATA=${TMPDIR:-/tmp}/reader-bench.$$.lsp
+EMPTY=${TMPDIR:-/tmp}/reader-empty.$$.lsp
+trap 'rm -f $DATA $EMPTY' EXIT
+. $(dirname $0)/lib.sh
+
+gen_forms -v pre="(atom " -v post=")" > $DATA
+: > $EMPTY
+
+size=$(wc -c < $DATA)
+base=$(best 3 $LISP $EMPTY)
+file=$(best 3 $LISP $DATA)
+pipe=$(best 3 sh -c "$LISP < $DATA")
+pbase=$(best 3 sh -c "$LISP < $EMPTY")
+awk -v size=$size -v base=$base -v file=$file -v pipe=$pipe -v pbase=$pbase \
+    'BEGIN {
+	printf "reader: %.1f MB\n", size / 1e6;
+	printf "reader: mmap  %.1f MB/s\n", size / (file - base);
+	printf "reader: stdin %.1f MB/s\n", size / (pipe - pbase);
+}'
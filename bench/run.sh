@@ -0,0 +1,61 @@
+#!/bin/sh
+# Runs every bench/*.lsp workload, plus reading and printing a large
+# generated file and starting up on an empty one, REPS times each (5
+# by default).  Prints one tab separated line per workload: median and
+# best wall time in ms, then objects and bytes allocated and peak RSS
+# in KB as --gc-report gives them.  Lines starting with # are comments,
+# so two runs can be compared with bench/compare.sh.
+# usage: bench/run.sh [lisp binary]
+LISP=${1:-./lisp}
+REPS=${REPS:-5}
+BENCH=$(dirname $0)
+DIR=${TMPDIR:-/tmp}/bench.$$
+trap 'rm -rf $DIR' EXIT
+mkdir -p $DIR
+. $BENCH/lib.sh
+
+# about 12 MB of forms to read, and 3 MB to read and print back
+gen_forms -v pre="(atom " -v post=")" > $DIR/reader.lsp
+gen_forms -v n=5000 > $DIR/printer.lsp
+gen_symbols 100000 > $DIR/symbols.lsp
+: > $DIR/startup.lsp
+
+# name, then the command, run with --gc-report
+run() {
+	name=$1
+	shift
+	: > $DIR/times
+	for k in $(seq $REPS); do
+		s=$(now)
+		"$@" 2> $DIR/report > /dev/null
+		e=$(now)
+		echo $(( (e - s) / 1000 )) >> $DIR/times
+	done
+	sort -n $DIR/times | awk -v name=$name -v report=$DIR/report '
+	{ t[NR] = $1 }
+	END {
+		while ((getline l < report) > 0) {
+			split(l, f, " ");
+			if (l ~ /objects allocated/)
+				objs = f[2];
+			else if (l ~ /bytes allocated/)
+				bytes = f[2];
+			else if (l ~ /peak rss/)
+				rss = f[4];
+		}
+		med = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2;
+		printf "%s\t%.1f\t%.1f\t%d\t%d\t%d\n", name, med / 1000,
+			t[1] / 1000, objs, bytes, rss;
+	}'
+}
+
+echo "# $LISP $(git -C $BENCH describe --always --dirty 2>/dev/null)" \
+     "reps $REPS $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+printf "# name\tmedian_ms\tbest_ms\tobjects\tbytes\trss_kb\n"
+run startup $LISP --gc-report $DIR/startup.lsp
+for f in $BENCH/*.lsp; do
+	run $(basename $f .lsp) $LISP --gc-report $f
+done
+run reader $LISP --gc-report $DIR/reader.lsp
+run printer sh -c "$LISP --gc-report < $DIR/printer.lsp"
+run symbols $LISP --gc-report $DIR/symbols.lsp
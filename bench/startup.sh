@@ -0,0 +1,27 @@
+#!/bin/sh
+# Cold start from text against starting from an image: lib.lsp alone,
+# and lib.lsp plus a generated library of 2000 functions and macros.
+# usage: bench/startup.sh [lisp binary]
+LISP=${1:-./lisp}
+DIR=${TMPDIR:-/tmp}/startup-bench.$$
+mkdir -p $DIR
+trap 'rm -rf $DIR' EXIT
+. $(dirname $0)/lib.sh
+
+gen_defs 1000 > $DIR/big.lsp
+echo "(save-image '$DIR/lib.img)" > $DIR/save-lib.lsp
+echo "(save-image '$DIR/big.img)" > $DIR/save-big.lsp
+$LISP $DIR/save-lib.lsp
+$LISP $DIR/big.lsp $DIR/save-big.lsp
+
+text=$(best 10 $LISP)
+image=$(best 10 $LISP --image $DIR/lib.img)
+bigtext=$(best 10 $LISP $DIR/big.lsp)
+bigimage=$(best 10 $LISP --image $DIR/big.img)
+awk -v a=$text -v b=$image -v c=$bigtext -v d=$bigimage \
+    -v s1=$(wc -c < $DIR/lib.img) -v s2=$(wc -c < $DIR/big.img) 'BEGIN {
+	printf "startup: lib.lsp        text %6.2f ms  image %6.2f ms (%d KB)\n",
+		a / 1000, b / 1000, s1 / 1024;
+	printf "startup: lib + 2000 defs text %6.2f ms  image %6.2f ms (%d KB)\n",
+		c / 1000, d / 1000, s2 / 1024;
+}'
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Interning: reads a list of N (100000 by default) unique symbols and
+# 1000 lookups of them, best of three with the startup taken off.
+# usage: bench/symbols.sh [lisp binary]
+LISP=${1:-./lisp}
+N=${N:-100000}
+DATA=${TMPDIR:-/tmp}/symbols-bench.$$.lsp
+EMPTY=${TMPDIR:-/tmp}/symbols-empty.$$.lsp
+trap 'rm -f $DATA $EMPTY' EXIT
+. $(dirname $0)/lib.sh
+
+gen_symbols $N > $DATA
+: > $EMPTY
+
+base=$(best 3 $LISP $EMPTY)
+time=$(best 3 $LISP $DATA)
+awk -v n=$N -v base=$base -v time=$time 'BEGIN {
+	printf "symbols: %d unique, %.3f s, %.0f symbols/s\n", n,
+		(time - base) / 1e6, n / ((time - base) / 1e6);
+}'
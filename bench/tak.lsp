@@ -0,0 +1,10 @@
+; Takeuchi's function, three arguments deep in non-tail calls
+(defun tak (x y z)
+  (cond ((< y x) (tak (tak (- x 1) y z)
+                      (tak (- y 1) z x)
+                      (tak (- z 1) x y)))
+        (t z)))
+(defun repeat (n)
+  (cond ((= n 0) nil)
+        (t (progn (tak 18 12 6) (repeat (- n 1))))))
+(repeat 10)
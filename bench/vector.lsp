@@ -0,0 +1,18 @@
+; scattered lookups in a table of 1000, and a string built and searched
+(defun fill (v i)
+  (cond ((= i (vector-length v)) v)
+        (t (progn (vector-set! v i (* i i)) (fill v (+ i 1))))))
+(label table (fill (make-vector 1000 0) 0))
+(defun sum (i acc)
+  (cond ((= i 0) acc)
+        (t (sum (- i 1)
+                (+ acc (vector-ref table (remainder (* i 7919) 1000)))))))
+(sum 200000 0)
+(defun grow (s i)
+  (cond ((= i 0) s)
+        (t (grow (concat s "ab") (- i 1)))))
+(label text (concat (grow "" 2000) "needle"))
+(defun find (i acc)
+  (cond ((= i 0) acc)
+        (t (find (- i 1) (+ acc (string-search "needle" text))))))
+(find 2000 0)
@@ -0,0 +1,8 @@
+; recursion through the Y combinator: every call goes through the
+; (λ (y) ((x x) y)) closures Y builds
+(label fib
+  (Y (λ (fib)
+       (λ (n)
+         (cond ((< n 2) n)
+               (t (+ (fib (- n 1)) (fib (- n 2)))))))))
+(fib 24)
@@ -0,0 +1,505 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lisp.h"
+
+/*
+ * Bignums
+ *
+ * Integers beyond 32 bits are a sign and a magnitude of 32 bit limbs,
+ * least significant first.  The limbs are malloc'd outside the heap,
+ * charged to the collector with gc_charge and freed by the sweep.
+ * Every operation reads its operands, which may also be INTs, computes
+ * the result into a fresh buffer and only then allocates the cell, so
+ * the operands need not be rooted.  Results that fit 32 bits come back
+ * as INTs: a BIG never holds a value an INT could.
+ */
+
+#define KARATSUBA_MIN	32	/* below this many limbs schoolbook wins */
+#define DEC_BASE	1000000000u	/* decimal chunks for read and print */
+#define DEC_DIGITS	9
+
+#define big(X)		((struct bignum*)(X))
+
+/* An integer operand seen as sign and magnitude */
+struct num {
+	const uint32_t *d;
+	size_t n;
+	int neg;
+	uint32_t small;		/* the magnitude of an INT */
+};
+
+static void view(struct num *v, sexp_t *x)
+{
+	int32_t i;
+
+	if (isint(x)) {
+		i = get_int(x);
+		v->neg = i < 0;
+		v->small = i < 0 ? -(uint32_t)i : (uint32_t)i;
+		v->d = &v->small;
+		v->n = v->small != 0;
+	} else {
+		v->neg = big(x)->neg;
+		v->d = big(x)->limb;
+		v->n = big(x)->len;
+	}
+}
+
+static uint32_t *limbs(size_t n)
+{
+	uint32_t *d;
+	if (!(d = calloc(n ? n : 1, sizeof(uint32_t)))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	return d;
+}
+
+static size_t trim(const uint32_t *d, size_t n)
+{
+	while (n && !d[n-1])
+		n--;
+	return n;
+}
+
+/* Wraps n limbs of d, which it takes over, in an INT or a BIG */
+static sexp_t *make_big(uint32_t *d, size_t n, int neg)
+{
+	struct bignum *b;
+
+	n = trim(d, n);
+	if (n == 0 || (n == 1 && d[0] < 0x80000000u + neg)) {
+		int32_t i = n ? (int32_t)(neg ? -(int64_t)d[0] : d[0]) : 0;
+		free(d);
+		return int_(i);
+	}
+	gc_charge(n * sizeof(uint32_t));
+	b = gc_alloc(BIG, sizeof(struct bignum));
+	b->neg = neg;
+	b->len = n;
+	b->limb = d;
+	return (sexp_t*)b;
+}
+
+/* An INT or BIG of a copy of n limbs */
+sexp_t *big_from_limbs(const uint32_t *d, size_t n, int neg)
+{
+	uint32_t *r = limbs(n);
+	memcpy(r, d, n * sizeof(uint32_t));
+	return make_big(r, n, neg);
+}
+
+void big_free(sexp_t *a)
+{
+	free(big(a)->limb);
+}
+
+/*
+ * Magnitudes
+ */
+
+static int mag_cmp(const uint32_t *a, size_t an, const uint32_t *b, size_t bn)
+{
+	an = trim(a, an);
+	bn = trim(b, bn);
+	if (an != bn)
+		return an < bn ? -1 : 1;
+	while (an--)
+		if (a[an] != b[an])
+			return a[an] < b[an] ? -1 : 1;
+	return 0;
+}
+
+/* r += a, where r has room for the sum in rn limbs */
+static void mag_add_into(uint32_t *r, size_t rn, const uint32_t *a, size_t an)
+{
+	uint64_t s = 0;
+	size_t i;
+
+	for (i = 0; i < an; i++) {
+		s += (uint64_t)r[i] + a[i];
+		r[i] = (uint32_t)s;
+		s >>= 32;
+	}
+	for (; s && i < rn; i++) {
+		s += r[i];
+		r[i] = (uint32_t)s;
+		s >>= 32;
+	}
+}
+
+/* r -= a, where r >= a */
+static void mag_sub_from(uint32_t *r, size_t rn, const uint32_t *a, size_t an)
+{
+	int64_t t, borrow = 0;
+	size_t i;
+
+	for (i = 0; i < an; i++) {
+		t = (int64_t)r[i] - a[i] - borrow;
+		r[i] = (uint32_t)t;
+		borrow = t < 0;
+	}
+	for (; borrow && i < rn; i++) {
+		t = (int64_t)r[i] - borrow;
+		r[i] = (uint32_t)t;
+		borrow = t < 0;
+	}
+}
+
+static void mag_mul_school(uint32_t *r, const uint32_t *a, size_t an,
+			   const uint32_t *b, size_t bn)
+{
+	uint64_t t;
+	size_t i, j;
+
+	memset(r, 0, (an + bn) * sizeof(uint32_t));
+	for (i = 0; i < bn; i++) {
+		if (!b[i])
+			continue;
+		t = 0;
+		for (j = 0; j < an; j++) {
+			t += (uint64_t)a[j] * b[i] + r[i+j];
+			r[i+j] = (uint32_t)t;
+			t >>= 32;
+		}
+		r[i+an] = (uint32_t)t;
+	}
+}
+
+static void mag_mul(uint32_t *r, const uint32_t *a, size_t an,
+		    const uint32_t *b, size_t bn);
+
+/*
+ * Karatsuba, for an >= bn > an/2: with a = a1 B^m + a0 and b split
+ * likewise, a b = z2 B^2m + z1 B^m + z0 where z0 = a0 b0, z2 = a1 b1
+ * and z1 = (a0 + a1)(b0 + b1) - z0 - z2, three products instead of four.
+ */
+static void mag_karatsuba(uint32_t *r, const uint32_t *a, size_t an,
+			  const uint32_t *b, size_t bn)
+{
+	size_t m = an / 2, sn = an - m + 1, tn = bn - m + 1;
+	uint32_t *sa, *sb, *z1;
+	size_t zn;
+
+	if (tn < m + 1)
+		tn = m + 1;
+	sa = limbs(sn);
+	sb = limbs(tn);
+	z1 = limbs(sn + tn);
+
+	mag_mul(r, a, m, b, m);
+	mag_mul(r + 2*m, a + m, an - m, b + m, bn - m);
+
+	memcpy(sa, a + m, (an - m) * sizeof(uint32_t));
+	mag_add_into(sa, sn, a, m);
+	memcpy(sb, b, m * sizeof(uint32_t));
+	mag_add_into(sb, tn, b + m, bn - m);
+	mag_mul(z1, sa, sn, sb, tn);
+	mag_sub_from(z1, sn + tn, r, 2*m);
+	mag_sub_from(z1, sn + tn, r + 2*m, an + bn - 2*m);
+	zn = trim(z1, sn + tn);
+	mag_add_into(r + m, an + bn - m, z1, zn);
+
+	free(sa);
+	free(sb);
+	free(z1);
+}
+
+/* r = a * b, with an + bn limbs of room in r */
+static void mag_mul(uint32_t *r, const uint32_t *a, size_t an,
+		    const uint32_t *b, size_t bn)
+{
+	const uint32_t *x;
+	uint32_t *tmp;
+	size_t i, n;
+
+	if (an < bn) {
+		x = a; a = b; b = x;
+		n = an; an = bn; bn = n;
+	}
+	if (bn < KARATSUBA_MIN) {
+		mag_mul_school(r, a, an, b, bn);
+		return;
+	}
+	if (2*bn > an) {
+		mag_karatsuba(r, a, an, b, bn);
+		return;
+	}
+	/* lopsided: multiply b by slices of a as long as itself */
+	memset(r, 0, (an + bn) * sizeof(uint32_t));
+	tmp = limbs(2*bn);
+	for (i = 0; i < an; i += bn) {
+		n = an - i < bn ? an - i : bn;
+		mag_mul(tmp, a + i, n, b, bn);
+		mag_add_into(r + i, an + bn - i, tmp, n + bn);
+	}
+	free(tmp);
+}
+
+/* Divides d in place by a single limb, returns the remainder */
+static uint32_t mag_div_small(uint32_t *d, size_t n, uint32_t v)
+{
+	uint64_t cur = 0;
+
+	while (n--) {
+		cur = cur << 32 | d[n];
+		d[n] = (uint32_t)(cur / v);
+		cur %= v;
+	}
+	return (uint32_t)cur;
+}
+
+/*
+ * q = a / b and r = a % b, for an >= bn > 0 and a trimmed b, by Knuth's
+ * algorithm D.  q has room for an - bn + 1 limbs and r for bn.
+ */
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *a, size_t an,
+		       const uint32_t *b, size_t bn)
+{
+	uint32_t *u, *v;
+	uint64_t qhat, rhat, p;
+	int64_t t, k;
+	unsigned s;
+	size_t i, j;
+
+	if (bn == 1) {
+		memcpy(q, a, an * sizeof(uint32_t));
+		r[0] = mag_div_small(q, an, b[0]);
+		return;
+	}
+	/* normalize so that the top limb of v has its high bit set */
+	s = __builtin_clz(b[bn-1]);
+	v = limbs(bn);
+	u = limbs(an + 1);
+	for (i = bn - 1; i > 0; i--)
+		v[i] = b[i] << s | (uint32_t)((uint64_t)b[i-1] >> (32 - s));
+	v[0] = b[0] << s;
+	u[an] = (uint32_t)((uint64_t)a[an-1] >> (32 - s));
+	for (i = an - 1; i > 0; i--)
+		u[i] = a[i] << s | (uint32_t)((uint64_t)a[i-1] >> (32 - s));
+	u[0] = a[0] << s;
+
+	for (j = an - bn + 1; j-- > 0; ) {
+		p = (uint64_t)u[j+bn] << 32 | u[j+bn-1];
+		qhat = p / v[bn-1];
+		rhat = p % v[bn-1];
+		while (qhat >> 32 ||
+		       qhat * v[bn-2] > (rhat << 32 | u[j+bn-2])) {
+			qhat--;
+			rhat += v[bn-1];
+			if (rhat >> 32)
+				break;
+		}
+		/* u[j..j+bn] -= qhat * v */
+		k = 0;
+		for (i = 0; i < bn; i++) {
+			p = qhat * v[i];
+			t = (int64_t)u[i+j] - k - (int64_t)(p & 0xFFFFFFFF);
+			u[i+j] = (uint32_t)t;
+			k = (int64_t)(p >> 32) - (t >> 32);
+		}
+		t = (int64_t)u[j+bn] - k;
+		u[j+bn] = (uint32_t)t;
+		if (t < 0) {
+			/* qhat was one too large: add v back */
+			qhat--;
+			p = 0;
+			for (i = 0; i < bn; i++) {
+				p += (uint64_t)u[i+j] + v[i];
+				u[i+j] = (uint32_t)p;
+				p >>= 32;
+			}
+			u[j+bn] += (uint32_t)p;
+		}
+		q[j] = (uint32_t)qhat;
+	}
+	for (i = 0; i < bn - 1; i++)
+		r[i] = u[i] >> s | (uint32_t)((uint64_t)u[i+1] << (32 - s));
+	r[bn-1] = u[bn-1] >> s;
+	free(u);
+	free(v);
+}
+
+/*
+ * Arithmetic on INTs and BIGs
+ */
+
+static sexp_t *add(sexp_t *a, sexp_t *b, int negb)
+{
+	struct num x, y;
+	uint32_t *r;
+	size_t n;
+	int neg;
+
+	view(&x, a);
+	view(&y, b);
+	y.neg ^= negb;
+	n = (x.n > y.n ? x.n : y.n) + 1;
+	r = limbs(n);
+	if (x.neg == y.neg) {
+		memcpy(r, x.d, x.n * sizeof(uint32_t));
+		mag_add_into(r, n, y.d, y.n);
+		neg = x.neg;
+	} else if (mag_cmp(x.d, x.n, y.d, y.n) >= 0) {
+		memcpy(r, x.d, x.n * sizeof(uint32_t));
+		mag_sub_from(r, n, y.d, y.n);
+		neg = x.neg;
+	} else {
+		memcpy(r, y.d, y.n * sizeof(uint32_t));
+		mag_sub_from(r, n, x.d, x.n);
+		neg = y.neg;
+	}
+	return make_big(r, n, neg);
+}
+
+sexp_t *big_add(sexp_t *a, sexp_t *b)
+{
+	return add(a, b, 0);
+}
+
+sexp_t *big_sub(sexp_t *a, sexp_t *b)
+{
+	return add(a, b, 1);
+}
+
+sexp_t *big_mul(sexp_t *a, sexp_t *b)
+{
+	struct num x, y;
+	uint32_t *r;
+
+	view(&x, a);
+	view(&y, b);
+	if (!x.n || !y.n)
+		return int_(0);
+	r = limbs(x.n + y.n);
+	mag_mul(r, x.d, x.n, y.d, y.n);
+	return make_big(r, x.n + y.n, x.neg != y.neg);
+}
+
+/* Truncating division, the remainder takes the sign of a */
+static sexp_t *divide(sexp_t *a, sexp_t *b, int rem)
+{
+	struct num x, y;
+	uint32_t *q, *r;
+
+	view(&x, a);
+	view(&y, b);
+	if (!y.n) {
+		fprintf(stderr, "error: division by zero\n");
+		return NULL;
+	}
+	if (mag_cmp(x.d, x.n, y.d, y.n) < 0)
+		return rem ? a : int_(0);
+	q = limbs(x.n - y.n + 1);
+	r = limbs(y.n);
+	mag_divmod(q, r, x.d, x.n, y.d, y.n);
+	if (rem) {
+		free(q);
+		return make_big(r, y.n, x.neg);
+	}
+	free(r);
+	return make_big(q, x.n - y.n + 1, x.neg != y.neg);
+}
+
+sexp_t *big_quotient(sexp_t *a, sexp_t *b)
+{
+	return divide(a, b, 0);
+}
+
+sexp_t *big_remainder(sexp_t *a, sexp_t *b)
+{
+	return divide(a, b, 1);
+}
+
+int big_cmp(sexp_t *a, sexp_t *b)
+{
+	struct num x, y;
+	int c;
+
+	view(&x, a);
+	view(&y, b);
+	if (x.neg != y.neg && (x.n || y.n))
+		return x.neg ? -1 : 1;
+	c = mag_cmp(x.d, x.n, y.d, y.n);
+	return x.neg ? -c : c;
+}
+
+double big_to_double(sexp_t *a)
+{
+	double f = 0.0;
+	size_t i;
+
+	for (i = big(a)->len; i-- > 0; )
+		f = f * 4294967296.0 + big(a)->limb[i];
+	return big(a)->neg ? -f : f;
+}
+
+/*
+ * Decimal conversion
+ */
+
+/* Reads n characters of optionally signed decimal digits */
+sexp_t *big_read(const char *s, size_t n)
+{
+	const char *end = s + n;
+	uint32_t *r, chunk;
+	size_t len = 0, i;
+	uint64_t t;
+	int neg = 0, k;
+
+	if (n && (*s == '-' || *s == '+')) {
+		neg = *s++ == '-';
+		n--;
+	}
+	r = limbs(n / DEC_DIGITS + 2);
+	for (k = n % DEC_DIGITS ? n % DEC_DIGITS : DEC_DIGITS; s < end;
+	     k = DEC_DIGITS) {
+		uint32_t scale = 1;
+		for (chunk = 0; k--; s++) {
+			chunk = chunk*10 + (*s - '0');
+			scale *= 10;
+		}
+		/* r = r * scale + chunk */
+		t = chunk;
+		for (i = 0; i < len; i++) {
+			t += (uint64_t)r[i] * scale;
+			r[i] = (uint32_t)t;
+			t >>= 32;
+		}
+		if (t)
+			r[len++] = (uint32_t)t;
+	}
+	return make_big(r, len, neg);
+}
+
+void big_print(sexp_t *a, FILE *out)
+{
+	uint32_t *d, *dec, c;
+	size_t n = big(a)->len, k = 0, i;
+	char *buf, *s;
+	int j;
+
+	d = limbs(n);
+	dec = limbs(n * 32 / 29 + 1);	/* 2^29 < 10^9 */
+	memcpy(d, big(a)->limb, n * sizeof(uint32_t));
+	while (n) {
+		dec[k++] = mag_div_small(d, n, DEC_BASE);
+		n = trim(d, n);
+	}
+	if (!(buf = malloc(k * DEC_DIGITS + 1))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	s = buf + k * DEC_DIGITS + 1;	/* digits go in backwards */
+	for (i = 0; i < k - 1; i++)
+		for (c = dec[i], j = 0; j < DEC_DIGITS; j++, c /= 10)
+			*--s = '0' + c % 10;
+	for (c = dec[i]; c; c /= 10)
+		*--s = '0' + c % 10;
+	if (big(a)->neg)
+		*--s = '-';
+	print_write(s, buf + k * DEC_DIGITS + 1 - s, out);
+	free(buf);
+	free(d);
+	free(dec);
+}
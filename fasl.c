@@ -0,0 +1,691 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lisp.h"
+
+/*
+ * Fasl
+ *
+ * fasl-write puts a tree of conses and vectors, integers, floats,
+ * strings and symbols in a file as tagged binary, which fasl-read
+ * decodes straight into new cells: there is nothing to tokenize,
+ * numbers are not parsed and each symbol name is interned once per
+ * file.  After the magic the file is one item, a tag byte followed by
+ *
+ *   F_NIL, F_T	nothing
+ *   F_INT	the integer as a varint, zigzag coded
+ *   F_FLOAT	the 8 bytes of the double, little endian
+ *   F_BIG	sign byte, varint limb count, 4 bytes per limb
+ *   F_SYM	varint length and name, numbering the symbol
+ *   F_OLDSYM	varint number of a symbol seen before
+ *   F_LIST	varint n, the n cars of a chain of conses, then the cdr
+ *		of the last one
+ *   F_LABEL	labels the first cons of the F_LIST, or the vector of the
+ *		F_VECTOR, that follows
+ *   F_REF	varint label of a cons or vector seen before
+ *   F_STRING	varint length and the bytes
+ *   F_VECTOR	varint n, then the n elements
+ *
+ * Varints hold 7 bits a byte, low bits first, the top bit set in all
+ * but the last byte.  A first pass finds the conses and vectors reached
+ * more than once, as for *print-circle*; they are written once and referred to
+ * after that, so shared and circular structure reads back as it was.
+ * Both directions keep their own stack instead of recursing.
+ */
+
+#define FASL_MAGIC	"LFASL\0\0\1"
+#define FASL_CHUNK	(1 << 16)
+
+enum { F_NIL, F_T, F_INT, F_FLOAT, F_BIG, F_SYM, F_OLDSYM, F_LIST,
+       F_LABEL, F_REF, F_STRING, F_VECTOR };
+
+static void out_of_memory(void)
+{
+	fprintf(stderr, "error: out of memory\n");
+	exit(1);
+}
+
+static void *grow(void *p, size_t *size, size_t need, size_t elem)
+{
+	if (need <= *size)
+		return p;
+	while (*size < need)
+		*size = *size ? 2 * *size : 64;
+	if (!(p = realloc(p, *size * elem)))
+		out_of_memory();
+	return p;
+}
+
+/*
+ * Writing
+ */
+
+/* Cell to number, by open addressing */
+struct entry {
+	sexp_t *cell;
+	long n;
+};
+
+struct map {
+	struct entry *slot;
+	size_t size, count;
+};
+
+struct wframe {
+	sexp_t *cell;		/* cons whose car is being written, or vector */
+	size_t left;		/* cars or elements still to write, this one
+				   included */
+};
+
+struct writer {
+	FILE *out;
+	unsigned char *buf;
+	size_t len;
+	struct map shared;	/* conses and vectors met twice: 0, or label + 1 */
+	struct map syms;	/* symbol number + 1 */
+	long labels, nsyms;
+	struct wframe *stack;
+	size_t depth, stack_size;
+	int fail;		/* met something it cannot write */
+	int ioerr;
+};
+
+#define map_hash(p)	((size_t)(((PTRT)(p) >> 4) * 0x9E3779B1u))
+
+/* The entry of cell, or the free one it would go in */
+static struct entry *map_find(struct map *m, sexp_t *cell)
+{
+	size_t i, mask = m->size - 1;
+
+	for (i = map_hash(cell) & mask; m->slot[i].cell; i = (i+1) & mask)
+		if (m->slot[i].cell == cell)
+			break;
+	return &m->slot[i];
+}
+
+/* The entry of cell, added with n 0 if it was not there */
+static struct entry *map_add(struct map *m, sexp_t *cell)
+{
+	struct entry *old = m->slot, *e;
+	size_t i, size = m->size;
+
+	if (2 * (m->count + 1) > m->size) {
+		m->size = size ? 2 * size : 1024;
+		if (!(m->slot = calloc(m->size, sizeof(*m->slot))))
+			out_of_memory();
+		for (i = 0; i < size; i++)
+			if (old[i].cell)
+				*map_find(m, old[i].cell) = old[i];
+		free(old);
+	}
+	e = map_find(m, cell);
+	if (!e->cell) {
+		e->cell = cell;
+		m->count++;
+	}
+	return e;
+}
+
+static void put_flush(struct writer *w)
+{
+	if (w->len && fwrite(w->buf, 1, w->len, w->out) != w->len)
+		w->ioerr = 1;
+	w->len = 0;
+}
+
+/* Room for n more bytes; no item needs more than FASL_CHUNK but names */
+static unsigned char *room(struct writer *w, size_t n)
+{
+	if (w->len + n > FASL_CHUNK)
+		put_flush(w);
+	return w->buf + w->len;
+}
+
+static void put_byte_slow(struct writer *w, int c)
+{
+	*room(w, 1) = c;
+	w->len++;
+}
+
+#define put_byte(w, c)	((w)->len < FASL_CHUNK ?\
+			 (void)((w)->buf[(w)->len++] = (c)) :\
+			 put_byte_slow((w), (c)))
+
+static void put_varint(struct writer *w, uint64_t n)
+{
+	unsigned char *p = room(w, 10), *s = p;
+
+	while (n >= 0x80) {
+		*p++ = n | 0x80;
+		n >>= 7;
+	}
+	*p++ = n;
+	w->len += p - s;
+}
+
+static void put_bytes(struct writer *w, const void *s, size_t n)
+{
+	if (n > FASL_CHUNK) {
+		put_flush(w);
+		if (fwrite(s, 1, n, w->out) != n)
+			w->ioerr = 1;
+		return;
+	}
+	memcpy(room(w, n), s, n);
+	w->len += n;
+}
+
+static void put_atom(struct writer *w, sexp_t *x)
+{
+	union { double f; uint64_t i; } bits;
+	struct bignum *b;
+	struct entry *e;
+	unsigned char *p;
+	int64_t i;
+	size_t j, len;
+
+	if (x == nil) {
+		put_byte(w, F_NIL);
+		return;
+	}
+	if (x == t) {
+		put_byte(w, F_T);
+		return;
+	}
+	switch (x ? type(x) : NIL) {
+	case INT:
+		i = get_int(x);
+		put_byte(w, F_INT);
+		put_varint(w, (uint64_t)i << 1 ^ (uint64_t)(i >> 63));
+		break;
+	case FLOAT:
+		bits.f = get_float(x);
+		put_byte(w, F_FLOAT);
+		p = room(w, 8);
+		for (j = 0; j < 8; j++)
+			p[j] = bits.i >> 8*j;
+		w->len += 8;
+		break;
+	case BIG:
+		b = (struct bignum*)x;
+		put_byte(w, F_BIG);
+		put_byte(w, b->neg);
+		put_varint(w, b->len);
+		for (j = 0; j < b->len; j++) {
+			p = room(w, 4);
+			p[0] = b->limb[j];
+			p[1] = b->limb[j] >> 8;
+			p[2] = b->limb[j] >> 16;
+			p[3] = b->limb[j] >> 24;
+			w->len += 4;
+		}
+		break;
+	case SYM:
+		e = map_add(&w->syms, x);
+		if (e->n) {
+			put_byte(w, F_OLDSYM);
+			put_varint(w, e->n - 1);
+			break;
+		}
+		e->n = ++w->nsyms;
+		len = strlen(get_symname(x));
+		put_byte(w, F_SYM);
+		put_varint(w, len);
+		put_bytes(w, get_symname(x), len);
+		break;
+	case STRING:
+		put_byte(w, F_STRING);
+		put_varint(w, string_len(x));
+		put_bytes(w, string_chars(x), string_len(x));
+		break;
+	default:
+		fprintf(stderr, "error: fasl-write takes conses, vectors, "
+				"numbers, strings and symbols only\n");
+		w->fail = 1;
+		break;
+	}
+}
+
+static void push(struct writer *w, sexp_t *cell, size_t left)
+{
+	if (w->depth == w->stack_size)
+		w->stack = grow(w->stack, &w->stack_size, w->depth + 1,
+				sizeof(*w->stack));
+	w->stack[w->depth].cell = cell;
+	w->stack[w->depth].left = left;
+	w->depth++;
+}
+
+#define compound(x)	(iscons(x) || isvector(x))
+
+/*
+ * First pass: finds the conses and vectors reached more than once,
+ * noting those met in their mark bits rather than in a table of every
+ * cons.  Only the shared ones go in a map, which mostly stays small or
+ * empty.
+ */
+static void find_shared(struct writer *w, sexp_t *x)
+{
+	size_t i;
+
+	push(w, x, 0);
+	while (w->depth) {
+		x = w->stack[--w->depth].cell;
+		if (isvector(x)) {
+			if (gc_visit(x))
+				map_add(&w->shared, x);
+			else
+				for (i = 0; i < vector_len(x); i++)
+					if (compound(vector_elems(x)[i]))
+						push(w, vector_elems(x)[i], 0);
+			continue;
+		}
+		for (; iscons(x); x = cdr(x)) {
+			if (gc_visit(x)) {
+				map_add(&w->shared, x);
+				break;
+			}
+			if (compound(car(x)))
+				push(w, car(x), 0);
+		}
+		if (isvector(x))
+			push(w, x, 0);
+	}
+	gc_visit_end();
+}
+
+/* The entry of a shared cons or vector, NULL for the others */
+static struct entry *find_label(struct writer *w, sexp_t *x)
+{
+	struct entry *e = map_find(&w->shared, x);
+	return e->cell ? e : NULL;
+}
+
+#define shared(w, x)	((w)->shared.count ? find_label((w), (x)) : NULL)
+
+static void put_value(struct writer *w, sexp_t *x)
+{
+	struct wframe *f;
+	struct entry *e;
+	sexp_t *y;
+	size_t n;
+
+	for (;;) {
+		e = compound(x) ? shared(w, x) : NULL;
+		if (!compound(x)) {
+			put_atom(w, x);
+		} else if (e && e->n) {
+			put_byte(w, F_REF);
+			put_varint(w, e->n - 1);
+		} else {
+			if (e) {
+				e->n = ++w->labels;
+				put_byte(w, F_LABEL);
+			}
+			if (isvector(x)) {
+				put_byte(w, F_VECTOR);
+				put_varint(w, vector_len(x));
+				if (vector_len(x)) {
+					push(w, x, vector_len(x));
+					x = vector_elems(x)[0];
+					continue;
+				}
+				goto next;
+			}
+			/* the run ends before a cons written on its own */
+			for (n = 1, y = cdr(x); iscons(y) && !shared(w, y);
+			     y = cdr(y))
+				n++;
+			put_byte(w, F_LIST);
+			put_varint(w, n);
+			push(w, x, n);
+			x = car(x);
+			continue;
+		}
+next:
+		/* x is done, find what follows it */
+		for (;;) {
+			if (!w->depth || w->fail)
+				return;
+			f = &w->stack[w->depth - 1];
+			if (isvector(f->cell)) {
+				if (!--f->left) {
+					w->depth--;
+					continue;
+				}
+				x = vector_elems(f->cell)[vector_len(f->cell) -
+							  f->left];
+				break;
+			}
+			x = cdr(f->cell);
+			if (--f->left) {
+				f->cell = x;
+				x = car(x);
+			} else {
+				w->depth--;
+			}
+			break;
+		}
+	}
+}
+
+/* Writes x to the file at path, 0 on success */
+int fasl_write(sexp_t *x, const char *path)
+{
+	struct writer w;
+
+	memset(&w, 0, sizeof(w));
+	if (!(w.out = fopen(path, "wb"))) {
+		fprintf(stderr, "error: could not open %s\n", path);
+		return -1;
+	}
+	if (!(w.buf = malloc(FASL_CHUNK)))
+		out_of_memory();
+	put_bytes(&w, FASL_MAGIC, 8);
+	find_shared(&w, x);
+	put_value(&w, x);
+	put_flush(&w);
+	if (fclose(w.out) || w.ioerr) {
+		fprintf(stderr, "error: could not write %s\n", path);
+		w.fail = 1;
+	}
+	if (w.fail)
+		unlink(path);	/* rather than leave half a file */
+	free(w.buf);
+	free(w.shared.slot);
+	free(w.syms.slot);
+	free(w.stack);
+	return w.fail ? -1 : 0;
+}
+
+/*
+ * Reading
+ */
+
+struct rframe {
+	sexp_t *cell;		/* last cons of the chain, or vector */
+	size_t left;		/* cars or elements still to read, 0 once
+				   at the cdr */
+};
+
+struct loader {
+	const unsigned char *pos, *end;
+	sexp_t *ret;
+	sexp_t **syms;
+	size_t nsyms, syms_size;
+	sexp_t **labels;
+	size_t nlabels, labels_size;
+	struct rframe *stack;
+	size_t depth, stack_size;
+	uint32_t *limbs;
+	size_t limbs_size;
+	int fail;
+};
+
+static int get_byte(struct loader *l)
+{
+	if (l->pos == l->end) {
+		l->fail = 1;
+		return -1;
+	}
+	return *l->pos++;
+}
+
+static uint64_t get_varint(struct loader *l)
+{
+	uint64_t n = 0;
+	int shift = 0, c;
+
+	do {
+		if ((c = get_byte(l)) < 0 || shift > 63)
+			return l->fail = 1, 0;
+		n |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return n;
+}
+
+/* The n bytes at pos, NULL if the file ends first */
+static const unsigned char *get_bytes(struct loader *l, uint64_t n)
+{
+	const unsigned char *p = l->pos;
+
+	if (n > (uint64_t)(l->end - l->pos))
+		return l->fail = 1, NULL;
+	l->pos += n;
+	return p;
+}
+
+static sexp_t *get_atom(struct loader *l, int tag)
+{
+	union { double f; uint64_t i; } bits;
+	const unsigned char *p;
+	uint64_t n;
+	int64_t i;
+	size_t j;
+	int neg;
+
+	switch (tag) {
+	case F_NIL:
+		return nil;
+	case F_T:
+		return t;
+	case F_INT:
+		n = get_varint(l);
+		i = (int64_t)(n >> 1 ^ -(n & 1));
+		if (i < INT32_MIN || i > INT32_MAX)
+			break;
+		return int_(i);
+	case F_FLOAT:
+		if (!(p = get_bytes(l, 8)))
+			break;
+		for (bits.i = 0, j = 0; j < 8; j++)
+			bits.i |= (uint64_t)p[j] << 8*j;
+		return float_(bits.f);
+	case F_BIG:
+		neg = get_byte(l);
+		n = get_varint(l);
+		if (neg < 0 || neg > 1 || n == 0 || !(p = get_bytes(l, 4 * n)))
+			break;
+		l->limbs = grow(l->limbs, &l->limbs_size, n, sizeof(uint32_t));
+		for (j = 0; j < n; j++, p += 4)
+			l->limbs[j] = p[0] | p[1] << 8 | p[2] << 16 |
+				(uint32_t)p[3] << 24;
+		if (!l->limbs[n - 1])
+			break;
+		return big_from_limbs(l->limbs, n, neg);
+	case F_SYM:
+		n = get_varint(l);
+		if (!n || !(p = get_bytes(l, n)) || memchr(p, 0, n))
+			break;
+		l->syms = grow(l->syms, &l->syms_size, l->nsyms + 1,
+			       sizeof(sexp_t*));
+		/* the symbol is placed before anything else is allocated */
+		return l->syms[l->nsyms++] = find_symboln((const char*)p, n);
+	case F_OLDSYM:
+		n = get_varint(l);
+		if (n >= l->nsyms)
+			break;
+		return l->syms[n];
+	case F_STRING:
+		n = get_varint(l);
+		if (n > UINT32_MAX || !(p = get_bytes(l, n)))
+			break;
+		return new_string((const char*)p, n);
+	case F_REF:
+		n = get_varint(l);
+		if (n >= l->nlabels)
+			break;
+		return l->labels[n];
+	}
+	l->fail = 1;
+	return NULL;
+}
+
+/* Puts x where the item being read goes */
+static void place(struct loader *l, sexp_t *x)
+{
+	struct rframe *f;
+
+	if (!l->depth) {
+		l->ret = x;
+		return;
+	}
+	f = &l->stack[l->depth - 1];
+	if (isvector(f->cell)) {
+		vector_elems(f->cell)[vector_len(f->cell) - f->left] = x;
+		gc_write(f->cell, x);
+	} else if (f->left)
+		set_car(f->cell, x);
+	else
+		set_cdr(f->cell, x);
+}
+
+static void add_label(struct loader *l, sexp_t *x)
+{
+	l->labels = grow(l->labels, &l->labels_size, l->nlabels + 1,
+			 sizeof(sexp_t*));
+	l->labels[l->nlabels++] = x;
+}
+
+static void push_frame(struct loader *l, sexp_t *cell, size_t left)
+{
+	l->stack = grow(l->stack, &l->stack_size, l->depth + 1,
+			sizeof(*l->stack));
+	l->stack[l->depth].cell = cell;
+	l->stack[l->depth].left = left;
+	l->depth++;
+}
+
+/*
+ * Reads the item at pos.  Every cons or vector is made and placed
+ * before what it holds is read, so the whole structure hangs from the
+ * rooted ret while it is built and labels can refer to lists that are
+ * not finished yet.
+ */
+static sexp_t *get_value(struct loader *l)
+{
+	struct rframe *f;
+	sexp_t *c;
+	uint64_t n;
+	int tag, label = 0;
+	gc_frame();
+
+	l->ret = nil;
+	gc_push(&l->ret);
+	while (!l->fail) {
+		if ((tag = get_byte(l)) == F_LABEL) {
+			label = 1;
+			continue;
+		}
+		if (tag == F_LIST) {
+			n = get_varint(l);
+			if (!n || l->fail)
+				break;
+			c = cons(nil, nil);
+			place(l, c);
+			if (label)
+				add_label(l, c);
+			label = 0;
+			/* a list in a cdr continues the chain */
+			if (!l->depth || l->stack[l->depth - 1].left ||
+			    isvector(l->stack[l->depth - 1].cell))
+				push_frame(l, c, n);
+			else {
+				f = &l->stack[l->depth - 1];
+				f->cell = c;
+				f->left = n;
+			}
+			continue;
+		}
+		if (tag == F_VECTOR) {
+			/* each element takes a byte at least */
+			n = get_varint(l);
+			if (l->fail || n > UINT32_MAX ||
+			    n > (uint64_t)(l->end - l->pos))
+				break;
+			c = new_vector(n, nil);
+			place(l, c);
+			if (label)
+				add_label(l, c);
+			label = 0;
+			if (n) {
+				push_frame(l, c, n);
+				continue;
+			}
+		} else {
+			if (label || !(c = get_atom(l, tag)))
+				break;
+			place(l, c);
+		}
+
+		/* c is done, find what follows it */
+		for (;;) {
+			if (!l->depth)
+				goto done;
+			f = &l->stack[l->depth - 1];
+			if (!f->left) {
+				l->depth--;
+				continue;
+			}
+			if (isvector(f->cell)) {
+				if (--f->left)
+					break;
+				l->depth--;
+				continue;
+			}
+			if (--f->left) {
+				c = cons(nil, nil);
+				set_cdr(f->cell, c);
+				f->cell = c;
+			}
+			break;
+		}
+	}
+	l->fail = 1;
+done:
+	gc_pop();
+	return l->ret;
+}
+
+/* The object in the fasl file at path, NULL on error */
+sexp_t *fasl_read(const char *path)
+{
+	struct loader l;
+	struct stat st;
+	void *map = MAP_FAILED;
+	sexp_t *x;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "error: could not open %s\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size > 8)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED || memcmp(map, FASL_MAGIC, 8)) {
+		fprintf(stderr, "error: %s is not a fasl file\n", path);
+		if (map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return NULL;
+	}
+
+	memset(&l, 0, sizeof(l));
+	l.pos = (const unsigned char*)map + 8;
+	l.end = (const unsigned char*)map + st.st_size;
+	x = get_value(&l);
+	if (!l.fail && l.pos != l.end)
+		l.fail = 1;
+	if (l.fail)
+		fprintf(stderr, "error: %s is corrupt\n", path);
+	free(l.syms);
+	free(l.labels);
+	free(l.stack);
+	free(l.limbs);
+	munmap(map, st.st_size);
+	return l.fail ? NULL : x;
+}
@@ -0,0 +1,647 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lisp.h"
+
+/*
+ * Images
+ *
+ * save-image writes everything reachable from the toplevel bindings to
+ * a file; --image maps such a file and rebuilds the heap from it in
+ * place of loading lib.lsp.  The file holds no addresses: objects are
+ * fixed size records that refer to each other by index, and what is
+ * not of fixed size (names, limbs, frames, bytecode) lies in a data
+ * area the records point into by offset.  Loading is one pass that
+ * allocates every object and one that fills in their fields, which
+ * beats reading and analyzing the same definitions from text once
+ * there are more than a few of them: bench/startup.sh compares both.
+ *
+ * What init() makes is not written but referred to by its place in
+ * the builtin table: nil, t, dot, the toplevel environment and the
+ * primitives and special forms, sorted by name.  An image only loads
+ * into a binary with the same builtins, as its header records.
+ *
+ * A reference is 0 for NULL, n<<1 | 1 for the fixnum n and i+1 << 1
+ * for object i, counting the builtins first.
+ */
+
+#define IMAGE_MAGIC	"LISPIMG\0"
+#define IMAGE_VERSION	1
+
+struct image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t word;		/* sizeof(void*) of the writer */
+	uint32_t builtins;	/* hash of the builtin names */
+	uint32_t nbuiltins;
+	uint64_t nobjs;
+	uint64_t nbinds;	/* (symbol, value) pairs after the objects */
+	uint64_t size;		/* of the data that follows them */
+};
+
+struct image_obj {
+	uint8_t type;
+	uint8_t flag;		/* sign of a BIG, rest of a CODE */
+	uint16_t nparams;	/* of a CODE */
+	uint32_t n;		/* length of a name, limbs, ops or frame */
+	uint64_t a, b;		/* references, offsets or raw fields */
+};
+
+static sexp_t **builtin;
+static size_t nbuiltins;
+static uint32_t builtins_hash;
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp(((const char **)a)[0], ((const char **)b)[0]);
+}
+
+/* Takes the builtin table from the toplevel init() has just made */
+void image_init(void)
+{
+	struct { const char *name; sexp_t *val; } *prims;
+	struct binding *b;
+	size_t i, n = 0;
+	uint32_t h = 2166136261u;
+	const char *s;
+
+	prims = malloc(toplevel->tab->count * sizeof(*prims));
+	builtin = malloc((toplevel->tab->count + 4) * sizeof(sexp_t*));
+	if (!prims || !builtin) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < toplevel->tab->size; i++)
+		for (b = toplevel->tab->slot[i]; b; b = b->next)
+			if (b->val && (isprim(b->val) || isspec(b->val))) {
+				prims[n].name = get_symname(b->sym);
+				prims[n++].val = b->val;
+			}
+	qsort(prims, n, sizeof(*prims), by_name);
+
+	builtin[nbuiltins++] = nil;
+	builtin[nbuiltins++] = t;
+	builtin[nbuiltins++] = dot;
+	builtin[nbuiltins++] = (sexp_t*)toplevel;
+	for (i = 0; i < n; i++) {
+		builtin[nbuiltins++] = prims[i].val;
+		for (s = prims[i].name; *s; s++)
+			h = (h ^ (unsigned char)*s) * 16777619u;
+		h = (h ^ isspec(prims[i].val)) * 16777619u;
+	}
+	builtins_hash = h;
+	free(prims);
+}
+
+/*
+ * Writing
+ */
+
+struct entry {
+	sexp_t *obj;
+	size_t index;
+};
+
+struct writer {
+	sexp_t **objs;		/* in the order they were found */
+	size_t nobjs, objs_size;
+	struct entry *map;	/* object to index */
+	size_t map_size, map_count;
+	char *data;
+	size_t len, size;
+	int fail;
+};
+
+#define map_hash(p)	((size_t)(((PTRT)(p) >> 3) * 0x9E3779B1u))
+
+static void *grow(void *p, size_t *size, size_t need, size_t elem)
+{
+	if (need <= *size)
+		return p;
+	while (*size < need)
+		*size = *size ? 2 * *size : 1024;
+	if (!(p = realloc(p, *size * elem))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* The map entry of x, or the free one it would go in */
+static size_t map_find(struct writer *w, sexp_t *x)
+{
+	size_t i, mask = w->map_size - 1;
+
+	for (i = map_hash(x) & mask; w->map[i].obj; i = (i+1) & mask)
+		if (w->map[i].obj == x)
+			break;
+	return i;
+}
+
+static void map_add(struct writer *w, sexp_t *x, size_t index)
+{
+	size_t i, old_size = w->map_size;
+	struct entry *old = w->map;
+
+	if (2 * (w->map_count + 1) > w->map_size) {
+		w->map_size = old_size ? 2 * old_size : 1024;
+		if (!(w->map = calloc(w->map_size, sizeof(*w->map)))) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+		for (i = 0; i < old_size; i++)
+			if (old[i].obj)
+				w->map[map_find(w, old[i].obj)] = old[i];
+		free(old);
+	}
+	i = map_find(w, x);
+	w->map[i].obj = x;
+	w->map[i].index = index;
+	w->map_count++;
+}
+
+/* Queues x to be written, unless it is known already */
+static void visit(struct writer *w, sexp_t *x)
+{
+	if (!x || isfixnum(x) || w->map[map_find(w, x)].obj)
+		return;
+	if (isprim(x) || isspec(x)) {
+		fprintf(stderr, "error: cannot save a primitive not made "
+				"by init\n");
+		w->fail = 1;
+		return;
+	}
+	w->objs = grow(w->objs, &w->objs_size, w->nobjs + 1, sizeof(sexp_t*));
+	map_add(w, x, nbuiltins + w->nobjs);
+	w->objs[w->nobjs++] = x;
+}
+
+static uint64_t ref(struct writer *w, sexp_t *x)
+{
+	if (!x)
+		return 0;
+	if (isfixnum(x))
+		return (uint64_t)(int64_t)fixnum_val(x) << 1 | 1;
+	return (uint64_t)(w->map[map_find(w, x)].index + 1) << 1;
+}
+
+/* Appends n bytes to the data, 8 byte aligned, returns their offset */
+static uint64_t put(struct writer *w, const void *p, size_t n)
+{
+	size_t off = w->len;
+
+	w->data = grow(w->data, &w->size, off + n + 8, 1);
+	memcpy(w->data + off, p, n);
+	w->len = (off + n + 7) & ~(size_t)7;
+	memset(w->data + off + n, 0, w->len - off - n);
+	return off;
+}
+
+static uint64_t put_refs(struct writer *w, struct image_obj *o,
+			 sexp_t **v, size_t n, sexp_t *x, sexp_t *y)
+{
+	uint64_t r[2], off;
+	size_t i;
+
+	r[0] = ref(w, x);
+	r[1] = ref(w, y);
+	off = put(w, r, sizeof(r));
+	for (i = 0; i < n; i++) {
+		r[0] = ref(w, v[i]);
+		put(w, r, sizeof(r[0]));
+	}
+	o->n = n;
+	return off;
+}
+
+/* The children of x, to be visited */
+static void visit_fields(struct writer *w, sexp_t *x)
+{
+	code_t *code;
+	env_t *env;
+	size_t i;
+
+	switch (type(x)) {
+	case CONS:
+	case LAMBDA:
+	case MACRO:
+	case CLOSURE:
+		visit(w, car(x));
+		visit(w, cdr(x));
+		break;
+	case LREF:
+	case GREF:
+	case PARAMS:
+		visit(w, car(x));
+		break;
+	case CODE:
+		code = (code_t*)x;
+		visit(w, code->src);
+		for (i = 0; i < code->nconsts; i++)
+			visit(w, code->consts[i]);
+		break;
+	case ENV:
+		env = (env_t*)x;
+		visit(w, env->params);
+		visit(w, (sexp_t*)env->par);
+		for (i = 0; i < env->size; i++)
+			visit(w, env->vals[i]);
+		break;
+	case VECTOR:
+		for (i = 0; i < vector_len(x); i++)
+			visit(w, vector_elems(x)[i]);
+		break;
+	}
+}
+
+static void write_obj(struct writer *w, sexp_t *x, struct image_obj *o)
+{
+	union { double f; uint64_t i; } bits;
+	code_t *code;
+	env_t *env;
+
+	memset(o, 0, sizeof(*o));
+	o->type = type(x);
+	switch (o->type) {
+	case INT:
+		o->a = (uint64_t)(int64_t)get_int(x);
+		break;
+	case FLOAT:
+		bits.f = get_float(x);
+		o->a = bits.i;
+		break;
+	case BIG:
+		o->flag = ((struct bignum*)x)->neg;
+		o->n = ((struct bignum*)x)->len;
+		o->a = put(w, ((struct bignum*)x)->limb, o->n * sizeof(uint32_t));
+		break;
+	case SYM:
+		o->n = strlen(get_symname(x));
+		o->a = put(w, get_symname(x), o->n);
+		break;
+	case STRING:
+		o->n = string_len(x);
+		o->a = put(w, string_chars(x), o->n);
+		break;
+	case VECTOR:
+		o->a = put_refs(w, o, vector_elems(x), vector_len(x), NULL,
+				NULL);
+		break;
+	case CONS:
+	case LAMBDA:
+	case MACRO:
+	case CLOSURE:
+		o->a = ref(w, car(x));
+		o->b = ref(w, cdr(x));
+		break;
+	case LREF:
+	case PARAMS:
+		o->a = ref(w, car(x));
+		o->b = (PTRT)cdr(x);
+		break;
+	case GREF:
+		o->a = ref(w, car(x));
+		break;
+	case CODE:
+		code = (code_t*)x;
+		o->flag = code->rest;
+		o->nparams = code->nparams;
+		o->b = (uint64_t)code->maxstack << 32 | code_size(code);
+		o->a = put_refs(w, o, code->consts, code->nconsts, code->src,
+				NULL);
+		put(w, code->ops, o->b & 0xFFFFFFFF);
+		break;
+	case ENV:
+		env = (env_t*)x;
+		o->a = put_refs(w, o, env->vals, env->size, env->params,
+				(sexp_t*)env->par);
+		break;
+	default:
+		fprintf(stderr, "error: cannot save an object of type %d\n",
+			o->type);
+		w->fail = 1;
+	}
+}
+
+/* Writes the toplevel to path, returns 0 on success */
+int image_save(const char *path)
+{
+	struct writer w;
+	struct image_header h;
+	struct image_obj *recs;
+	struct binding *b;
+	uint64_t *binds;
+	size_t i, nbinds = 0;
+	FILE *f;
+	int ret = -1;
+
+	memset(&w, 0, sizeof(w));
+	for (i = 0; i < nbuiltins; i++)
+		map_add(&w, builtin[i], i);
+	for (i = 0; i < toplevel->tab->size; i++)
+		for (b = toplevel->tab->slot[i]; b; b = b->next)
+			if (b->val) {
+				visit(&w, b->sym);
+				visit(&w, b->val);
+				nbinds++;
+			}
+	for (i = 0; i < w.nobjs && !w.fail; i++)
+		visit_fields(&w, w.objs[i]);
+
+	recs = malloc(w.nobjs * sizeof(*recs) + 1);
+	binds = malloc(2 * nbinds * sizeof(*binds) + 1);
+	if (!recs || !binds) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < w.nobjs && !w.fail; i++)
+		write_obj(&w, w.objs[i], &recs[i]);
+	nbinds = 0;
+	for (i = 0; i < toplevel->tab->size; i++)
+		for (b = toplevel->tab->slot[i]; b; b = b->next)
+			if (b->val) {
+				binds[nbinds++] = ref(&w, b->sym);
+				binds[nbinds++] = ref(&w, b->val);
+			}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+	h.version = IMAGE_VERSION;
+	h.word = sizeof(void*);
+	h.builtins = builtins_hash;
+	h.nbuiltins = nbuiltins;
+	h.nobjs = w.nobjs;
+	h.nbinds = nbinds / 2;
+	h.size = w.len;
+
+	if (w.fail)
+		;
+	else if (!(f = fopen(path, "wb")))
+		fprintf(stderr, "error: could not open %s\n", path);
+	else {
+		if (fwrite(&h, sizeof(h), 1, f) == 1 &&
+		    fwrite(recs, sizeof(*recs), w.nobjs, f) == w.nobjs &&
+		    fwrite(binds, sizeof(*binds), nbinds, f) == nbinds &&
+		    fwrite(w.data, 1, w.len, f) == w.len)
+			ret = 0;
+		if (fclose(f) || ret)
+			fprintf(stderr, "error: could not write %s\n", path);
+	}
+	free(recs);
+	free(binds);
+	free(w.objs);
+	free(w.map);
+	free(w.data);
+	return ret;
+}
+
+/*
+ * Loading
+ */
+
+struct loader {
+	const struct image_obj *recs;
+	const char *data;
+	uint64_t size;
+	sexp_t **objs;		/* builtins first */
+	size_t total;
+	int fail;
+};
+
+static sexp_t *deref(struct loader *l, uint64_t r)
+{
+	if (!r)
+		return NULL;
+	if (r & 1)
+		return fixnum((int64_t)r >> 1);
+	if ((r >> 1) - 1 >= l->total) {
+		l->fail = 1;
+		return NULL;
+	}
+	return l->objs[(r >> 1) - 1];
+}
+
+/* n bytes of data at off, NULL if they are not all in the file */
+static const void *at(struct loader *l, uint64_t off, uint64_t n)
+{
+	if (off > l->size || n > l->size - off) {
+		l->fail = 1;
+		return NULL;
+	}
+	return l->data + off;
+}
+
+/* Makes the object of a record, its fields left to fill_obj */
+static sexp_t *make_obj(struct loader *l, const struct image_obj *o)
+{
+	union { double f; uint64_t i; } bits;
+	const uint64_t *refs;
+	const char *p;
+	code_t *code;
+
+	switch (o->type) {
+	case INT:
+		return int_((int32_t)o->a);
+	case FLOAT:
+		bits.i = o->a;
+		return float_(bits.f);
+	case BIG:
+		if (!(p = at(l, o->a, (uint64_t)o->n * sizeof(uint32_t))))
+			return NULL;
+		return big_from_limbs((const uint32_t*)p, o->n, o->flag);
+	case SYM:
+		if (!(p = at(l, o->a, o->n)))
+			return NULL;
+		return find_symboln(p, o->n);
+	case STRING:
+		if (!(p = at(l, o->a, o->n)))
+			return NULL;
+		return new_string(p, o->n);
+	case VECTOR:
+		if (!at(l, o->a, (2 + (uint64_t)o->n) * sizeof(uint64_t)))
+			return NULL;
+		return new_vector(o->n, NULL);
+	case CONS:
+		return cons(NULL, NULL);
+	case LAMBDA:
+	case MACRO:
+	case CLOSURE:
+	case GREF:
+		return new_sexp(o->type, NULL, NULL);
+	case LREF:
+	case PARAMS:
+		return new_sexp(o->type, NULL, (void*)(PTRT)o->b);
+	case CODE:
+		refs = at(l, o->a, (2 + (uint64_t)o->n) * sizeof(uint64_t));
+		p = at(l, o->a + (2 + (uint64_t)o->n) * sizeof(uint64_t),
+		       o->b & 0xFFFFFFFF);
+		if (!refs || !p)
+			return NULL;
+		code = gc_alloc(CODE, sizeof(code_t));
+		code->rest = o->flag;
+		code->nparams = o->nparams;
+		code->maxstack = o->b >> 32;
+		code->nconsts = o->n;
+		code->ops = malloc(o->b & 0xFFFFFFFF);
+		code->consts = calloc(o->n ? o->n : 1, sizeof(sexp_t*));
+		code->src = NULL;
+		if (!code->ops || !code->consts) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+		memcpy(code->ops, p, o->b & 0xFFFFFFFF);
+		return (sexp_t*)code;
+	case ENV:
+		if (!at(l, o->a, (2 + (uint64_t)o->n) * sizeof(uint64_t)))
+			return NULL;
+		/* a parent for now: only the toplevel has none */
+		return (sexp_t*)new_env(toplevel, NULL, o->n);
+	}
+	l->fail = 1;
+	return NULL;
+}
+
+static void fill_obj(struct loader *l, const struct image_obj *o, sexp_t *x)
+{
+	const uint64_t *refs;
+	code_t *code;
+	env_t *env;
+	size_t i;
+
+	switch (o->type) {
+	case CONS:
+	case LAMBDA:
+	case MACRO:
+	case CLOSURE:
+		set_car(x, deref(l, o->a));
+		set_cdr(x, deref(l, o->b));
+		break;
+	case LREF:
+	case PARAMS:
+		set_car(x, deref(l, o->a));
+		break;
+	case GREF:
+		set_car(x, deref(l, o->a));
+		if (!car(x) || !issym(car(x))) {
+			l->fail = 1;
+			break;
+		}
+		x->cdr = (sexp_t*)env_slot(toplevel, car(x));
+		break;
+	case CODE:
+		code = (code_t*)x;
+		refs = (const uint64_t*)(l->data + o->a);
+		code->src = deref(l, refs[0]);
+		gc_write(x, code->src);
+		for (i = 0; i < o->n; i++) {
+			code->consts[i] = deref(l, refs[2 + i]);
+			gc_write(x, code->consts[i]);
+		}
+		break;
+	case ENV:
+		env = (env_t*)x;
+		refs = (const uint64_t*)(l->data + o->a);
+		env->params = deref(l, refs[0]);
+		env->par = (env_t*)deref(l, refs[1]);
+		if (!env->par || type(env->par) != ENV) {
+			env->par = toplevel;
+			l->fail = 1;
+		}
+		gc_write(x, env->params);
+		gc_write(x, (sexp_t*)env->par);
+		for (i = 0; i < o->n; i++) {
+			env->vals[i] = deref(l, refs[2 + i]);
+			gc_write(x, env->vals[i]);
+		}
+		break;
+	case VECTOR:
+		refs = (const uint64_t*)(l->data + o->a);
+		for (i = 0; i < o->n; i++) {
+			vector_elems(x)[i] = deref(l, refs[2 + i]);
+			gc_write(x, vector_elems(x)[i]);
+		}
+		break;
+	}
+}
+
+/* Binds the toplevel as saved in the image at path, 0 on success */
+int image_load(const char *path)
+{
+	const struct image_header *h;
+	const uint64_t *binds;
+	struct loader l;
+	struct stat st;
+	sexp_t *sym;
+	void *map = MAP_FAILED;
+	size_t i, head;
+	int fd;
+	gc_frame();
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "error: could not open %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*h))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	h = map;
+	if (map == MAP_FAILED || memcmp(h->magic, IMAGE_MAGIC, 8) ||
+	    h->version != IMAGE_VERSION || h->word != sizeof(void*)) {
+		fprintf(stderr, "error: %s is not an image\n", path);
+		goto unmap;
+	}
+	if (h->builtins != builtins_hash || h->nbuiltins != nbuiltins) {
+		fprintf(stderr, "error: %s was saved by another build\n", path);
+		goto unmap;
+	}
+	head = sizeof(*h) + h->nobjs * sizeof(struct image_obj) +
+		h->nbinds * 2 * sizeof(uint64_t);
+	if (h->nobjs > (size_t)st.st_size || h->nbinds > (size_t)st.st_size ||
+	    head > (size_t)st.st_size || h->size != st.st_size - head) {
+		fprintf(stderr, "error: %s is truncated\n", path);
+		goto unmap;
+	}
+
+	l.recs = (const struct image_obj*)(h + 1);
+	binds = (const uint64_t*)(l.recs + h->nobjs);
+	l.data = (const char*)map + head;
+	l.size = h->size;
+	l.total = nbuiltins + h->nobjs;
+	l.fail = 0;
+	if (!(l.objs = calloc(l.total, sizeof(sexp_t*)))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	memcpy(l.objs, builtin, nbuiltins * sizeof(sexp_t*));
+
+	/* every object is a root until the bindings hold them */
+	gc_reserve((ptrdiff_t)h->nobjs);
+	for (i = nbuiltins; i < l.total; i++)
+		*gc_sp++ = &l.objs[i];
+	for (i = 0; i < h->nobjs && !l.fail; i++)
+		l.objs[nbuiltins + i] = make_obj(&l, &l.recs[i]);
+	for (i = 0; i < h->nobjs && !l.fail; i++)
+		fill_obj(&l, &l.recs[i], l.objs[nbuiltins + i]);
+	for (i = 0; i < h->nbinds && !l.fail; i++) {
+		sym = deref(&l, binds[2*i]);
+		if (!sym || !issym(sym))
+			l.fail = 1;
+		else
+			env_bind(toplevel, sym, deref(&l, binds[2*i + 1]));
+	}
+	gc_popn(h->nobjs);
+	free(l.objs);
+	if (l.fail)
+		fprintf(stderr, "error: %s is corrupt\n", path);
+	munmap(map, st.st_size);
+	return l.fail ? -1 : 0;
+
+unmap:
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	return -1;
+}
@@ -1,480 +1,996 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <stddef.h>
 #include "lisp.h"
 
-#define MAXLEN 512
-
-union float_int_conv float_int;
-
 env_t *toplevel;
+struct reader *std_in;
 sexp_t *nil, *t, *dot;
 
-//sexp_t *new_sexp(uint8_t type, uint64_t data)
-sexp_t *new_sexp(uint8_t type, DATAT data)
+static void *xmalloc(size_t n)
 {
-	sexp_t *e;
-	e = gc_alloc(sizeof(sexp_t));
-	e->type = type;
-	e->data= data;
-	return e;
+	void *p;
+	if (!(p = malloc(n ? n : 1))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* A vector of len elements, all fill, which the caller keeps rooted */
+sexp_t *new_vector(size_t len, sexp_t *fill)
+{
+	struct vector *v;
+	sexp_t **elems;
+	size_t i;
+
+	elems = xmalloc(len * sizeof(sexp_t*));
+	for (i = 0; i < len; i++)
+		elems[i] = fill;
+	gc_charge(len * sizeof(sexp_t*));
+	v = gc_alloc(VECTOR, sizeof(struct vector));
+	v->len = len;
+	v->elems = elems;
+	return (sexp_t*)v;
+}
+
+/* A string of a copy of the len bytes at s, or of len to fill in */
+sexp_t *new_string(const char *s, size_t len)
+{
+	struct string *str;
+	char *p;
+
+	p = xmalloc(len + 1);
+	if (s)
+		memcpy(p, s, len);
+	p[len] = '\0';
+	gc_charge(len + 1);
+	str = gc_alloc(STRING, sizeof(struct string));
+	str->len = len;
+	str->chars = p;
+	return (sexp_t*)str;
 }
 
 /*
  * Environment
+ *
+ * A call frame is an array of values, one slot per symbol of the
+ * lambda list it was built for; code analyzed by analyze_lambda reads
+ * the slots by position.  Bindings are also found by symbol, compared
+ * by pointer, for code that was not analyzed.  The parentless toplevel
+ * environment keeps its bindings in a hash table indexed by the
+ * symbol's hash.
  */
 
-env_t *new_env(env_t *par)
+#define BINDTAB_SIZE	64
+
+static struct bindtab *new_bindtab(size_t size)
+{
+	struct bindtab *tab;
+	tab = calloc(1, sizeof(*tab) + size * sizeof(tab->slot[0]));
+	if (!tab) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	tab->size = size;
+	return tab;
+}
+
+/* A frame of size slots named by params, or toplevel when par is NULL */
+env_t *new_env(env_t *par, sexp_t *params, unsigned size)
 {
 	env_t *env;
-	env = gc_alloc(sizeof(env_t));
-	env->type = ENV;
+	env = gc_alloc(ENV, sizeof(env_t));
+	env->size = size;
 	env->par = par;
-	env->first = NULL;
+	env->params = params;
+	if (!par)
+		env->tab = new_bindtab(BINDTAB_SIZE);
+	else if (!(env->vals = size ? calloc(size, sizeof(sexp_t*)) : NULL) &&
+		 size) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
 	return env;
 }
 
 void env_clear(env_t *env)
 {
 	struct binding *b, *next;
-	for (b = env->first; b; b = next) {
-		free(b->var);
-		next = b->next;
-		free(b);
+	size_t i;
+
+	if (env->par) {
+		free(env->vals);
+		return;
 	}
+	for (i = 0; i < env->tab->size; i++)
+		for (b = env->tab->slot[i]; b; b = next) {
+			next = b->next;
+			free(b);
+		}
+	free(env->tab);
 }
 
-/* TODO: this is slow */
-sexp_t *env_look_up(env_t *env, sexp_t *sym)
+/* Slot of sym in a lambda list, the last one if it appears twice */
+int param_index(sexp_t *params, sexp_t *sym)
+{
+	int i, found = -1;
+	for (i = 0; iscons(params); params = cdr(params), i++)
+		if (car(params) == sym)
+			found = i;
+	return params == sym ? i : found;
+}
+
+#define bindtab_chain(tab, sym) \
+	((tab)->slot[get_symhash(sym) & ((tab)->size-1)])
+
+/* Global binding of sym, if any */
+struct binding *env_global(env_t *env, sexp_t *sym)
 {
 	struct binding *b;
-	for (b = env->first; b; b = b->next)
-		if (strcmp(get_symname(sym), b->var) == 0)
-			return b->val;
-	if (env->par)
-		return env_look_up(env->par, sym);
-	fprintf(stderr, "error: symbol %s not bound.\n", get_symname(sym));
+	while (env->par)
+		env = env->par;
+	for (b = bindtab_chain(env->tab, sym); b; b = b->next)
+		if (b->sym == sym)
+			return b;
 	return NULL;
 }
 
-void env_bind(env_t *env, char *var, sexp_t *val)
+/* Finds the slot holding sym, NULL if unbound */
+sexp_t **env_find(env_t *env, sexp_t *sym)
 {
-	struct binding *b = malloc(sizeof(struct binding));
-	b->var = strdup(var);
-	b->val = val;
-	b->next = env->first;
-	env->first = b;
+	struct binding *b;
+	int i;
+
+	for (; env->par; env = env->par)
+		if ((i = param_index(env->params, sym)) >= 0)
+			return &env->vals[i];
+	if ((b = env_global(env, sym)) && b->val)
+		return &b->val;
+	return NULL;
 }
 
-void env_set(env_t *env, char *var, sexp_t *val)
+sexp_t *env_look_up(env_t *env, sexp_t *sym)
 {
-	struct binding *b;
-	for (b = env->first; b; b = b->next)
-		if (strcmp(var, b->var) == 0) {
-			b->val = val;
-			return;
+	sexp_t **slot;
+	if ((slot = env_find(env, sym)))
+		return *slot;
+	fprintf(stderr, "error: symbol %s not bound.\n", get_symname(sym));
+	return NULL;
+}
+
+static void bindtab_grow(struct bindtab **tabp)
+{
+	struct bindtab *old = *tabp, *tab;
+	struct binding *b, *next;
+	size_t i;
+
+	tab = new_bindtab(2*old->size);
+	for (i = 0; i < old->size; i++)
+		for (b = old->slot[i]; b; b = next) {
+			next = b->next;
+			b->next = bindtab_chain(tab, b->sym);
+			bindtab_chain(tab, b->sym) = b;
 		}
-	if (env->par)
-		env_set(env->par, var, val);
+	tab->count = old->count;
+	free(old);
+	*tabp = tab;
 }
 
 /*
- * Symbol list
+ * Returns the global binding of sym, creating an unbound one if there
+ * is none: analyzed code refers to globals through these and they
+ * stay put for as long as the toplevel environment lives.
  */
+struct binding *env_slot(env_t *env, sexp_t *sym)
+{
+	struct binding *b;
 
-sexp_t *symlist;
+	while (env->par)
+		env = env->par;
+	if ((b = env_global(env, sym)))
+		return b;
+	if (++env->tab->count > env->tab->size)
+		bindtab_grow(&env->tab);
+	b = malloc(sizeof(struct binding));
+	b->sym = sym;
+	b->val = NULL;
+	b->next = bindtab_chain(env->tab, sym);
+	bindtab_chain(env->tab, sym) = b;
+	gc_write((sexp_t*)env, sym);
+	return b;
+}
 
-/* TODO: this is slow */
-sexp_t *find_symbol(const char *s)
+/* Binds sym globally, replacing any previous binding */
+void env_bind(env_t *env, sexp_t *sym, sexp_t *val)
 {
-	sexp_t *sym;
-	sexp_t *tmp;
-	for (sym = symlist; sym != nil; sym = cdr(sym))
-		if (strcmp(s, get_symname(car(sym))) == 0)
-			return car(sym);
-
-	tmp = new_sexp(SYM, make_cons(strdup(s), NULL));
-	gc_push(&tmp);
-	symlist = cons(tmp, symlist);
-	gc_pop();
-	return car(symlist);
+	while (env->par)
+		env = env->par;
+	env_slot(env, sym)->val = val;
+	gc_write((sexp_t*)env, val);
+}
+
+void env_define(env_t *env, const char *name, sexp_t *val)
+{
+	sexp_t *sym = NULL;
+	gc_frame();
+	gc_push2(&val, &sym);
+	sym = find_symbol(name);
+	env_bind(env, sym, val);
+	gc_popn(2);
+}
+
+void env_set(env_t *env, sexp_t *sym, sexp_t *val)
+{
+	sexp_t **slot;
+	env_t *owner;
+	int i;
+
+	for (owner = env; owner->par; owner = owner->par)
+		if ((i = param_index(owner->params, sym)) >= 0)
+			break;
+	if ((slot = env_find(env, sym))) {
+		*slot = val;
+		gc_write((sexp_t*)owner, val);
+	}
 }
 
 /*
- * Print
+ * Symbol table
+ *
+ * Symbols are interned in an open-addressing hash table, probed
+ * linearly and keyed by a hash of the name kept in the symbol's cdr.
+ * The table does not keep its symbols alive: the sweep hands every
+ * dead one to symbol_free.  Names are copied into aligned chunks that
+ * count the live names they hold and are released when that count
+ * drops to zero.
  */
 
-void print_atom(sexp_t *atm, FILE *out)
+#define SYM_CHUNK	(1 << 16)
+#define SYM_DELETED	((sexp_t*)&symtab)
+
+struct sym_chunk {
+	size_t live;
+	size_t used;
+	size_t size;
+};
+
+#define chunk_of(name) \
+	((struct sym_chunk*)((uintptr_t)(name) & ~(uintptr_t)(SYM_CHUNK-1)))
+
+static struct sym_chunk *sym_cur;
+static sexp_t **symtab;
+static size_t symtab_size, symtab_count, symtab_used;
+
+static uint32_t hash_name(const char *s, size_t len)
 {
-	if (atm == nil)
-		fprintf(out, "nil");
-	else if (atm == t)
-		fprintf(out, "t");
-	else
-		switch (type(atm)) {
-		case INT:
-			fprintf(out, "%d", get_int(atm));
-			break;
-		case FLOAT:
-			fprintf(out, "%lf", get_float(atm));
-			break;
-		case SYM:
-			fprintf(out, "%s", (char*)car(atm));
-			break;
-		case LAMBDA:
-			fprintf(out, "<#Lambda ");
-			print_sexp(proc_params(atm), out);
-			putc(' ', out);
-			print_sexp(proc_body(atm), out);
-			fprintf(out, ">");
-			break;
-		case MACRO:
-			fprintf(out, "<#Macro ");
-			print_sexp(proc_params(atm), out);
-			putc(' ', out);
-			print_sexp(proc_body(atm), out);
-			fprintf(out, ">");
-			break;
-		case PRIM:
-			fprintf(out, "<#Primitive %p>", get_prim(atm));
-			break;
-		case SPEC:
-			fprintf(out, "<#Specialform %p>", get_prim(atm));
-			break;
-		}
+	uint32_t h = 2166136261u;
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
 }
 
-void print_sexp(sexp_t *exp, FILE *out)
+static char *new_name(const char *s, size_t len)
 {
-	if (type(exp) == ENV)
-		fprintf(out, "<#Environment %p>", exp);
-	if (isatom(exp)) {
-		print_atom(exp, out);
-	} else {
-		putc('(', out);
-		for (; exp != nil && iscons(exp); exp = cdr(exp)) {
-			print_sexp(car(exp), out);
-			if (!isnil(cdr(exp))) {
-				putc(' ', out);
-				if (!iscons(cdr(exp))) {
-					fprintf(out, ". ");
-					print_sexp(cdr(exp), out);
-				}
-			}
+	struct sym_chunk *c = sym_cur;
+	size_t size;
+	char *name;
+
+	if (!c || c->used + len+1 > c->size) {
+		size = (sizeof(*c) + len+1 + SYM_CHUNK-1) & ~(size_t)(SYM_CHUNK-1);
+		if (!(c = aligned_alloc(SYM_CHUNK, size))) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+		c->live = 0;
+		c->used = sizeof(*c);
+		c->size = size;
+		/* names longer than a chunk get one of their own */
+		if (size == SYM_CHUNK) {
+			if (sym_cur && sym_cur->live == 0)
+				free(sym_cur);
+			sym_cur = c;
 		}
-		putc(')', out);
 	}
+	name = (char*)c + c->used;
+	memcpy(name, s, len);
+	name[len] = '\0';
+	c->used += len+1;
+	c->live++;
+	return name;
 }
 
-/*
- * Read
- */
+static void symtab_resize(void)
+{
+	sexp_t **old = symtab;
+	size_t i, j, oldsize = symtab_size;
+
+	for (symtab_size = 1024; symtab_size < 4*symtab_count; )
+		symtab_size *= 2;
+	symtab = calloc(symtab_size, sizeof(*symtab));
+	if (!symtab) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i] || old[i] == SYM_DELETED)
+			continue;
+		for (j = get_symhash(old[i]) & (symtab_size-1); symtab[j];
+		     j = (j+1) & (symtab_size-1))
+			;
+		symtab[j] = old[i];
+	}
+	symtab_used = symtab_count;
+	free(old);
+}
 
-int nextchar(FILE *in)
+sexp_t *find_symboln(const char *s, size_t len)
 {
-	int c;
-	c = getc(in);
-	if (c == ';') {
-		while ((c = getc(in)) != '\n');
-		c = nextchar(in);
+	uint32_t h = hash_name(s, len);
+	size_t i, mask, slot = (size_t)-1;
+	sexp_t *sym;
+
+	if (2*(symtab_used+1) > symtab_size)
+		symtab_resize();
+	mask = symtab_size - 1;
+	for (i = h & mask; (sym = symtab[i]); i = (i+1) & mask) {
+		if (sym == SYM_DELETED) {
+			if (slot == (size_t)-1)
+				slot = i;
+		} else if (get_symhash(sym) == h &&
+			   strncmp(get_symname(sym), s, len) == 0 &&
+			   get_symname(sym)[len] == '\0')
+			return sym;
+	}
+	if (slot == (size_t)-1) {
+		slot = i;
+		symtab_used++;
 	}
-	if (isspace(c))
-		c = ' ';
-	return c;
+	/* a collection here only turns slots into SYM_DELETED */
+	sym = new_sexp(SYM, new_name(s, len), (void*)(PTRT)h);
+	symtab[slot] = sym;
+	symtab_count++;
+	return sym;
 }
 
-int nextcharsp(FILE *in)
+sexp_t *find_symbol(const char *s)
 {
-	int c;
-	while ((c = nextchar(in)) == ' ');
-	return c;
+	return find_symboln(s, strlen(s));
 }
 
-/* Reads int, float or symbol */
-sexp_t *read_atom(const char *buf)
+/* Called by the sweep for every dead symbol */
+void symbol_free(sexp_t *sym)
 {
-	char c;
-	const char *s = buf;
-	int i = 0;	// integer part
-	double f = 0.0;	// fractional part
-	int base = 10;
-	double div = base;
-	int exp = 0;
-	int haveexp = 0;
-	int expsign = 1;
-	int havenum = 0;
-	int sign = 1;
-	int type = INT;
+	struct sym_chunk *c = chunk_of(get_symname(sym));
+	size_t i, mask = symtab_size - 1;
 
-	if ((c = *s++) == '-')
-		sign = -1;
-	else if (c == '+')
+	for (i = get_symhash(sym) & mask; symtab[i] != sym; i = (i+1) & mask)
 		;
-	else
-		s--;
-
-	while ((c = *s++)) {
-		if (isdigit(c) && (type == INT || type == FLOAT)) {
-			havenum = 1;
-			if (type == INT)	// integer part
-				i = i*base + c-'0';
-			else {			// fractional part
-				f += (c-'0')/div;
-				div *= base;
-			}
-		} else if (c == '.' && type != FLOAT) {
-			type = FLOAT;
-		} else if (c == 'e' && !haveexp && havenum) {
-			havenum = 0;
-			haveexp = 1;
-			type = FLOAT;
-			if ((c = *s++) == '-')
-				expsign = -1;
-			else if (c == '+')
-				;
-			else
-				s--;
-			for (c = *s++; isdigit(c); c = *s++) {
-				exp = exp*10 + c-'0';
-				havenum = 1;
-			}
-			s--;
-		} else
-			return find_symbol(buf);
-	}
-	if (!havenum)
-		return find_symbol(buf);
-	if (type == INT)
-		return int_(i*sign);
-	f = sign*(i+f);
-	while (exp--)
-		f = (expsign > 0) ? f*10.0 : f/10.0;
-	return float_(f);
+	symtab[i] = SYM_DELETED;
+	symtab_count--;
+	if (--c->live == 0 && c != sym_cur)
+		free(c);
 }
 
-sexp_t *read_sexp(FILE *in)
+/*
+ * Analysis
+ *
+ * When a closure is made its body is rewritten once: every variable
+ * bound by an enclosing lambda list becomes an LREF holding the frame
+ * depth and slot index, every other variable a GREF pointing straight
+ * at its global binding.  The lambda list is wrapped in a PARAMS
+ * object carrying the frame size, which also marks the body as done
+ * so nested lambdas are not analyzed again when they are evaluated.
+ * Forms whose operator is a macro at analysis time are left alone, as
+ * are quoted and backquoted data and the names given to label and set;
+ * symbols there are looked up by name.  A call whose operator comes to
+ * hold a macro later is expanded from the form it was analyzed from,
+ * which the macro expansion cache keeps for every analyzed call.
+ */
+
+/* Number of slots a lambda list needs, -1 if it is malformed */
+int count_params(sexp_t *params)
 {
-	char buf[MAXLEN], *s = buf;
-	int c;
-	int havedot = 0;
-	sexp_t *last, *next, *ret;
+	int n;
+	for (n = 0; iscons(params); params = cdr(params), n++)
+		if (!issym(car(params)))
+			return -1;
+	if (params != nil && !issym(params))
+		return -1;
+	n += (params != nil);
+	return n <= LREF_MAX ? n : -1;
+}
 
-	if ((c = nextcharsp(in)) == EOF)
-		return NULL;
+/* Finds sym in scope and then in the frames of env */
+int scope_lookup(sexp_t *sym, struct scope *sc, env_t *env,
+		 unsigned *depth, int *index)
+{
+	*depth = 0;
+	for (; sc; sc = sc->up, (*depth)++)
+		if ((*index = param_index(sc->params, sym)) >= 0)
+			return 1;
+	for (; env->par; env = env->par, (*depth)++)
+		if ((*index = param_index(env->params, sym)) >= 0)
+			return 1;
+	return 0;
+}
 
-	if (c == '(') {
-		if ((c = nextcharsp(in)) == ')')
-			return nil;
-		ungetc(c, in);
-		next = read_sexp(in);
-		gc_push(&next);
-		if (next == dot) {
-			fprintf(stderr, "error: 'dot' not allowed at "
-					"beginning of list\n");
-			gc_pop();
-			return NULL;
-		}
-		ret = last = cons(next, nil);
-		gc_pop();
-		gc_push(&ret);
-		while ((c = nextcharsp(in)) != ')') {
-			ungetc(c, in);
-			next = read_sexp(in);
-			if (next == dot) {
-				havedot++;
-				continue;
-			}
-			if (havedot == 0) {
-				gc_push(&next);
-				last->data = make_cons(car(last),
-						       cons(next, nil));
-				gc_pop();
-				last = cdr(last);
-			} else if (havedot == 1) {
-				last->data = make_cons(car(last), next);
-				havedot++;
-			} else {
-				fprintf(stderr, "error: only one "
-				  "expression after 'dot' allowed\n");
-				gc_pop();
-				return NULL;
-			}
-		}
-		gc_pop();
-		return ret;
-	}
+static sexp_t *analyze(sexp_t *exp, struct scope *sc, env_t *env);
+static void macro_source(sexp_t *site, sexp_t *form);
 
-	if (c == ')') {
-		fprintf(stderr, "error: unexpected \')\'\n");
-		return NULL;
-	}
+static sexp_t *resolve(sexp_t *sym, struct scope *sc, env_t *env)
+{
+	unsigned depth;
+	int index;
 
-	if (c == '.') {
-		if ((c = nextchar(in)) == ' ')
-			return dot;
-		else {
-			ungetc(c, in);
-			c = '.';
-		}
+	if (scope_lookup(sym, sc, env, &depth, &index))
+		return depth <= LREF_MAX ? lref(sym, depth, index) : sym;
+	return gref(sym, env_slot(env, sym));
+}
+
+/* Analyzes every element of a list */
+static sexp_t *analyze_list(sexp_t *l, struct scope *sc, env_t *env)
+{
+	sexp_t *head = NULL, *tail = NULL;
+	gc_frame();
+	if (!iscons(l))
+		return l;
+	gc_push2(&head, &tail);
+	head = analyze(car(l), sc, env);
+	tail = analyze_list(cdr(l), sc, env);
+	tail = cons(head, tail);
+	gc_popn(2);
+	return tail;
+}
+
+/* Analyzes the clauses of a cond */
+static sexp_t *analyze_clauses(sexp_t *l, struct scope *sc, env_t *env)
+{
+	sexp_t *head = NULL, *tail = NULL;
+	gc_frame();
+	if (!iscons(l))
+		return l;
+	gc_push2(&head, &tail);
+	head = analyze_list(car(l), sc, env);
+	tail = analyze_clauses(cdr(l), sc, env);
+	tail = cons(head, tail);
+	gc_popn(2);
+	return tail;
+}
+
+/* Analyzes (params . body) of a lambda or macro made in scope */
+static sexp_t *analyze_body(sexp_t *args, struct scope *sc, env_t *env)
+{
+	sexp_t *body = NULL, *ret = NULL;
+	struct scope inner;
+	int n;
+	gc_frame();
+
+	if (type(car(args)) == PARAMS || (n = count_params(car(args))) < 0)
+		return args;
+	inner.params = car(args);
+	inner.up = sc;
+	gc_push2(&body, &ret);
+	body = analyze_list(cdr(args), &inner, env);
+	ret = params_(car(args), n);
+	ret = cons(ret, body);
+	gc_popn(2);
+	return ret;
+}
+
+static sexp_t *analyze(sexp_t *exp, struct scope *sc, env_t *env)
+{
+	sexp_t *op, *fn = NULL, *head = NULL, *tail = NULL;
+	struct binding *b;
+	sexp_t *(*f)();
+	unsigned depth;
+	int index;
+	gc_frame();
+
+	if (issym(exp))
+		return resolve(exp, sc, env);
+	if (!iscons(exp) || list_len(exp) < 0)
+		return exp;
+
+	op = car(exp);
+	if (issym(op) && !scope_lookup(op, sc, env, &depth, &index) &&
+	    (b = env_global(env, op)))
+		fn = b->val;
+	if (fn && type(fn) == MACRO)
+		return exp;
+	gc_push3(&exp, &head, &tail);
+	if (!fn || type(fn) != SPEC) {
+		tail = analyze_list(exp, sc, env);
+		macro_source(tail, exp);
+		gc_popn(3);
+		return tail;
 	}
 
-	if (c == '\'') {
-		next = read_sexp(in);
-		gc_push(&next);
-		next = cons(next, nil);
-		next = cons(find_symbol("quote"), next);
-		gc_pop();
-		return next;
+	f = get_prim(fn);
+	if ((f == (sexp_t *(*)())spec_lambda ||
+	     f == (sexp_t *(*)())spec_macro) && iscons(cdr(exp)))
+		tail = analyze_body(cdr(exp), sc, env);
+	else if (f == (sexp_t *(*)())spec_cond)
+		tail = analyze_clauses(cdr(exp), sc, env);
+	else if (f == (sexp_t *(*)())spec_and ||
+		 f == (sexp_t *(*)())spec_or ||
+		 f == (sexp_t *(*)())spec_setcar ||
+		 f == (sexp_t *(*)())spec_setcdr)
+		tail = analyze_list(cdr(exp), sc, env);
+	else if ((f == (sexp_t *(*)())spec_label ||
+		  f == (sexp_t *(*)())spec_set) && iscons(cdr(exp))) {
+		head = car(cdr(exp));
+		tail = analyze_list(cdr(cdr(exp)), sc, env);
+		tail = cons(head, tail);
+	} else {
+		gc_popn(3);
+		return exp;
 	}
+	head = resolve(op, sc, env);
+	tail = cons(head, tail);
+	macro_source(tail, exp);
+	gc_popn(3);
+	return tail;
+}
 
-	if (c == '`') {
-		next = read_sexp(in);
-		gc_push(&next);
-		next = cons(next, nil);
-		next = cons(find_symbol("backquote"), next);
-		gc_pop();
-		return next;
+/* Analyzes the (params . body) of a closure about to be made in env */
+sexp_t *analyze_lambda(sexp_t *args, env_t *env)
+{
+	return analyze_body(args, NULL, env);
+}
+
+/*
+ * Macro expansion cache
+ *
+ * A macro call is expanded the first time it is evaluated and the
+ * expansion is kept in a table keyed by the address of the calling
+ * form, together with the macro that made it.  Later evaluations of
+ * the same form reuse the expansion as long as its operator still
+ * names that macro, so redefining the macro with label or set makes
+ * them expand again.  Entries do not keep the calling form alive: the
+ * collector drops those whose form died, see macro_cache_gc.
+ *
+ * An analyzed call has LREF and GREF cells where its form had symbols,
+ * so it gets an entry when it is made, holding that form, and a macro
+ * its operator turns out to hold is expanded from the form.
+ *
+ * eval runs the expansion analyzed, like a lambda body, so the lambdas
+ * in it are not analyzed again each time they are made.  That code is
+ * kept in the entry too, with the lambda lists of the frames it was
+ * analyzed in; eval can reach a form under other frames, and then it
+ * is analyzed again for those.
+ */
+
+struct mcache_entry {
+	sexp_t *site;
+	sexp_t *source;		/* its unanalyzed form, or NULL */
+	sexp_t *macro;		/* NULL until site is expanded */
+	sexp_t *exp;
+	sexp_t *code;		/* exp analyzed, NULL until eval runs it */
+	sexp_t *frames;		/* params of the frames code is for */
+};
+
+static struct mcache_entry *mcache;
+static size_t mcache_size, mcache_count;
+unsigned long macro_cache_hits, macro_cache_misses;
+
+#define mcache_hash(site) \
+	((size_t)(((PTRT)(site) >> 4) * 0x9E3779B1u) & (mcache_size - 1))
+
+static struct mcache_entry *mcache_find(sexp_t *site)
+{
+	size_t i;
+	for (i = mcache_hash(site); mcache[i].site; i = (i+1) & (mcache_size-1))
+		if (mcache[i].site == site)
+			return &mcache[i];
+	return &mcache[i];
+}
+
+/* Rebuilds the table with room for n entries, keeping those of live sites */
+static void mcache_rehash(size_t n, int (*live)(sexp_t *))
+{
+	struct mcache_entry *old = mcache, *e;
+	size_t i, size = mcache_size;
+
+	for (mcache_size = 64; mcache_size < 2*n; mcache_size *= 2)
+		;
+	if (!(mcache = calloc(mcache_size, sizeof(*mcache)))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
 	}
+	mcache_count = 0;
+	for (i = 0; i < size; i++)
+		if (old[i].site && (!live || live(old[i].site))) {
+			e = mcache_find(old[i].site);
+			*e = old[i];
+			mcache_count++;
+		}
+	free(old);
+}
 
-	if (c == ',') {
-		if ((c = nextchar(in)) == '@') {
-			next = read_sexp(in);
-			gc_push(&next);
-			next = cons(next, nil);
-			next = cons(find_symbol("unquote-splice"), next);
-			gc_pop();
-			return next;
+/* Expansion of the macro call site, a call of mac */
+sexp_t *macro_expansion(sexp_t *site, sexp_t *mac)
+{
+	struct mcache_entry *e;
+	sexp_t *exp, *form = site;
+	gc_frame();
+
+	if (mcache && (e = mcache_find(site))->site) {
+		if (e->macro == mac) {
+			macro_cache_hits++;
+			return e->exp;
 		}
-		ungetc(c, in);
-		next = read_sexp(in);
-		gc_push(&next);
-		next = cons(next, nil);
-		next = cons(find_symbol("unquote"), next);
-		gc_pop();
-		return next;
+		if (e->source)
+			form = e->source;
 	}
+	macro_cache_misses++;
+	gc_push3(&site, &mac, &form);
+	exp = expand_macro(mac, cdr(form));
+	gc_popn(3);
+	if (!exp)
+		return NULL;
+	if (2*(mcache_count+1) > mcache_size)
+		mcache_rehash(mcache_count+1, NULL);
+	if (!(e = mcache_find(site))->site)
+		mcache_count++;
+	e->site = site;
+	e->macro = mac;
+	e->exp = exp;
+	e->code = NULL;
+	e->frames = NULL;
+	return exp;
+}
 
-	*s++ = c;
-	while ((c = nextchar(in)) != EOF &&
-	       c != ' ' && c != ')' && c != '(' /*&& c != '\''*/)
-		*s++ = c;
-	*s = '\0';
-	if (c)
-		ungetc(c, in);
-	return read_atom(buf);
+/* Remembers that site, an analyzed call, was made from form */
+static void macro_source(sexp_t *site, sexp_t *form)
+{
+	struct mcache_entry *e;
+
+	if (2*(mcache_count+1) > mcache_size)
+		mcache_rehash(mcache_count+1, NULL);
+	if (!(e = mcache_find(site))->site)
+		mcache_count++;
+	e->site = site;
+	e->source = form;
+}
+
+/* Whether frames lists the params of the frames of env, innermost first */
+static int same_frames(sexp_t *frames, env_t *env)
+{
+	for (; env->par; env = env->par, frames = cdr(frames))
+		if (!iscons(frames) || car(frames) != env->params)
+			return 0;
+	return frames == nil;
+}
+
+static sexp_t *frame_list(env_t *env)
+{
+	sexp_t *rest = NULL;
+	gc_frame();
+	if (!env->par)
+		return nil;
+	gc_push(&env);
+	rest = frame_list(env->par);
+	rest = cons(env->params, rest);
+	gc_pop();
+	return rest;
+}
+
+/* Expansion of the macro call site analyzed for evaluation in env */
+sexp_t *macro_code(sexp_t *site, sexp_t *mac, env_t *env)
+{
+	struct mcache_entry *e;
+	sexp_t *exp = NULL, *code = NULL, *frames = NULL;
+	gc_frame();
+
+	gc_push3(&site, &env, &exp);
+	gc_push2(&code, &frames);
+	if (!(exp = macro_expansion(site, mac))) {
+		gc_popn(5);
+		return NULL;
+	}
+	if ((e = mcache_find(site))->code && same_frames(e->frames, env)) {
+		gc_popn(5);
+		return e->code;
+	}
+	code = analyze(exp, NULL, env);
+	frames = frame_list(env);
+	/* the table may have been rebuilt while analyzing */
+	if ((e = mcache_find(site))->site && e->exp == exp) {
+		e->code = code;
+		e->frames = frames;
+	}
+	gc_popn(5);
+	return code;
+}
+
+/*
+ * Called by the collector once the roots are marked: marks what the
+ * entries of live call sites hold, until that revives no more sites,
+ * then forgets the entries of the sites about to be freed.
+ */
+void macro_cache_gc(int (*live)(sexp_t *), void (*mark)(sexp_t *))
+{
+	struct mcache_entry *e;
+	int again;
+
+	do {
+		again = 0;
+		for (e = mcache; e < mcache + mcache_size; e++)
+			if (e->site && live(e->site) &&
+			    (!live(e->source) || !live(e->macro) ||
+			     !live(e->exp) || !live(e->code) ||
+			     !live(e->frames))) {
+				mark(e->source);
+				mark(e->macro);
+				mark(e->exp);
+				mark(e->code);
+				mark(e->frames);
+				again = 1;
+			}
+	} while (again);
+	if (mcache)
+		mcache_rehash(mcache_count, live);
 }
 
 /*
  * Eval
  */
 
+/* Returns the expansion of a macro call, without evaluating it */
+sexp_t *expand_macro(sexp_t *mac, sexp_t *args)
+{
+	env_t *env;
+	sexp_t *ret;
+	gc_frame();
+	env = env_extend(proc_env(mac), proc_params(mac), args);
+	if (!env)
+		return NULL;
+	gc_push(&env);
+	ret = evblock(proc_body(mac), env);
+	gc_pop();
+	return ret;
+}
+
 env_t *env_extend(env_t *par, sexp_t *params, sexp_t *args)
 {
 	env_t *env;
+	int i, n;
 
-	if (list_len(params) >= 0 && list_len(params) != list_len(args)) {
+	if (type(params) == PARAMS) {
+		n = params_size(params);
+		params = params_list(params);
+	} else if ((n = count_params(params)) < 0) {
+		fprintf(stderr, "error: symbol expected\n");
+		return NULL;
+	}
+	if (list_len(params) >= 0 ? list_len(params) != list_len(args) :
+	    list_len(args) < n-1 && list_len(args) >= 0) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
 	}
 
-	env = new_env(par);
-	gc_push(&env);
-	for (; params != nil; params = cdr(params), args = cdr(args))
-		if (iscons(params)) {
-			if (!issym(car(params))) {
-				fprintf(stdout, "error: symbol expected\n");
-				gc_pop();
-				return NULL;
-			}
-			env_bind(env, get_symname(car(params)), car(args));
-		} else  {
-			if (!issym(params)) {
-				fprintf(stdout, "error: symbol expected\n");
-				gc_pop();
-				return NULL;
-			}
-			env_bind(env, get_symname(params), args);
-			break;
-		}
-	gc_pop();
+	env = new_env(par, params, n);
+	for (i = 0; iscons(params); params = cdr(params), args = cdr(args))
+		env->vals[i++] = car(args);
+	if (params != nil)
+		env->vals[i] = args;
 	return env;
 }
 
 sexp_t *apply(sexp_t *proc, sexp_t *args, env_t *env)
 {
+	sexp_t *ret = NULL;
+	size_t mark;
+	gc_frame();
+
+	mark = profile_call(proc);
 	switch (type(proc)) {
 	case PRIM:
 	case SPEC:
-		return (get_prim(proc))(args, env);
+		ret = (get_prim(proc))(args, env);
+		break;
 	case LAMBDA:
-	case MACRO:
 		env = env_extend(proc_env(proc), proc_params(proc), args);
+		if (!env)
+			break;
 		gc_push(&env);
-		proc = evblock(proc_body(proc), env, type(proc) == MACRO);
+		ret = evblock(proc_body(proc), env);
 		gc_pop();
-		return proc;
-	default:
-		return NULL;
+		break;
+	case MACRO:
+		gc_push(&env);
+		ret = expand_macro(proc, args);
+		if (mark)
+			profile_leave(mark);
+		mark = 0;
+		if (ret)
+			ret = eval(ret, env);
+		gc_pop();
+		break;
+	case CLOSURE:
+		ret = vm_apply(proc, args);
+		break;
 	}
+	if (mark)
+		profile_leave(mark);
+	return ret;
 }
 
-sexp_t *evblock(sexp_t *exp, env_t *env, int ismacro)
+sexp_t *evblock(sexp_t *exp, env_t *env)
 {
 	sexp_t *ret = NULL;
+	gc_frame();
 	gc_push(&ret);
-	for (; exp != nil; exp = cdr(exp)) {
+	for (; exp != nil; exp = cdr(exp))
 		ret = eval(car(exp), env);
-		if (ismacro)
-			ret = eval(ret, env);
-	}
 	gc_pop();
 	return ret;
 }
 
 sexp_t *evlis(sexp_t *args, env_t *env)
 {
-	sexp_t *e1, *e2;
+	sexp_t *e1 = NULL, *e2 = NULL;
+	gc_frame();
 	if (isnil(args))
 		return nil;
+	gc_push2(&e1, &e2);
 	e1 = eval(car(args), env);
-	gc_push(&e1);
 	e2 = evlis(cdr(args), env);
-	gc_push(&e2);
 	e1 = cons(e1, e2);
-	gc_pop();
-	gc_pop();
+	gc_popn(2);
 	return e1;
 }
 
+/*
+ * Calls in tail position, that is the last expression of a lambda body,
+ * the chosen branch of a cond, the last operand of and, or and progn,
+ * and a macro expansion, go back to the top of eval instead of
+ * recursing, so loops written as tail recursion run in constant C stack.
+ */
 sexp_t *eval(sexp_t *exp, env_t *env)
 {
+	sexp_t *proc = NULL, *args = NULL, *ret = NULL;
+	sexp_t *(*f)();
+	sexp_t *(*f2)(sexp_t *, sexp_t *);
+	size_t mark, frame = 0;	/* frame: the profiled call running here */
+	gc_frame();
+
+	gc_push3(&exp, &proc, &args);
+	gc_push(&env);
+tail:
 	switch (type(exp)) {
 	case NIL:
 	case INT:
 	case FLOAT:
-		return exp;
+	case BIG:
+	case VECTOR:
+	case STRING:
+		ret = exp;
+		break;
 	case SYM:
-		return env_look_up(env, exp);
-	case CONS: {
-		sexp_t *proc, *args;
+		ret = env_look_up(env, exp);
+		break;
+	case LREF: {
+		env_t *e = env;
+		unsigned depth = lref_depth(exp);
+		for (; depth && e->par; depth--)
+			e = e->par;
+		if (depth || !e->par || lref_index(exp) >= e->size)
+			ret = env_look_up(env, car(exp));
+		else
+			ret = e->vals[lref_index(exp)];
+		break;
+	}
+	case GREF:
+		if (!gref_binding(exp)->val)
+			fprintf(stderr, "error: symbol %s not bound.\n",
+				get_symname(car(exp)));
+		ret = gref_binding(exp)->val;
+		break;
+	case CONS:
 		if (list_len(exp) < 0) {
 			fprintf(stderr, "error: proper list expected\n");
-			return NULL;
+			break;
 		}
-		proc = eval(car(exp), env);
-		gc_push(&proc);
-		args = (type(proc) == PRIM || type(proc) == LAMBDA) ?
-			evlis(cdr(exp), env) : cdr(exp);
-		gc_push(&args);
-		proc = apply(proc, args, env);
-		gc_pop();
-		gc_pop();
-		return proc;
-	}
-	default:
-		return NULL;
+		if (!(proc = eval(car(exp), env)))
+			break;
+		args = cdr(exp);
+		switch (type(proc)) {
+		case SPEC:
+			f = get_prim(proc);
+			if (f == (sexp_t *(*)())spec_cond) {
+				for (; args != nil; args = cdr(args))
+					if (eval(car(car(args)), env) != nil)
+						break;
+				if (args == nil)
+					break;
+				exp = car(cdr(car(args)));
+				goto tail;
+			}
+			if (f == (sexp_t *(*)())spec_and ||
+			    f == (sexp_t *(*)())spec_or) {
+				if (args == nil) {
+					ret = f == (sexp_t *(*)())spec_and ?
+						t : nil;
+					break;
+				}
+				for (; cdr(args) != nil; args = cdr(args)) {
+					ret = eval(car(args), env);
+					if (f == (sexp_t *(*)())spec_and ?
+					    ret == nil : ret != nil)
+						break;
+				}
+				if (cdr(args) != nil)
+					break;
+				exp = car(args);
+				goto tail;
+			}
+			ret = f(args, env);
+			break;
+		case PRIM:
+			if (get_prim(proc) == (sexp_t *(*)())prim_progn &&
+			    args != nil) {
+				for (; cdr(args) != nil; args = cdr(args))
+					eval(car(args), env);
+				exp = car(args);
+				goto tail;
+			}
+			/* (+ a b) and the like need no argument list */
+			if (get_prim2(proc) && args != nil &&
+			    cdr(args) != nil && cdr(cdr(args)) == nil) {
+				f2 = get_prim2(proc);
+				exp = eval(car(args), env);
+				ret = eval(car(cdr(args)), env);
+				mark = profile_call(proc);
+				ret = f2(exp, ret);
+				if (mark)
+					profile_leave(mark);
+				break;
+			}
+			args = evlis(args, env);
+			mark = profile_call(proc);
+			ret = get_prim(proc)(args, env);
+			if (mark)
+				profile_leave(mark);
+			break;
+		case LAMBDA:
+			args = evlis(args, env);
+			if (!(env = env_extend(proc_env(proc),
+					       proc_params(proc), args)))
+				break;
+			/* a tail call ends the call it was made from */
+			if (frame)
+				profile_leave(frame);
+			frame = profile_call(proc);
+			for (exp = proc_body(proc); cdr(exp) != nil;
+			     exp = cdr(exp))
+				eval(car(exp), env);
+			exp = car(exp);
+			goto tail;
+		case MACRO:
+			mark = profile_call(proc);
+			exp = macro_code(exp, proc, env);
+			if (mark)
+				profile_leave(mark);
+			if (!exp)
+				break;
+			goto tail;
+		case CLOSURE:
+			args = evlis(args, env);
+			mark = profile_call(proc);
+			ret = vm_apply(proc, args);
+			if (mark)
+				profile_leave(mark);
+			break;
+		}
+		break;
 	}
+	if (frame)
+		profile_leave(frame);
+	gc_popn(4);
+	return ret;
 }
 
 /*
@@ -484,6 +1000,7 @@ sexp_t *eval(sexp_t *exp, env_t *env)
 sexp_t *copy_list(sexp_t *l)
 {
 	sexp_t *e;
+	gc_frame();
 	if (l == nil)
 		return nil;
 	e = copy_list(cdr(l));
@@ -493,119 +1010,127 @@ sexp_t *copy_list(sexp_t *l)
 	return e;
 }
 
-int list_len(sexp_t *e)
-{
-	int i;
-	if (!islist(e))
-		return -1;
-	for (i = 0; e != nil; e = cdr(e)) {
-		if (!islist(cdr(e)))
-			return -1;
-		i++;
-	}
-	return i;
-}
-
 int init(void)
 {
-	if (sizeof(nil->data) != 2*sizeof(void*) ||
+	if (offsetof(sexp_t, car) != CONS_BIT ||
 	    sizeof(PTRT) != sizeof(void*)) {
 		fprintf(stderr, "Error: incompatible with this platform.\n");
 		return 1;
 	}
 
-	nil = new_sexp(NIL,0); gc_push(&nil);
-	t = new_sexp(NIL,0); gc_push(&t);
-	dot = new_sexp(NIL,0); gc_push(&dot);
-	symlist = nil; gc_push(&symlist);
-	toplevel = new_env(NULL); gc_push(&toplevel);
-
-
-	env_bind(toplevel, "nil", nil);
-	env_bind(toplevel, "t", t);
-
-	env_bind(toplevel, "atom", prim(prim_atom));
-	env_bind(toplevel, "consp", prim(prim_consp));
-	env_bind(toplevel, "eq", prim(prim_eq));
-	env_bind(toplevel, "cons", prim(prim_cons));
-	env_bind(toplevel, "car", prim(prim_car));
-	env_bind(toplevel, "cdr", prim(prim_cdr));
-	env_bind(toplevel, "list", prim(prim_list));
-	env_bind(toplevel, "append", prim(prim_append));
-	env_bind(toplevel, "eval", prim(prim_eval));
-	env_bind(toplevel, "apply", prim(prim_apply));
-	env_bind(toplevel, "progn", prim(prim_progn));
-	env_bind(toplevel, "+", prim(prim_add));
-	env_bind(toplevel, "-", prim(prim_sub));
-	env_bind(toplevel, "*", prim(prim_mul));
-	env_bind(toplevel, "/", prim(prim_div));
-	env_bind(toplevel, "=", prim(prim_numeq));
-	env_bind(toplevel, "<", prim(prim_numlt));
-	env_bind(toplevel, ">", prim(prim_numgt));
-	env_bind(toplevel, "<=", prim(prim_numle));
-	env_bind(toplevel, ">=", prim(prim_numge));
-	env_bind(toplevel, "display", prim(prim_display));
-	env_bind(toplevel, "newline", prim(prim_newline));
-	env_bind(toplevel, "print", prim(prim_print));
-	env_bind(toplevel, "read", prim(prim_read));
-
-	env_bind(toplevel, "quote", spec(spec_quote));
-	env_bind(toplevel, "backquote", spec(spec_backquote));
-	env_bind(toplevel, "cond", spec(spec_cond));
-	env_bind(toplevel, "and", spec(spec_and));
-	env_bind(toplevel, "or", spec(spec_or));
-	env_bind(toplevel, "lambda", spec(spec_lambda));
-	env_bind(toplevel, "λ", spec(spec_lambda));
-	env_bind(toplevel, "macro", spec(spec_macro));
-	env_bind(toplevel, "μ", spec(spec_macro));
-	env_bind(toplevel, "label", spec(spec_label));
-	env_bind(toplevel, "set", spec(spec_set));
-	env_bind(toplevel, "setcar", spec(spec_setcar));
-	env_bind(toplevel, "setcdr", spec(spec_setcdr));
+	std_in = reader_fd(0);
+	nil = new_sexp(NIL, NULL, NULL); gc_push(&nil);
+	t = new_sexp(NIL, NULL, NULL); gc_push(&t);
+	dot = new_sexp(NIL, NULL, NULL); gc_push(&dot);
+	toplevel = new_env(NULL, NULL, 0); gc_push(&toplevel);
+
+
+	env_define(toplevel, "nil", nil);
+	env_define(toplevel, "t", t);
 
+	env_define(toplevel, "atom", prim(prim_atom));
+	env_define(toplevel, "consp", prim(prim_consp));
+	env_define(toplevel, "eq", prim(prim_eq));
+	env_define(toplevel, "cons", prim(prim_cons));
+	env_define(toplevel, "car", prim(prim_car));
+	env_define(toplevel, "cdr", prim(prim_cdr));
+	env_define(toplevel, "list", prim(prim_list));
+	env_define(toplevel, "append", prim(prim_append));
+	env_define(toplevel, "eval", prim(prim_eval));
+	env_define(toplevel, "apply", prim(prim_apply));
+	env_define(toplevel, "progn", prim(prim_progn));
+	env_define(toplevel, "+", prim2(prim_add, num_add));
+	env_define(toplevel, "-", prim2(prim_sub, num_sub));
+	env_define(toplevel, "*", prim2(prim_mul, num_mul));
+	env_define(toplevel, "/", prim2(prim_div, num_div));
+	env_define(toplevel, "quotient", prim(prim_quotient));
+	env_define(toplevel, "remainder", prim(prim_remainder));
+	env_define(toplevel, "=", prim2(prim_numeq, num_eq));
+	env_define(toplevel, "<", prim2(prim_numlt, num_lt));
+	env_define(toplevel, ">", prim2(prim_numgt, num_gt));
+	env_define(toplevel, "<=", prim2(prim_numle, num_le));
+	env_define(toplevel, ">=", prim2(prim_numge, num_ge));
+	env_define(toplevel, "display", prim(prim_display));
+	env_define(toplevel, "newline", prim(prim_newline));
+	env_define(toplevel, "print", prim(prim_print));
+	env_define(toplevel, "read", prim(prim_read));
+	env_define(toplevel, "save-image", prim(prim_save_image));
+	env_define(toplevel, "fasl-write", prim(prim_fasl_write));
+	env_define(toplevel, "fasl-read", prim(prim_fasl_read));
+	env_define(toplevel, "profile-start", prim(prim_profile_start));
+	env_define(toplevel, "profile-report", prim(prim_profile_report));
+	env_define(toplevel, "gc", prim(prim_gc));
+	env_define(toplevel, "gc-tune", prim(prim_gc_tune));
+	env_define(toplevel, "gc-stats", prim(prim_gc_stats));
+	env_define(toplevel, "macroexpand-1", prim(prim_macroexpand_1));
+	env_define(toplevel, "macroexpand", prim(prim_macroexpand));
+	env_define(toplevel, "macro-cache-stats", prim(prim_macro_cache_stats));
+	env_define(toplevel, "vectorp", prim(prim_vectorp));
+	env_define(toplevel, "make-vector", prim(prim_make_vector));
+	env_define(toplevel, "vector", prim(prim_vector));
+	env_define(toplevel, "vector-length", prim(prim_vector_length));
+	env_define(toplevel, "vector-ref", prim2(prim_vector_ref, vector_ref));
+	env_define(toplevel, "vector-set!", prim(prim_vector_set));
+	env_define(toplevel, "stringp", prim(prim_stringp));
+	env_define(toplevel, "string-length", prim(prim_string_length));
+	env_define(toplevel, "concat", prim(prim_concat));
+	env_define(toplevel, "substring", prim(prim_substring));
+	env_define(toplevel, "string-search", prim(prim_string_search));
+
+	env_define(toplevel, "quote", spec(spec_quote));
+	env_define(toplevel, "backquote", spec(spec_backquote));
+	env_define(toplevel, "cond", spec(spec_cond));
+	env_define(toplevel, "and", spec(spec_and));
+	env_define(toplevel, "or", spec(spec_or));
+	env_define(toplevel, "lambda", spec(spec_lambda));
+	env_define(toplevel, "λ", spec(spec_lambda));
+	env_define(toplevel, "macro", spec(spec_macro));
+	env_define(toplevel, "μ", spec(spec_macro));
+	env_define(toplevel, "label", spec(spec_label));
+	env_define(toplevel, "set", spec(spec_set));
+	env_define(toplevel, "setcar", spec(spec_setcar));
+	env_define(toplevel, "setcdr", spec(spec_setcdr));
+
+	env_define(toplevel, "*print-circle*", nil);
+	print_circle = env_slot(toplevel, find_symbol("*print-circle*"));
+
+	image_init();
 	return 0;
 }
 
 void clean_up(void)
 {
-	sexp_t *sym;
-
-	gc_pop();	/* toplevel */
-	gc_pop();	/* symlist */
-	gc_pop();	/* dot */
-	gc_pop();	/* t */
-	gc_pop();	/* nil */
-
-	for (sym = symlist; sym != nil; sym = cdr(sym))
-		free(get_symname(car(sym)));
-
+	gc_unwind(4);	/* toplevel, dot, t, nil */
 	gc_sweep();
+	reader_close(std_in);
 }
 
 void dofile(const char *path)
 {
-	FILE *input;
+	struct reader *input;
 	sexp_t *e = NULL;
-	if ((input = fopen(path, "r")) == NULL) {
+	gc_frame();
+	if ((input = reader_open(path)) == NULL) {
 		fprintf(stderr, "error: could not open %s\n", path);
 		return;
 	}
 	gc_push(&e);
 	while ((e = read_sexp(input))) {
-		e = eval(e, toplevel);
+		e = evaluate(e, toplevel);
 		e = NULL;
 	}
 	gc_pop();
-	fclose(input);
+	reader_close(input);
 }
 
 /* normal repl */
 void repl()
 {
 	sexp_t *e = NULL;
+	gc_frame();
 	gc_push(&e);
-	while ((e = read_sexp(stdin))) {
-		e = eval(e, toplevel);
+	while ((e = read_sexp(std_in))) {
+		e = evaluate(e, toplevel);
 		if (e)
 			print_sexpnl(e, stdout);
 		e = NULL;
@@ -617,29 +1142,89 @@ void repl()
 void repl_eq()
 {
 	sexp_t *e1 = NULL, *e2 = NULL;
-	gc_push(&e1);
-	gc_push(&e2);
-	while ((e1 = read_sexp(stdin)) && (e2 = read_sexp(stdin))) {
-		e1 = apply(eval(e1, toplevel), e2, toplevel);
+	gc_frame();
+	gc_push2(&e1, &e2);
+	while ((e1 = read_sexp(std_in)) && (e2 = read_sexp(std_in))) {
+		e1 = apply(evaluate(e1, toplevel), e2, toplevel);
 		if (e1)
 			print_sexpnl(e1, stdout);
 		e1 = e2 = NULL;
 	}
-	gc_pop();
-	gc_pop();
+	gc_popn(2);
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-eq] [--vm] [--image file] "
+		"[--profile calls|samples] [--gc-report] [--gc-stress] "
+		"[--gc-trace] [--gc-<setting> value]... [file]...\n", name);
 }
 
 int main(int argc, char *argv[])
 {
+	int i, evalquote = 0, report = 0, files = 0, profile = 0;
+	const char *image = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-eq") == 0)
+			evalquote = 1;
+		else if (strcmp(argv[i], "--vm") == 0)
+			vm_mode = 1;
+		else if (strcmp(argv[i], "--image") == 0 && i+1 < argc)
+			image = argv[++i];
+		else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+			if (strcmp(argv[++i], "calls") == 0)
+				profile = PROFILE_CALLS;
+			else if (strcmp(argv[i], "samples") == 0)
+				profile = PROFILE_SAMPLES;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--gc-report") == 0)
+			report = 1;
+		else if (strcmp(argv[i], "--gc-stress") == 0)
+			gc_tune("stress", 1);
+		else if (strcmp(argv[i], "--gc-trace") == 0)
+			gc_tune("trace", 1);
+		else if (strncmp(argv[i], "--gc-", 5) == 0 && i+1 < argc) {
+			if (gc_tune(argv[i]+5, atof(argv[i+1]))) {
+				fprintf(stderr, "error: bad gc setting %s\n",
+					argv[i]);
+				return 1;
+			}
+			i++;
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			return 1;
+		} else
+			argv[++files] = argv[i];	/* gathered from argv[1] */
+	}
+
 	if (init())
 		return 1;
 
-	dofile("lib.lsp");
+	/* an image holds lib.lsp already */
+	if (image && image_load(image))
+		return 1;
+	if (!image)
+		dofile("lib.lsp");
+
+	/* the flat profile goes to stderr, the stacks to profile.folded */
+	if (profile && profile_start(profile))
+		return 1;
 
-	if (argc > 1 && strcmp(argv[1], "-eq") == 0)
+	/* files given are loaded in place of the repl */
+	for (i = 1; i <= files; i++)
+		dofile(argv[i]);
+	if (!files && evalquote)
 		repl_eq();
-	else
+	else if (!files)
 		repl();
+	if (profiling)
+		profile_report(stderr, "profile.folded");
+	if (report)
+		gc_report(stderr);
 	clean_up();
 
 	return 0;
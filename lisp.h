@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #define NIL	0x0
 #define INT	0x1
@@ -14,72 +15,313 @@
 #define PRIM	0x7
 #define SPEC	0x8
 #define ENV	0x9
+#define LREF	0xA	/* analyzed local variable */
+#define GREF	0xB	/* analyzed global variable */
+#define PARAMS	0xC	/* analyzed lambda list */
+#define CODE	0xD	/* compiled lambda body */
+#define CLOSURE	0xE	/* compiled lambda */
+#define BIG	0xF	/* integer beyond 32 bits */
+#define VECTOR	0x10
+#define STRING	0x11
+#define NTYPES	(STRING + 1)
 
 #ifdef BIT64
-	#define DATAT	__uint128_t
 	#define PTRT	uint64_t
 #else
-	#define DATAT	uint64_t
 	#define PTRT	uint32_t
 #endif
 
+/*
+ * Cells
+ *
+ * A cons is nothing but its car and cdr, two words.  Other cells start
+ * with a type byte, followed by the same two fields or by a double.
+ * A pointer to a cons points one word before it, so that car and cdr
+ * are found at the same offsets in both kinds of cell; since cells are
+ * 16 byte aligned, such a pointer is the only kind with the CONS_BIT
+ * set, and that bit is the type of a cons.
+ */
 typedef struct sexp sexp_t;
 struct sexp {
 	uint8_t type;
-	DATAT data;
+	sexp_t *car;
+	sexp_t *cdr;
+};
+
+struct flonum {
+	uint8_t type;
+	double f;
+};
+
+#define CONS_BIT	sizeof(void*)
+
+struct bignum {
+	uint8_t type;
+	uint8_t neg;
+	uint32_t len;		/* limbs, the top one nonzero */
+	uint32_t *limb;		/* least significant first */
+};
+
+/*
+ * Cells stop at 64 bytes, so the elements of a vector and the bytes of
+ * a string are a block of their own, charged to the collector and
+ * freed by the sweep like the limbs of a bignum.  A string is also
+ * NUL terminated, for the C functions it is handed to.
+ */
+struct vector {
+	uint8_t type;
+	uint32_t len;
+	sexp_t **elems;
+};
+
+struct string {
+	uint8_t type;
+	uint32_t len;		/* bytes, the NUL not counted */
+	char *chars;
 };
 
 typedef struct env env_t;
+struct binding {
+	sexp_t *sym;
+	sexp_t *val;
+	struct binding *next;
+};
+
+struct bindtab {
+	size_t size;
+	size_t count;
+	struct binding *slot[];
+};
+
 struct env {
 	uint8_t type;
+	uint32_t size;		/* slots in vals */
 	env_t *par;
-	struct binding {
-		char *var;
-		sexp_t *val;
-		struct binding *next;
-	} *first;
+	sexp_t *params;		/* lambda list naming the slots */
+	union {
+		sexp_t **vals;
+		struct bindtab *tab;	/* toplevel only */
+	};
 };
 
-void print128(DATAT d);
+typedef struct code code_t;
+struct code {
+	uint8_t type;
+	uint8_t rest;		/* takes a rest list */
+	uint16_t nparams;	/* positional parameters */
+	uint16_t maxstack;	/* value stack slots it needs */
+	uint16_t nconsts;
+	uint8_t *ops;
+	sexp_t **consts;
+	sexp_t *src;		/* (params . body) it was compiled from */
+};
+
+/* Lexical scope of the code being analyzed or compiled */
+struct scope {
+	sexp_t *params;
+	struct scope *up;
+};
 
-union float_int_conv { double f; uint64_t i; };
-extern union float_int_conv float_int;
 extern sexp_t *nil, *t, *dot;
 
-env_t *toplevel;
+extern env_t *toplevel;
+extern int vm_mode;
+
+struct gc_policy {
+	size_t min_bytes;	/* lower bound of the byte threshold */
+	size_t min_objs;	/* lower bound of the object threshold */
+	double growth;		/* heap growth factor when nothing survives */
+	double growth_max;	/* heap growth factor when everything survives */
+	int stress;		/* collect on every allocation */
+	int reverse;		/* mark conses by pointer reversal */
+	int generational;	/* collect a nursery on its own */
+	size_t nursery;		/* nursery size that triggers a minor cycle */
+	int trace;		/* log every cycle to stderr */
+};
+
+#define GC_HIST	24	/* pause buckets: under 1 us, under 2^n us */
+
+struct gc_stats {
+	unsigned long cycles;
+	unsigned long freed;	/* objects freed over all cycles */
+	size_t freed_bytes;
+	size_t last_freed;	/* objects freed by the last cycle */
+	size_t live;		/* objects surviving the last cycle */
+	size_t live_bytes;
+	double pause;		/* seconds spent collecting */
+	double pause_max;
+	unsigned long minors;	/* minor cycles */
+	unsigned long promoted;	/* objects surviving minor cycles */
+	double minor_pause;
+	double minor_pause_max;
+	unsigned long allocs[NTYPES];	/* objects allocated by type */
+	size_t alloc_bytes[NTYPES];
+	size_t charged;		/* bytes outside the heap, as bignum limbs */
+	unsigned long mark_hist[GC_HIST];	/* all cycles, by pause */
+	unsigned long sweep_hist[GC_HIST];
+};
+
+extern struct gc_policy gc_policy;
+extern struct gc_stats gc_stats;
+extern const char *gc_tune_keys[];
+extern const char *gc_type_names[];
+
+/*
+ * Root stack
+ *
+ * Holds the addresses of the local variables the collector has to
+ * treat as roots.  gc_push2/gc_push3 protect several locals with one
+ * bounds check, gc_popn releases them together.  Built with GC_DEBUG,
+ * every push is tagged with the pushing function and a pop of another
+ * function's root aborts; a gc_frame() at the top of a function also
+ * checks that the stack is back where it was when the function returns.
+ * gc_unwind drops roots without the check, for the globals init() pushes.
+ */
+extern sexp_t ***gc_sp, ***gc_top;
+void    gc_grow(size_t n);
+
+#ifdef GC_DEBUG
+struct gc_frame { size_t depth; const char *func; };
+void    gc_check_push(const char *func, size_t n);
+void    gc_check_pop(const char *func, size_t n);
+void    gc_check_frame(struct gc_frame *f);
+#define gc_frame()	struct gc_frame gc_frame_\
+	__attribute__((cleanup(gc_check_frame))) = { gc_roots(), __func__ }
+#define gc_reserve(n)	(gc_top - gc_sp < (n) ? gc_grow(n) : (void)0,\
+			 gc_check_push(__func__, n))
+#define gc_popn(n)	(gc_check_pop(__func__, n), (void)(gc_sp -= (n)))
+#else
+#define gc_frame()	((void)0)
+#define gc_reserve(n)	(gc_top - gc_sp < (n) ? gc_grow(n) : (void)0)
+#define gc_popn(n)	((void)(gc_sp -= (n)))
+#endif
+
+#define gc_push(a)	(gc_reserve(1), *gc_sp++ = (sexp_t**)(a))
+#define gc_push2(a,b)	(gc_reserve(2), gc_sp[0] = (sexp_t**)(a),\
+			 gc_sp[1] = (sexp_t**)(b), gc_sp += 2)
+#define gc_push3(a,b,c)	(gc_reserve(3), gc_sp[0] = (sexp_t**)(a),\
+			 gc_sp[1] = (sexp_t**)(b), gc_sp[2] = (sexp_t**)(c),\
+			 gc_sp += 3)
+#define gc_pop()	gc_popn(1)
+#define gc_unwind(n)	((void)(gc_sp -= (n)))
 
 void    gc_dump(void);
 void    gc_dump_stack(void);
-void   *gc_alloc(size_t size);
-void    gc_push(void *obj);
-void    gc_pop(void);
+void   *gc_alloc(uint8_t type, size_t size);
+void   *gc_alloc_cons(void);
 void    gc_mark(void);
 void    gc_sweep(void);
+size_t  gc_collect(void);
+size_t  gc_minor(void);
+void    gc_barrier(void *obj, void *val);
+void    gc_charge(size_t bytes);
+int     gc_visit(sexp_t *cell);
+void    gc_visit_end(void);
+int     gc_tune(const char *key, double val);
+double  gc_tune_get(const char *key);
+void    gc_report(FILE *out);
+void    gc_census(unsigned long *count);
+size_t  gc_roots(void);
+size_t  gc_roots_peak(void);
 
 sexp_t *copy_list(sexp_t *l);
-int     list_len(sexp_t *e);
+sexp_t *new_vector(size_t len, sexp_t *fill);
+sexp_t *new_string(const char *s, size_t len);
+
+/* Constructors, inline for the callers in every file */
+static inline sexp_t *new_sexp(uint8_t type, void *car, void *cdr)
+{
+	sexp_t *e = gc_alloc(type, sizeof(sexp_t));
+	e->car = car;
+	e->cdr = cdr;
+	return e;
+}
 
-sexp_t *new_sexp(uint8_t type, DATAT data);
+static inline sexp_t *new_cons(sexp_t *car, sexp_t *cdr)
+{
+	sexp_t *e = (sexp_t*)((char*)gc_alloc_cons() - CONS_BIT);
+	e->car = car;
+	e->cdr = cdr;
+	return e;
+}
 
-env_t  *new_env(env_t *par);
+static inline sexp_t *new_float(double f)
+{
+	struct flonum *e = gc_alloc(FLOAT, sizeof(struct flonum));
+	e->f = f;
+	return (sexp_t*)e;
+}
+
+env_t  *new_env(env_t *par, sexp_t *params, unsigned size);
 env_t  *env_extend(env_t *par, sexp_t *params, sexp_t *args);
 void    env_clear(env_t *env);
+int     param_index(sexp_t *params, sexp_t *sym);
+struct binding *env_global(env_t *env, sexp_t *sym);
+struct binding *env_slot(env_t *env, sexp_t *sym);
+sexp_t **env_find(env_t *env, sexp_t *sym);
 sexp_t *env_look_up(env_t *env, sexp_t *sym);
-void    env_bind(env_t *env, char *var, sexp_t *val);
-void    env_set(env_t *env, char *var, sexp_t *val);
+void    env_bind(env_t *env, sexp_t *sym, sexp_t *val);
+void    env_define(env_t *env, const char *name, sexp_t *val);
+void    env_set(env_t *env, sexp_t *sym, sexp_t *val);
 
 sexp_t *find_symbol(const char *s);
+sexp_t *find_symboln(const char *s, size_t len);
+void    symbol_free(sexp_t *sym);
 
+extern struct binding *print_circle;
+void    print_put(sexp_t *exp, FILE *out);
+void    print_putc(int c, FILE *out);
+void    print_write(const char *s, size_t n, FILE *out);
+void    print_flush(FILE *out);
 void    print_sexp(sexp_t *exp, FILE *out);
-#define print_sexpnl(exp, out)\
-	(print_sexp(exp,out), putc('\n',out))
-sexp_t *read_sexp(FILE *in);
+void    print_sexpnl(sexp_t *exp, FILE *out);
+void    image_init(void);
+int     image_save(const char *path);
+int     image_load(const char *path);
+int     fasl_write(sexp_t *x, const char *path);
+sexp_t *fasl_read(const char *path);
+
+struct reader;
+extern struct reader *std_in;
+struct reader *reader_fd(int fd);
+struct reader *reader_open(const char *path);
+void    reader_close(struct reader *r);
+sexp_t *read_atom(const char *buf, size_t len);
+sexp_t *read_sexp(struct reader *r);
+
+int     count_params(sexp_t *params);
+int     scope_lookup(sexp_t *sym, struct scope *sc, env_t *env,
+		     unsigned *depth, int *index);
+sexp_t *analyze_lambda(sexp_t *args, env_t *env);
+sexp_t *expand_macro(sexp_t *mac, sexp_t *args);
+sexp_t *macro_expansion(sexp_t *site, sexp_t *mac);
+sexp_t *macro_code(sexp_t *site, sexp_t *mac, env_t *env);
+void    macro_cache_gc(int (*live)(sexp_t *), void (*mark)(sexp_t *));
+extern unsigned long macro_cache_hits, macro_cache_misses;
 
 sexp_t *apply(sexp_t *proc, sexp_t *args, env_t *env);
 sexp_t *evlis(sexp_t *args, env_t *env);
-sexp_t *evblock(sexp_t *exp, env_t *env, int ismacro);
+sexp_t *evblock(sexp_t *exp, env_t *env);
 sexp_t *eval(sexp_t *exp, env_t *env);
 
+#define PROFILE_CALLS	1
+#define PROFILE_SAMPLES	2
+extern int profiling;
+size_t  profile_enter(sexp_t *proc);
+void    profile_leave(size_t mark);
+#define profile_call(proc)	(profiling ? profile_enter(proc) : 0)
+void    profile_mark(void (*mark)(sexp_t *));
+int     profile_start(int mode);
+void    profile_stop(void);
+int     profile_report(FILE *out, const char *stacks);
+
+sexp_t *vm_eval(sexp_t *exp, env_t *env);
+size_t  code_size(code_t *code);
+sexp_t *vm_apply(sexp_t *proc, sexp_t *args);
+void    vm_mark(void (*mark)(sexp_t *));
+#define evaluate(exp, env)\
+	(vm_mode ? vm_eval((exp), (env)) : eval((exp), (env)))
+
 /*
  * Primitive functions
  * and Special forms
@@ -104,10 +346,44 @@ sexp_t *prim_numlt(sexp_t *args);
 sexp_t *prim_numgt(sexp_t *args);
 sexp_t *prim_numle(sexp_t *args);
 sexp_t *prim_numge(sexp_t *args);
+sexp_t *prim_quotient(sexp_t *args);
+sexp_t *prim_remainder(sexp_t *args);
+sexp_t *num_add(sexp_t *a, sexp_t *b);
+sexp_t *num_sub(sexp_t *a, sexp_t *b);
+sexp_t *num_mul(sexp_t *a, sexp_t *b);
+sexp_t *num_div(sexp_t *a, sexp_t *b);
+sexp_t *num_eq(sexp_t *a, sexp_t *b);
+sexp_t *num_lt(sexp_t *a, sexp_t *b);
+sexp_t *num_gt(sexp_t *a, sexp_t *b);
+sexp_t *num_le(sexp_t *a, sexp_t *b);
+sexp_t *num_ge(sexp_t *a, sexp_t *b);
 sexp_t *prim_display(sexp_t *args);
 sexp_t *prim_newline();
 sexp_t *prim_print(sexp_t *args);
 sexp_t *prim_read();
+sexp_t *prim_save_image(sexp_t *args);
+sexp_t *prim_fasl_write(sexp_t *args);
+sexp_t *prim_fasl_read(sexp_t *args);
+sexp_t *prim_profile_start(sexp_t *args);
+sexp_t *prim_profile_report(sexp_t *args);
+sexp_t *prim_gc();
+sexp_t *prim_gc_tune(sexp_t *args);
+sexp_t *prim_gc_stats();
+sexp_t *prim_vectorp(sexp_t *args);
+sexp_t *prim_make_vector(sexp_t *args);
+sexp_t *prim_vector(sexp_t *args);
+sexp_t *prim_vector_length(sexp_t *args);
+sexp_t *prim_vector_ref(sexp_t *args);
+sexp_t *vector_ref(sexp_t *v, sexp_t *i);
+sexp_t *prim_vector_set(sexp_t *args);
+sexp_t *prim_stringp(sexp_t *args);
+sexp_t *prim_string_length(sexp_t *args);
+sexp_t *prim_concat(sexp_t *args);
+sexp_t *prim_substring(sexp_t *args);
+sexp_t *prim_string_search(sexp_t *args);
+sexp_t *prim_macroexpand_1(sexp_t *args, env_t *env);
+sexp_t *prim_macroexpand(sexp_t *args, env_t *env);
+sexp_t *prim_macro_cache_stats();
 
 sexp_t *spec_quote(sexp_t *args);
 sexp_t *spec_backquote(sexp_t *args, env_t *env);
@@ -121,45 +397,144 @@ sexp_t *spec_set(sexp_t *args, env_t *env);
 sexp_t *spec_setcar(sexp_t *args, env_t *env);
 sexp_t *spec_setcdr(sexp_t *args, env_t *env);
 
-#define type(X)		(((sexp_t*)(X))->type & 0x7F)
-#define marked(X)	(((sexp_t*)(X))->type & 0x80)
+sexp_t *big_add(sexp_t *a, sexp_t *b);
+sexp_t *big_sub(sexp_t *a, sexp_t *b);
+sexp_t *big_mul(sexp_t *a, sexp_t *b);
+sexp_t *big_quotient(sexp_t *a, sexp_t *b);
+sexp_t *big_remainder(sexp_t *a, sexp_t *b);
+int     big_cmp(sexp_t *a, sexp_t *b);
+double  big_to_double(sexp_t *a);
+sexp_t *big_from_limbs(const uint32_t *d, size_t n, int neg);
+sexp_t *big_read(const char *s, size_t n);
+void    big_print(sexp_t *a, FILE *out);
+void    big_free(sexp_t *a);
+
+/*
+ * Integers that fit are not allocated: n is the word n<<1 | 1, which is
+ * never the address of a cell.  On 32 bit builds those that need all
+ * 32 bits are still boxed in an INT cell.  Larger ones are BIGs, see
+ * bignum.c.
+ */
+#define isfixnum(X)	((PTRT)(X) & 1)
+#define type(X)		(isfixnum(X) ? INT : ((PTRT)(X) & CONS_BIT) ?\
+			 CONS : ((sexp_t*)(X))->type)
 #define isint(X)	(type(X) == INT)
 #define isfloat(X)	(type(X) == FLOAT)
-#define isnum(X)	(isint(X) || isfloat(X))
+#define isbig(X)	(type(X) == BIG)
+#define isinteger(X)	(isint(X) || isbig(X))
+#define isnum(X)	(isint(X) || isfloat(X) || isbig(X))
 #define issym(X)	(type(X) == SYM)
 #define islambda(X)	(type(X) == LAMBDA)
 #define isprim(X)	(type(X) == PRIM)
 #define isspec(X)	(type(X) == SPEC)
-#define isatom(X)	(type(X) != CONS)
-#define iscons(X)	(type(X) == CONS)
+#define isvector(X)	(type(X) == VECTOR)
+#define isstring(X)	(type(X) == STRING)
+#define isatom(X)	(!iscons(X))
+#define iscons(X)	(((PTRT)(X) & (CONS_BIT | 1)) == CONS_BIT)
 #define isnil(X)	((X) == nil)
 #define islist(X)	(iscons(X) || isnil(X))
 
-#define make_cons(a, b)	(((DATAT) ((PTRT)(b)) << sizeof(void*)*8) | (PTRT)(a))
-#define cons(a, b)	(new_sexp(CONS, make_cons((a), (b))))
+#define gc_write(x, v)	(gc_policy.generational ?\
+			 gc_barrier((x), (v)) : (void)0)
+#define set_car(x, a)	((x)->car = (a), gc_write((x), car(x)))
+#define set_cdr(x, d)	((x)->cdr = (d), gc_write((x), cdr(x)))
+#define cons(a, b)	(new_cons((a), (b)))
 
-#define get_car(b)	((void*)((PTRT)(b)))
-#define get_cdr(a)	((void*)((PTRT)((a) >> sizeof(void*)*8)))
-#define car(a)		((sexp_t*)(get_car((a)->data)))
-#define cdr(a)		((sexp_t*)(get_cdr((a)->data)))
+#define car(a)		((a)->car)
+#define cdr(a)		((a)->cdr)
 
 #define get_symname(s)	((char*)car(s))
+#define get_symhash(s)	((uint32_t)(PTRT)cdr(s))
 
-#define make_int(a)	((DATAT) (a))
-#define get_int(a)	((int32_t) (a)->data)
-#define int_(a)		(new_sexp(INT, make_int(a)))
+#define fixnum(a)	((sexp_t*)((PTRT)(int32_t)(a) << 1 | 1))
+#define fixnum_val(a)	((int32_t)((intptr_t)(a) >> 1))
+#ifdef BIT64
+#define get_int(a)	fixnum_val(a)
+#define int_(a)		fixnum(a)
+#else
+#define get_int(a)	(isfixnum(a) ? fixnum_val(a) : (int32_t)(PTRT)car(a))
+#define int_(a)		int_box(a)
+static inline sexp_t *int_box(int32_t a)
+{
+	return a >= -0x40000000 && a < 0x40000000 ?
+		fixnum(a) : new_sexp(INT, (void*)(PTRT)a, NULL);
+}
+#endif
+
+#define vector_len(v)	(((struct vector*)(v))->len)
+#define vector_elems(v)	(((struct vector*)(v))->elems)
+#define string_len(s)	(((struct string*)(s))->len)
+#define string_chars(s)	(((struct string*)(s))->chars)
+
+#define get_float(a)	(((struct flonum*)(a))->f)
+#define float_(a)	(new_float(a))
+#define num_val(a)	(isint(a) ? (double)get_int(a) :\
+			 isfloat(a) ? get_float(a) : big_to_double(a))
 
-#define make_float(a)	(float_int.f = (a), float_int.i)
-#define get_float(a)	(float_int.i = (a)->data, (double)float_int.f)
-#define float_(a)	(new_sexp(FLOAT, make_float(a)))
+/* Length of a proper list, -1 for anything else */
+static inline int list_len(sexp_t *e)
+{
+	int i;
+	if (!islist(e))
+		return -1;
+	for (i = 0; e != nil; e = cdr(e)) {
+		if (!islist(cdr(e)))
+			return -1;
+		i++;
+	}
+	return i;
+}
 
-#define prim(a)		(new_sexp(PRIM, make_cons((a), NULL)))
-#define spec(a)		(new_sexp(SPEC, make_cons((a), NULL)))
-#define lambda(a,env)	(new_sexp(LAMBDA, make_cons((a), (env))))
-#define macro(a,env)	(new_sexp(MACRO, make_cons((a), (env))))
+/* eq: the same object, or atoms holding the same bits */
+static inline int eq_atoms(sexp_t *a, sexp_t *b)
+{
+	union { double f; uint64_t i; } x, y;
+
+	if (a == b)
+		return 1;
+	if (!a || !b || isfixnum(a) || isfixnum(b) || type(a) != type(b))
+		return 0;
+	switch (type(a)) {
+	case NIL:
+		return 0;
+	case FLOAT:
+		x.f = get_float(a);
+		y.f = get_float(b);
+		return x.i == y.i;
+	case BIG:
+		return big_cmp(a, b) == 0;
+	case STRING:
+		return string_len(a) == string_len(b) &&
+			!memcmp(string_chars(a), string_chars(b), string_len(a));
+	case VECTOR:
+		return 0;
+	default:
+		return car(a) == car(b) && cdr(a) == cdr(b);
+	}
+}
+
+#define prim(a)		(new_sexp(PRIM, (void*)(a), NULL))
+/* a primitive that also has an entry point for exactly two arguments */
+#define prim2(a,f2)	(new_sexp(PRIM, (void*)(a), (void*)(f2)))
+#define spec(a)		(new_sexp(SPEC, (void*)(a), NULL))
+#define lambda(a,env)	(new_sexp(LAMBDA, (a), (env)))
+#define macro(a,env)	(new_sexp(MACRO, (a), (env)))
 #define proc_params(a)	(car(car(a)))
 #define proc_body(a)	(cdr(car(a)))
 #define proc_env(a)	((env_t*)cdr(a))
+#define closure(c,env)	(new_sexp(CLOSURE, (c), (env)))
+#define closure_code(a)	((code_t*)car(a))
 #define get_prim(a)	((sexp_t *(*)())car(a))
+#define get_prim2(a)	((sexp_t *(*)(sexp_t *, sexp_t *))cdr(a))
+
+#define LREF_MAX	0xFFFF
+#define lref(sym,d,i)	(new_sexp(LREF, (sym), (void*)((PTRT)(d)<<16 | (i))))
+#define lref_depth(a)	((unsigned)((PTRT)cdr(a) >> 16))
+#define lref_index(a)	((unsigned)((PTRT)cdr(a) & LREF_MAX))
+#define gref(sym,b)	(new_sexp(GREF, (sym), (b)))
+#define gref_binding(a)	((struct binding*)cdr(a))
+#define params_(l,n)	(new_sexp(PARAMS, (l), (void*)(PTRT)(n)))
+#define params_list(a)	(car(a))
+#define params_size(a)	((unsigned)(PTRT)cdr(a))
 
 #endif
@@ -1,113 +1,1005 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "lisp.h"
 
-typedef struct gc_mem gc_mem_t;
-struct gc_mem {
-	void *loc;
-	gc_mem_t *next;
+/* Stack of reachable root objects */
+static sexp_t ***gc_root = NULL;
+sexp_t ***gc_sp = NULL, ***gc_top = NULL;
+#ifdef GC_DEBUG
+static const char **gc_owner;
+#endif
+
+/*
+ * Heap
+ *
+ * Objects live in fixed-size cells carved out of aligned pages.  Each
+ * page serves a single size class and keeps its allocation and mark
+ * bits in side bitmaps, so the page of an object is found by masking
+ * its address.  Cells come off a per-class free list rebuilt by the
+ * sweep, or by bumping through a fresh page.  Pages left without live
+ * cells are kept for reuse by any class, up to GC_KEEP_PAGES of them.
+ * Conses have pages of their own, the only cells without a type byte:
+ * the sweep must not look into them for something to finalize.
+ *
+ * In generational mode every new cell is also flagged young and its
+ * page is put on the nursery list.  A minor collection marks only
+ * young objects, starting from the roots and from the old objects in
+ * the remembered set, then sweeps the nursery pages alone.  Survivors
+ * are promoted in place by clearing their young bit: objects never
+ * move, since C code keeps unrooted pointers into reachable lists.
+ * The remembered set is filled by gc_write, the barrier behind
+ * set_car, set_cdr, env_bind and env_set.
+ */
+
+#define GC_PAGE_SIZE	(1 << 16)
+#define GC_MIN_SHIFT	4		/* smallest cell is 16 bytes */
+#define GC_CLASSES	3		/* 16, 32 and 64 byte cells */
+#define GC_CONS_POOL	GC_CLASSES	/* and 16 byte conses */
+#define GC_KEEP_PAGES	16
+#define GC_MAX_CELLS	(GC_PAGE_SIZE >> GC_MIN_SHIFT)
+#define GC_WORDS	(GC_MAX_CELLS / 32)
+
+typedef struct gc_page gc_page_t;
+struct gc_page {
+	gc_page_t *next;
+	unsigned shift;		/* log2 of the cell size */
+	unsigned ncells;
+	unsigned bump;		/* cells handed out by bumping */
+	gc_page_t *ynext;	/* nursery list */
+	int nursery;		/* on the nursery list */
+	int conses;		/* holds conses only */
+	uint32_t alloc[GC_WORDS];
+	uint32_t mark[GC_WORDS];
+	uint32_t flip[GC_WORDS];	/* cdr reversed, see mark_reverse */
+	uint32_t young[GC_WORDS];
+	uint32_t rem[GC_WORDS];		/* in the remembered set */
 };
 
-/* List of allocated objects */
-static gc_mem_t *gc_memlist = NULL;
-/* Stack of reachable root objects */
-static gc_mem_t *gc_root = NULL;
+#define GC_HDR_SIZE	((sizeof(gc_page_t) + 63) & ~(size_t)63)
+
+#define page_of(p)	((gc_page_t*)((uintptr_t)(p) & ~(uintptr_t)(GC_PAGE_SIZE-1)))
+#define page_cells(pg)	((char*)(pg) + GC_HDR_SIZE)
+#define page_cell(pg,i)	(page_cells(pg) + ((size_t)(i) << (pg)->shift))
+/* p may also be a cons pointer, which points a word before its cell */
+#define cell_index(pg,p) ((unsigned)(((char*)(p) + CONS_BIT -\
+			  page_cells(pg)) >> (pg)->shift))
+
+#define bit_test(map,i)	((map)[(i) >> 5] & (1u << ((i) & 31)))
+#define bit_set(map,i)	((map)[(i) >> 5] |= (1u << ((i) & 31)))
+#define bit_clear(map,i) ((map)[(i) >> 5] &= ~(1u << ((i) & 31)))
+
+struct gc_pool {
+	gc_page_t *pages;
+	gc_page_t *cur;		/* page being bumped through */
+	void *free;
+};
+
+static struct gc_pool gc_pools[GC_CLASSES + 1];
+static gc_page_t *gc_empty;
+static unsigned gc_nempty;
+
+static gc_page_t *gc_nursery;
+static sexp_t **gc_remset;
+static size_t gc_nrem, gc_remsize;
+static int gc_minor_active;
+
+static int marked(void *obj)
+{
+	gc_page_t *pg = page_of(obj);
+	return bit_test(pg->mark, cell_index(pg, obj)) != 0;
+}
+
+static int young(void *obj)
+{
+	gc_page_t *pg = page_of(obj);
+	return bit_test(pg->young, cell_index(pg, obj)) != 0;
+}
+
+static void set_mark(void *obj)
+{
+	gc_page_t *pg = page_of(obj);
+	bit_set(pg->mark, cell_index(pg, obj));
+}
+
+static gc_page_t *gc_new_page(unsigned shift)
+{
+	gc_page_t *pg;
+	if ((pg = gc_empty)) {
+		gc_empty = pg->next;
+		gc_nempty--;
+	} else if (!(pg = aligned_alloc(GC_PAGE_SIZE, GC_PAGE_SIZE))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	memset(pg, 0, GC_HDR_SIZE);
+	pg->shift = shift;
+	pg->ncells = (GC_PAGE_SIZE - GC_HDR_SIZE) >> shift;
+	return pg;
+}
+
+static void gc_free_page(gc_page_t *pg)
+{
+	if (gc_nempty < GC_KEEP_PAGES) {
+		pg->next = gc_empty;
+		gc_empty = pg;
+		gc_nempty++;
+	} else
+		free(pg);
+}
+
+static void *gc_bump(struct gc_pool *pool, unsigned shift)
+{
+	gc_page_t *pg = pool->cur;
+	if (!pg || pg->bump == pg->ncells) {
+		pg = gc_new_page(shift);
+		pg->conses = (pool == &gc_pools[GC_CONS_POOL]);
+		pg->next = pool->pages;
+		pool->pages = pool->cur = pg;
+	}
+	return page_cell(pg, pg->bump++);
+}
+
+/*
+ * Collection policy
+ *
+ * A cycle runs once either the bytes or the objects allocated since
+ * the previous cycle reach a threshold.  After each cycle the
+ * thresholds are recomputed from the surviving heap: the heap may grow
+ * by a factor between 'growth' and 'growth-max' before the next cycle,
+ * leaning towards 'growth-max' the more of the heap survived.
+ */
+struct gc_policy gc_policy = {
+	1 << 20,	/* min-bytes */
+	1 << 16,	/* min-objects */
+	1.5,		/* growth */
+	4.0,		/* growth-max */
+	0,		/* stress */
+	0,		/* pointer-reversal */
+	0,		/* generational */
+	1 << 19,	/* nursery-bytes */
+	0		/* trace */
+};
+struct gc_stats gc_stats;
+
+/*
+ * Allocated since the last cycle, and the limits that trigger one.  In
+ * generational mode gc_bytes counts what minor cycles promoted, while
+ * gc_young_bytes counts the nursery.
+ */
+static size_t gc_bytes, gc_objs, gc_young_bytes;
+static size_t gc_next_bytes = 1 << 20, gc_next_objs = 1 << 16;
+
+const char *gc_tune_keys[] = {
+	"min-bytes", "min-objects", "growth", "growth-max", "stress",
+	"pointer-reversal", "generational", "nursery-bytes", "trace", NULL
+};
+
+const char *gc_type_names[NTYPES] = {
+	"nil", "int", "float", "symbol", "cons", "lambda", "macro", "prim",
+	"spec", "env", "lref", "gref", "params", "code", "closure", "big",
+	"vector", "string"
+};
+
+/* What the trace line of the previous cycle counted as allocated */
+static size_t gc_traced;
+
+static double gc_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Counts a pause in its bucket: under 1 us, else under 2^n us */
+static void gc_hist(unsigned long *hist, double pause)
+{
+	unsigned n;
+
+	pause *= 1e6;
+	for (n = 0; pause >= 1.0 && n < GC_HIST - 1; n++)
+		pause /= 2;
+	hist[n]++;
+}
+
+static size_t gc_allocated(void)
+{
+	size_t bytes = gc_stats.charged;
+	unsigned i;
+
+	for (i = 0; i < NTYPES; i++)
+		bytes += gc_stats.alloc_bytes[i];
+	return bytes;
+}
 
-void *gc_alloc(size_t size)
+/* One line per cycle for --gc-trace */
+static void gc_trace(const char *kind, double mark, double sweep,
+		     size_t freed, size_t live, size_t live_bytes)
 {
-	gc_mem_t *new;
+	size_t bytes = gc_allocated();
+
+	fprintf(stderr, "gc: %lu %s: %.3f ms mark, %.3f ms sweep, "
+		"%lu bytes allocated, %lu freed, %lu %s (%lu bytes), "
+		"%lu roots\n", gc_stats.cycles + gc_stats.minors, kind,
+		mark * 1e3, sweep * 1e3, (unsigned long)(bytes - gc_traced),
+		(unsigned long)freed, (unsigned long)live,
+		*kind == 'm' ? "promoted" : "live",
+		(unsigned long)live_bytes, (unsigned long)gc_roots());
+	gc_traced = bytes;
+}
+
+static void gc_retune(void)
+{
+	double survival, factor;
+	size_t total = gc_stats.live + gc_stats.last_freed;
+
+	survival = total ? (double)gc_stats.live / total : 0.0;
+	factor = gc_policy.growth +
+		(gc_policy.growth_max - gc_policy.growth) * survival;
+	gc_next_bytes = gc_stats.live_bytes * (factor - 1.0);
+	gc_next_objs = gc_stats.live * (factor - 1.0);
+	if (gc_next_bytes < gc_policy.min_bytes)
+		gc_next_bytes = gc_policy.min_bytes;
+	if (gc_next_objs < gc_policy.min_objs)
+		gc_next_objs = gc_policy.min_objs;
+}
+
+static void gc_forget(void)
+{
+	gc_page_t *pg;
+	size_t i;
+
+	for (i = 0; i < gc_nrem; i++) {
+		pg = page_of(gc_remset[i]);
+		bit_clear(pg->rem, cell_index(pg, gc_remset[i]));
+	}
+	gc_nrem = 0;
+	for (; (pg = gc_nursery); gc_nursery = pg->ynext)
+		pg->nursery = 0;
+	gc_young_bytes = 0;
+}
+
+/* Runs a full cycle, returns the number of objects freed */
+size_t gc_collect(void)
+{
+	double start, mid, pause;
+
+	start = gc_clock();
+	gc_forget();
 	gc_mark();
+	mid = gc_clock();
 	gc_sweep();
-	new = malloc(sizeof(gc_mem_t));
-	new->loc = malloc(size);
-	new->next = gc_memlist;
-	gc_memlist = new;
-	return new->loc;
+	pause = gc_clock() - start;
+
+	gc_stats.cycles++;
+	gc_stats.pause += pause;
+	if (pause > gc_stats.pause_max)
+		gc_stats.pause_max = pause;
+	gc_hist(gc_stats.mark_hist, mid - start);
+	gc_hist(gc_stats.sweep_hist, start + pause - mid);
+	if (gc_policy.trace)
+		gc_trace("full", mid - start, start + pause - mid,
+			 gc_stats.last_freed, gc_stats.live,
+			 gc_stats.live_bytes);
+	gc_bytes = gc_objs = 0;
+	gc_retune();
+	return gc_stats.last_freed;
 }
 
-void gc_push(void *obj)
+/* Whether v converts to a size_t, NaN not */
+#define fits_size(v)	((v) >= 0 && (v) < (double)SIZE_MAX)
+
+int gc_tune(const char *key, double val)
 {
-	gc_mem_t *new;
-	new = malloc(sizeof(gc_mem_t));
-	new->loc = obj;
-	new->next = gc_root;
-	gc_root = new;
+	if (strcmp(key, "min-bytes") == 0 && fits_size(val))
+		gc_policy.min_bytes = val;
+	else if (strcmp(key, "min-objects") == 0 && fits_size(val))
+		gc_policy.min_objs = val;
+	else if (strcmp(key, "growth") == 0 && val >= 1.0)
+		gc_policy.growth = val;
+	else if (strcmp(key, "growth-max") == 0 && val >= 1.0)
+		gc_policy.growth_max = val;
+	else if (strcmp(key, "stress") == 0)
+		gc_policy.stress = (val != 0);
+	else if (strcmp(key, "pointer-reversal") == 0)
+		gc_policy.reverse = (val != 0);
+	else if (strcmp(key, "generational") == 0) {
+		/* start over with an empty nursery either way */
+		gc_collect();
+		gc_policy.generational = (val != 0);
+	} else if (strcmp(key, "nursery-bytes") == 0 && val > 0 &&
+		   fits_size(val))
+		gc_policy.nursery = val;
+	else if (strcmp(key, "trace") == 0)
+		gc_policy.trace = (val != 0);
+	else
+		return -1;
+	if (gc_policy.growth_max < gc_policy.growth)
+		gc_policy.growth_max = gc_policy.growth;
+	gc_retune();
+	return 0;
 }
 
-void gc_pop(void)
+double gc_tune_get(const char *key)
 {
-	gc_mem_t *old;
-	old = gc_root;
-	gc_root = old->next;
-	free(old);
+	if (strcmp(key, "min-bytes") == 0)
+		return gc_policy.min_bytes;
+	if (strcmp(key, "min-objects") == 0)
+		return gc_policy.min_objs;
+	if (strcmp(key, "growth") == 0)
+		return gc_policy.growth;
+	if (strcmp(key, "growth-max") == 0)
+		return gc_policy.growth_max;
+	if (strcmp(key, "stress") == 0)
+		return gc_policy.stress;
+	if (strcmp(key, "pointer-reversal") == 0)
+		return gc_policy.reverse;
+	if (strcmp(key, "generational") == 0)
+		return gc_policy.generational;
+	if (strcmp(key, "nursery-bytes") == 0)
+		return gc_policy.nursery;
+	if (strcmp(key, "trace") == 0)
+		return gc_policy.trace;
+	return 0.0;
 }
 
-void gc_sweep(void)
+static void gc_report_counts(FILE *out, const char *what,
+			     unsigned long *count)
+{
+	unsigned long sum = 0;
+	unsigned i;
+
+	for (i = 0; i < NTYPES; i++)
+		sum += count[i];
+	fprintf(out, "gc: %lu objects %s", sum, what);
+	for (i = 0; i < NTYPES; i++)
+		if (count[i])
+			fprintf(out, ", %s %lu", gc_type_names[i], count[i]);
+	fputc('\n', out);
+}
+
+static void gc_report_hist(FILE *out, const char *what, unsigned long *hist)
+{
+	unsigned n;
+
+	fprintf(out, "gc: %s pauses", what);
+	for (n = 0; n < GC_HIST; n++)
+		if (hist[n])
+			fprintf(out, ", %lu under %lu us", hist[n], 1ul << n);
+	fputc('\n', out);
+}
+
+void gc_report(FILE *out)
+{
+	struct rusage ru;
+
+	fprintf(out, "gc: %lu cycles, %.3f ms total pause, "
+		"%.3f ms max pause\n", gc_stats.cycles,
+		gc_stats.pause * 1e3, gc_stats.pause_max * 1e3);
+	fprintf(out, "gc: %lu objects (%lu bytes) freed, "
+		"%lu objects (%lu bytes) live\n",
+		gc_stats.freed, (unsigned long)gc_stats.freed_bytes,
+		(unsigned long)gc_stats.live,
+		(unsigned long)gc_stats.live_bytes);
+	if (gc_stats.minors)
+		fprintf(out, "gc: %lu minor cycles, %.3f ms total pause, "
+			"%.3f ms max pause, %lu objects promoted\n",
+			gc_stats.minors, gc_stats.minor_pause * 1e3,
+			gc_stats.minor_pause_max * 1e3, gc_stats.promoted);
+	gc_report_counts(out, "allocated", gc_stats.allocs);
+	fprintf(out, "gc: %lu bytes allocated, %lu of them outside the "
+		"heap\n", (unsigned long)gc_allocated(),
+		(unsigned long)gc_stats.charged);
+	gc_report_hist(out, "mark", gc_stats.mark_hist);
+	gc_report_hist(out, "sweep", gc_stats.sweep_hist);
+	fprintf(out, "gc: root stack peak %lu\n",
+		(unsigned long)gc_roots_peak());
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(out, "gc: peak rss %ld KB\n", ru.ru_maxrss);
+}
+
+static void *gc_take(struct gc_pool *pool, unsigned shift)
+{
+	gc_page_t *pg;
+	void *obj;
+
+	if (gc_policy.stress || gc_bytes >= gc_next_bytes ||
+	    gc_objs >= gc_next_objs)
+		gc_collect();
+	else if (gc_policy.generational &&
+		 gc_young_bytes >= gc_policy.nursery)
+		gc_minor();
+
+	if ((obj = pool->free))
+		pool->free = *(void**)obj;
+	else
+		obj = gc_bump(pool, shift);
+	pg = page_of(obj);
+	bit_set(pg->alloc, cell_index(pg, obj));
+
+	if (gc_policy.generational) {
+		bit_set(pg->young, cell_index(pg, obj));
+		if (!pg->nursery) {
+			pg->nursery = 1;
+			pg->ynext = gc_nursery;
+			gc_nursery = pg;
+		}
+		gc_young_bytes += (size_t)1 << shift;
+	} else {
+		gc_bytes += (size_t)1 << shift;
+		gc_objs++;
+	}
+	return obj;
+}
+
+/* A cell of type for an object of size bytes, its type byte set */
+void *gc_alloc(uint8_t type, size_t size)
+{
+	unsigned shift;
+	sexp_t *obj;
+
+	for (shift = GC_MIN_SHIFT; ((size_t)1 << shift) < size; shift++)
+		;
+	if (shift >= GC_MIN_SHIFT + GC_CLASSES) {
+		fprintf(stderr, "error: no size class for %lu bytes\n",
+			(unsigned long)size);
+		exit(1);
+	}
+	obj = gc_take(&gc_pools[shift - GC_MIN_SHIFT], shift);
+	obj->type = type;
+	gc_stats.allocs[type]++;
+	gc_stats.alloc_bytes[type] += (size_t)1 << shift;
+	return obj;
+}
+
+/* Returns the cell of a cons, not yet the pointer to it */
+void *gc_alloc_cons(void)
+{
+	gc_stats.allocs[CONS]++;
+	gc_stats.alloc_bytes[CONS] += (size_t)1 << GC_MIN_SHIFT;
+	return gc_take(&gc_pools[GC_CONS_POOL], GC_MIN_SHIFT);
+}
+
+/* Records an old object that was made to point at a young one */
+void gc_barrier(void *obj, void *val)
+{
+	gc_page_t *pg;
+	unsigned i;
+
+	if (!val || isfixnum(val) || !young(val))
+		return;
+	pg = page_of(obj);
+	i = cell_index(pg, obj);
+	if (bit_test(pg->young, i) || bit_test(pg->rem, i))
+		return;
+	bit_set(pg->rem, i);
+	if (gc_nrem == gc_remsize) {
+		gc_remsize = gc_remsize ? 2*gc_remsize : 256;
+		gc_remset = realloc(gc_remset, gc_remsize * sizeof(*gc_remset));
+		if (!gc_remset) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+	}
+	gc_remset[gc_nrem++] = obj;
+}
+
+/*
+ * Between cycles every mark bit is clear, so a walk that allocates
+ * nothing may borrow them to note the cells it has met, and clear
+ * them all with gc_visit_end before the next allocation.
+ */
+int gc_visit(sexp_t *cell)
+{
+	gc_page_t *pg = page_of(cell);
+	unsigned i = cell_index(pg, cell);
+
+	if (bit_test(pg->mark, i))
+		return 1;
+	bit_set(pg->mark, i);
+	return 0;
+}
+
+void gc_visit_end(void)
+{
+	gc_page_t *pg;
+	unsigned c;
+
+	for (c = 0; c <= GC_CLASSES; c++)
+		for (pg = gc_pools[c].pages; pg; pg = pg->next)
+			memset(pg->mark, 0, sizeof(pg->mark));
+}
+
+/* Counts memory malloc'd for a new cell towards the next cycle */
+void gc_charge(size_t bytes)
+{
+	gc_stats.charged += bytes;
+	if (gc_policy.generational)
+		gc_young_bytes += bytes;
+	else
+		gc_bytes += bytes;
+}
+
+/* Makes room for at least n more roots */
+void gc_grow(size_t n)
+{
+	size_t depth = gc_sp - gc_root;
+	size_t old = gc_top - gc_root, size = old;
+
+	while (size - depth < n)
+		size = size ? 2*size : 1024;
+	gc_root = realloc(gc_root, size * sizeof(*gc_root));
+#ifdef GC_DEBUG
+	gc_owner = realloc(gc_owner, size * sizeof(*gc_owner));
+#endif
+	if (!gc_root) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	/* slots never pushed stay NULL, for gc_roots_peak */
+	memset(gc_root + old, 0, (size - old) * sizeof(*gc_root));
+	gc_sp = gc_root + depth;
+	gc_top = gc_root + size;
+}
+
+#ifdef GC_DEBUG
+void gc_check_push(const char *func, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		gc_owner[gc_sp - gc_root + i] = func;
+}
+
+void gc_check_pop(const char *func, size_t n)
+{
+	size_t i;
+	if ((size_t)(gc_sp - gc_root) < n) {
+		fprintf(stderr, "gc: %s pops an empty root stack\n", func);
+		abort();
+	}
+	for (i = 1; i <= n; i++)
+		if (strcmp(gc_owner[gc_sp - gc_root - i], func) != 0) {
+			fprintf(stderr, "gc: %s pops a root pushed by %s\n",
+				func, gc_owner[gc_sp - gc_root - i]);
+			abort();
+		}
+}
+
+void gc_check_frame(struct gc_frame *f)
+{
+	/* by depth: growing the stack may have moved it */
+	if (gc_roots() != f->depth) {
+		fprintf(stderr, "gc: %s returns with %ld roots unbalanced\n",
+			f->func, (long)(gc_roots() - f->depth));
+		abort();
+	}
+}
+#endif
+
+/* Releases what a dead object owns outside the heap */
+static void gc_finalize(sexp_t *obj)
 {
-	gc_mem_t **cur, *elt;
-	for (cur = &gc_memlist; *cur; ) {
-		elt = *cur;
-		if (!marked(elt->loc)) {
-			*cur = elt->next;
-			if (type(elt->loc) == ENV)
-				env_clear((void*)elt->loc);
-			free(elt->loc);
-			free(elt);
+	switch (type(obj)) {
+	case ENV:
+		env_clear((env_t*)obj);
+		break;
+	case SYM:
+		symbol_free(obj);
+		break;
+	case CODE:
+		free(((code_t*)obj)->ops);
+		free(((code_t*)obj)->consts);
+		break;
+	case BIG:
+		big_free(obj);
+		break;
+	case VECTOR:
+		free(vector_elems(obj));
+		break;
+	case STRING:
+		free(string_chars(obj));
+		break;
+	}
+}
+
+/* Frees unmarked cells and rebuilds the free lists, page by page */
+static void sweep_pool(struct gc_pool *pool, size_t *freed, size_t *live)
+{
+	gc_page_t **cur, *pg;
+	unsigned w, i, nlive;
+	uint32_t dead, bits;
+
+	pool->free = NULL;
+	for (cur = &pool->pages; (pg = *cur); ) {
+		nlive = 0;
+		for (w = 0; w < (pg->bump + 31) / 32; w++) {
+			dead = pg->alloc[w] & ~pg->mark[w];
+			for (; dead; dead &= dead - 1) {
+				i = w*32 + __builtin_ctz(dead);
+				if (!pg->conses)
+					gc_finalize((sexp_t*)page_cell(pg, i));
+				(*freed)++;
+			}
+			nlive += __builtin_popcount(pg->mark[w]);
+			pg->alloc[w] = pg->mark[w];
+			pg->mark[w] = 0;
+			pg->young[w] = 0;
+		}
+		*live += nlive;
+
+		if (nlive == 0 && pg == pool->cur) {
+			pg->bump = 0;
+		} else if (nlive == 0) {
+			*cur = pg->next;
+			gc_free_page(pg);
+			continue;
 		} else {
-			((sexp_t*)elt->loc)->type &= ~0x80;
-			cur = &elt->next;
+			for (w = 0; w < (pg->bump + 31) / 32; w++) {
+				bits = ~pg->alloc[w];
+				if (w == pg->bump / 32)
+					bits &= (1u << (pg->bump & 31)) - 1;
+				for (; bits; bits &= bits - 1) {
+					i = w*32 + __builtin_ctz(bits);
+					*(void**)page_cell(pg, i) = pool->free;
+					pool->free = page_cell(pg, i);
+				}
+			}
 		}
+		cur = &pg->next;
+	}
+}
+
+void gc_sweep(void)
+{
+	size_t freed = 0, freed_bytes = 0, live = 0, live_bytes = 0;
+	size_t f, l;
+	unsigned c, shift;
+
+	for (c = 0; c <= GC_CLASSES; c++) {
+		f = l = 0;
+		sweep_pool(&gc_pools[c], &f, &l);
+		shift = c == GC_CONS_POOL ? GC_MIN_SHIFT : GC_MIN_SHIFT + c;
+		freed += f;
+		live += l;
+		freed_bytes += f << shift;
+		live_bytes += l << shift;
 	}
+	gc_stats.freed += freed;
+	gc_stats.freed_bytes += freed_bytes;
+	gc_stats.last_freed = freed;
+	gc_stats.live = live;
+	gc_stats.live_bytes = live_bytes;
 }
 
-void mark_recur(sexp_t *exp)
+/*
+ * Mark
+ *
+ * Objects are marked when pushed onto an explicit mark stack and
+ * scanned when popped, so marking a long list or a deep tree costs
+ * heap rather than C stack.  With the 'pointer-reversal' setting,
+ * conses are traversed Deutsch-Schorr-Waite style instead: the path
+ * back to the root is threaded through the car and cdr fields being
+ * visited, and the flip bitmap records which of the two is reversed.
+ * Environments, code and vectors still go through the mark stack.
+ */
+
+static sexp_t **mark_stack;
+static size_t mark_depth, mark_size;
+
+static void mark_push(sexp_t *exp)
 {
-	if (marked(exp))
+	gc_page_t *pg;
+	unsigned i;
+
+	if (!exp || isfixnum(exp))
 		return;
-	exp->type |= 0x80;
-	if (type(exp) == ENV) {
-		struct binding *b;
-		env_t *env = (env_t*)exp;
-		for (b = env->first; b; b = b->next)
-			mark_recur(b->val);
-		if (env->par)
-			mark_recur((void*)env->par);
-	} else {
-		switch (type(exp)) {
-		case CONS:
-		case LAMBDA:
-		case MACRO:
-			mark_recur(car(exp));
-			mark_recur(cdr(exp));
+	pg = page_of(exp);
+	i = cell_index(pg, exp);
+	if (bit_test(pg->mark, i) ||
+	    (gc_minor_active && !bit_test(pg->young, i)))
+		return;
+	bit_set(pg->mark, i);
+	if (mark_depth == mark_size) {
+		mark_size = mark_size ? 2*mark_size : 1024;
+		mark_stack = realloc(mark_stack,
+				     mark_size * sizeof(*mark_stack));
+		if (!mark_stack) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+	}
+	mark_stack[mark_depth++] = exp;
+}
+
+#define flipped(X)	(bit_test(page_of(X)->flip, cell_index(page_of(X), X)))
+#define set_flip(X)	(bit_set(page_of(X)->flip, cell_index(page_of(X), X)))
+#define clear_flip(X)	(bit_clear(page_of(X)->flip, cell_index(page_of(X), X)))
+#define store_car(X,A)	((X)->car = (A))
+#define store_cdr(X,D)	((X)->cdr = (D))
+
+static void mark_reverse(sexp_t *cur)
+{
+	sexp_t *prev = NULL, *next;
+
+	for (;;) {
+		/* advance down car fields, reversing them */
+		while (cur && !isfixnum(cur) && !marked(cur)) {
+			if (type(cur) == ENV || type(cur) == CODE ||
+			    type(cur) == VECTOR) {
+				mark_push(cur);
+				break;
+			}
+			set_mark(cur);
+			if (type(cur) == LREF || type(cur) == GREF ||
+			    type(cur) == PARAMS) {
+				mark_push(car(cur));	/* cdr is no object */
+				break;
+			}
+			if (type(cur) != CONS && type(cur) != LAMBDA &&
+			    type(cur) != MACRO && type(cur) != CLOSURE)
+				break;
+			if (type(cur) != CONS)
+				mark_push(cdr(cur));	/* environment */
+			next = car(cur);
+			store_car(cur, prev);
+			prev = cur;
+			cur = next;
+		}
+		/* retreat until a cdr is left to visit */
+		for (;;) {
+			if (!prev)
+				return;
+			if (flipped(prev)) {
+				next = cdr(prev);
+				store_cdr(prev, cur);
+				clear_flip(prev);
+				cur = prev;
+				prev = next;
+			} else if (type(prev) == CONS) {
+				next = car(prev);
+				store_car(prev, cur);
+				cur = cdr(prev);
+				store_cdr(prev, next);
+				set_flip(prev);
+				break;
+			} else {
+				next = car(prev);
+				store_car(prev, cur);
+				cur = prev;
+				prev = next;
+			}
+		}
+	}
+}
+
+static void mark_object(sexp_t *exp)
+{
+	if (gc_policy.reverse && !gc_minor_active)
+		mark_reverse(exp);
+	else
+		mark_push(exp);
+}
+
+static void mark_fields(sexp_t *exp)
+{
+	struct binding *b;
+	env_t *env;
+	size_t i;
+
+	switch (type(exp)) {
+	case ENV:
+		env = (env_t*)exp;
+		if (!env->par) {
+			for (i = 0; i < env->tab->size; i++)
+				for (b = env->tab->slot[i]; b; b = b->next) {
+					mark_push(b->sym);
+					mark_object(b->val);
+				}
 			break;
 		}
+		for (i = 0; i < env->size; i++)
+			mark_object(env->vals[i]);
+		mark_push(env->params);
+		mark_push((sexp_t*)env->par);
+		break;
+	case LREF:
+	case GREF:
+	case PARAMS:
+		mark_push(car(exp));
+		break;
+	case CODE:
+		for (i = 0; i < ((code_t*)exp)->nconsts; i++)
+			mark_object(((code_t*)exp)->consts[i]);
+		mark_push(((code_t*)exp)->src);
+		break;
+	case VECTOR:
+		for (i = 0; i < vector_len(exp); i++)
+			mark_object(vector_elems(exp)[i]);
+		break;
+	case CONS:
+	case LAMBDA:
+	case MACRO:
+	case CLOSURE:
+		mark_push(cdr(exp));
+		mark_push(car(exp));
+		break;
 	}
 }
 
+static void mark_drain(void)
+{
+	while (mark_depth)
+		mark_fields(mark_stack[--mark_depth]);
+}
+
+static void mark_root(sexp_t *exp)
+{
+	mark_object(exp);
+	mark_drain();
+}
+
+/* Whether exp survives the cycle being marked, as far as known yet */
+static int gc_live(sexp_t *exp)
+{
+	return !exp || isfixnum(exp) || marked(exp) ||
+		(gc_minor_active && !young(exp));
+}
+
 void gc_mark(void)
 {
-	gc_mem_t *mem;
-	for (mem = gc_root; mem; mem = mem->next)
-		if (*(void**)mem->loc)
-			mark_recur(*(void**)mem->loc);
+	sexp_t ***root;
+	for (root = gc_root; root < gc_sp; root++)
+		mark_root(**root);
+	vm_mark(mark_root);
+	profile_mark(mark_root);
+	macro_cache_gc(gc_live, mark_root);
 }
 
+/* Frees the dead nursery cells and promotes the survivors */
+static void sweep_nursery(size_t *freed, size_t *live, size_t *live_bytes)
+{
+	struct gc_pool *pool;
+	gc_page_t *pg;
+	unsigned w, i;
+	uint32_t dead;
 
+	for (pg = gc_nursery; pg; pg = pg->ynext) {
+		pool = &gc_pools[pg->conses ? GC_CONS_POOL :
+				 pg->shift - GC_MIN_SHIFT];
+		for (w = 0; w < (pg->bump + 31) / 32; w++) {
+			if (!pg->young[w])
+				continue;
+			dead = pg->young[w] & ~pg->mark[w];
+			for (; dead; dead &= dead - 1) {
+				i = w*32 + __builtin_ctz(dead);
+				if (!pg->conses)
+					gc_finalize((sexp_t*)page_cell(pg, i));
+				bit_clear(pg->alloc, i);
+				*(void**)page_cell(pg, i) = pool->free;
+				pool->free = page_cell(pg, i);
+				(*freed)++;
+				gc_stats.freed_bytes += (size_t)1 << pg->shift;
+			}
+			*live += __builtin_popcount(pg->mark[w]);
+			*live_bytes += (size_t)__builtin_popcount(pg->mark[w])
+				<< pg->shift;
+			pg->young[w] = 0;
+			pg->mark[w] = 0;
+		}
+	}
+}
+
+/* Runs a minor cycle, returns the number of objects freed */
+size_t gc_minor(void)
+{
+	double start, mid, pause;
+	sexp_t ***root;
+	size_t i, freed = 0, live = 0, live_bytes = 0;
+
+	start = gc_clock();
+	gc_minor_active = 1;
+	for (root = gc_root; root < gc_sp; root++) {
+		mark_push(**root);
+		mark_drain();
+	}
+	vm_mark(mark_root);
+	profile_mark(mark_root);
+	for (i = 0; i < gc_nrem; i++) {
+		mark_fields(gc_remset[i]);
+		mark_drain();
+	}
+	macro_cache_gc(gc_live, mark_root);
+	gc_minor_active = 0;
+	mid = gc_clock();
+	sweep_nursery(&freed, &live, &live_bytes);
+	gc_forget();
+	pause = gc_clock() - start;
+
+	gc_stats.minors++;
+	gc_stats.minor_pause += pause;
+	if (pause > gc_stats.minor_pause_max)
+		gc_stats.minor_pause_max = pause;
+	gc_hist(gc_stats.mark_hist, mid - start);
+	gc_hist(gc_stats.sweep_hist, start + pause - mid);
+	if (gc_policy.trace)
+		gc_trace("minor", mid - start, start + pause - mid,
+			 freed, live, live_bytes);
+	gc_stats.freed += freed;
+	gc_stats.promoted += live;
+	gc_objs += live;
+	gc_bytes += live_bytes;
+	return freed;
+}
+
+size_t gc_roots(void)
+{
+	return gc_sp - gc_root;
+}
+
+/*
+ * Deepest the root stack has been: pops leave their slots behind and
+ * gc_grow clears the new ones, so it is the last slot not NULL.
+ */
+size_t gc_roots_peak(void)
+{
+	sexp_t ***root;
+
+	for (root = gc_top; root > gc_sp && !root[-1]; root--)
+		;
+	return root - gc_root;
+}
+
+/*
+ * Counts the objects in the heap by type: those that survived the last
+ * cycle and those allocated since, live or not.
+ */
+void gc_census(unsigned long *count)
+{
+	gc_page_t *pg;
+	unsigned c, w, i;
+	uint32_t bits;
+
+	memset(count, 0, NTYPES * sizeof(*count));
+	for (c = 0; c <= GC_CLASSES; c++)
+		for (pg = gc_pools[c].pages; pg; pg = pg->next)
+			for (w = 0; w < (pg->bump + 31) / 32; w++) {
+				bits = pg->alloc[w];
+				if (pg->conses) {
+					count[CONS] += __builtin_popcount(bits);
+					continue;
+				}
+				for (; bits; bits &= bits - 1) {
+					i = w*32 + __builtin_ctz(bits);
+					count[*(uint8_t*)page_cell(pg, i)]++;
+				}
+			}
+}
 
 void gc_dump_stack(void)
 {
-	gc_mem_t *mem;
-	for (mem = gc_root; mem; mem = mem->next)
-		print_sexpnl(*(void**)mem->loc, stdout);
+	sexp_t ***root;
+	for (root = gc_sp; root-- > gc_root; )
+		if (**root)
+			print_sexpnl(**root, stdout);
 }
 
 void gc_dump(void)
 {
-	gc_mem_t *mem;
-	for (mem = gc_memlist; mem; mem = mem->next) {
-		if (!marked(mem->loc)) {
-			fprintf(stdout, "%%%% ");
-		}
-		print_sexpnl(mem->loc, stdout);
-	}
+	gc_page_t *pg;
+	unsigned c, i;
+	char *obj;
+	for (c = 0; c <= GC_CLASSES; c++)
+		for (pg = gc_pools[c].pages; pg; pg = pg->next)
+			for (i = 0; i < pg->bump; i++) {
+				if (!bit_test(pg->alloc, i))
+					continue;
+				if (!bit_test(pg->mark, i))
+					fprintf(stdout, "%%%% ");
+				obj = page_cell(pg, i);
+				if (pg->conses)
+					obj -= CONS_BIT;
+				print_sexpnl((sexp_t*)obj, stdout);
+			}
 }
 
@@ -31,10 +31,7 @@ sexp_t *prim_eq(sexp_t *args)
 {
 	if (list_len(args) < 2)
 		return t;
-	if (type(car(args)) == NIL || type(car(cdr(args))) == NIL)
-		return (car(args) == car(cdr(args))) ? t : nil;
-	if ((car(args)->data == car(cdr(args))->data) &&
-	    (prim_eq(cdr(args)) == t))
+	if (eq_atoms(car(args), car(cdr(args))) && prim_eq(cdr(args)) == t)
 		return t;
 	return nil;
 }
@@ -82,6 +79,7 @@ sexp_t *prim_list(sexp_t *args)
 sexp_t *prim_append(sexp_t *args)
 {
 	sexp_t *lst, *ret;
+	gc_frame();
 	if (list_len(args) == 0)
 		return nil;
 	if (isnil(car(args)))
@@ -95,7 +93,7 @@ sexp_t *prim_append(sexp_t *args)
 	for (ret = lst = copy_list(car(args)); cdr(lst) != nil; lst = cdr(lst))
 		;
 	gc_push(&ret);
-	lst->data = make_cons(car(lst), prim_append(cdr(args)));
+	set_cdr(lst, prim_append(cdr(args)));
 	gc_pop();
 	return ret;
 }
@@ -106,7 +104,7 @@ sexp_t *prim_eval(sexp_t *args, env_t *env)
 		fprintf(stderr, "error: argument count eval\n");
 		return NULL;
 	}
-	return eval(car(args), env);
+	return evaluate(car(args), env);
 }
 
 sexp_t *prim_apply(sexp_t *args, env_t *env)
@@ -124,143 +122,216 @@ sexp_t *prim_progn(sexp_t *args)
 	return car(args);
 }
 
-#define addmul(F,OP,ID) \
-	sexp_t *n1, *n2; \
-	if (list_len(args) == 0) \
-		return int_(ID); \
-	n1 = car(args); \
-	if (!isnum(n1)) { \
+/*
+ * Arithmetic
+ *
+ * The n-ary primitives fold their arguments in one pass.  Integers
+ * stay fixnums as long as the overflow builtins allow and become
+ * bignums after that.  The first float turns the accumulator into a
+ * double in a register, and only the result is allocated.  The num_
+ * functions take exactly two numbers, for eval and the vm to call on
+ * (+ a b) and the like without building an argument list.
+ */
+#define num_check(X)	if (!(X) || !isnum(X)) { \
 		fprintf(stderr, "error: number expected\n"); \
 		return NULL; \
-	} \
-	if (list_len(args) == 1) \
-		return new_sexp(type(n1), n1->data); \
-	n2 = F(cdr(args)); \
-	if (!n2) \
-		return NULL; \
-	gc_push(&n2); \
-	if (isint(n1)) { \
-		n2 = isint(n2) ? \
-			int_(get_int(n1) OP get_int(n2)) : \
-			float_(get_int(n1) OP get_float(n2)); \
-		gc_pop(); \
-		return n2; \
-	} else { \
-		/* this is necessary because of sequence points */ \
-		double f = get_float(n2); \
-		n2 = isint(n2) ?  \
-			float_(get_float(n1) OP get_int(n2)) : \
-			float_(get_float(n1) OP f); \
-		gc_pop(); \
-		return n2; \
-	}
-sexp_t *prim_add(sexp_t *args) { addmul(prim_add, +, 0); }
-sexp_t *prim_mul(sexp_t *args) { addmul(prim_mul, *, 1); }
-#undef addmul
+	}
+#define float_op(op, f, g) \
+	((op) == '+' ? (f) + (g) : (op) == '-' ? (f) - (g) : (f) * (g))
+
+/* a op b for numbers a and b, op being one of + - * */
+static sexp_t *arith(int op, sexp_t *a, sexp_t *b)
+{
+	int32_t x, y, r;
+
+	if (isint(a) && isint(b)) {
+		x = get_int(a);
+		y = get_int(b);
+		if (!(op == '+' ? __builtin_add_overflow(x, y, &r) :
+		      op == '-' ? __builtin_sub_overflow(x, y, &r) :
+		      __builtin_mul_overflow(x, y, &r)))
+			return int_(r);
+	} else if (isfloat(a) || isfloat(b))
+		return float_(float_op(op, num_val(a), num_val(b)));
+	return op == '+' ? big_add(a, b) :
+		op == '-' ? big_sub(a, b) : big_mul(a, b);
+}
+
+/* Folds the numbers in args into acc */
+static sexp_t *fold(int op, sexp_t *acc, sexp_t *args)
+{
+	sexp_t *n;
+	double f = 0.0;
+	int isf = 0;
+
+	for (; args != nil; args = cdr(args)) {
+		n = car(args);
+		num_check(n);
+		if (!isf && (isfloat(acc) || isfloat(n))) {
+			f = num_val(acc);
+			isf = 1;
+		}
+		if (isf)
+			f = float_op(op, f, num_val(n));
+		else
+			acc = arith(op, acc, n);
+	}
+	return isf ? float_(f) : acc;
+}
+
+sexp_t *prim_add(sexp_t *args)
+{
+	return fold('+', int_(0), args);
+}
+
+sexp_t *prim_mul(sexp_t *args)
+{
+	return fold('*', int_(1), args);
+}
 
 sexp_t *prim_sub(sexp_t *args)
 {
-	sexp_t *n1, *n2;
-	if (list_len(args) == 0) {
+	sexp_t *n;
+
+	if (args == nil) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
 	}
-	n1 = car(args);
-	if (!isnum(n1)) {
-		fprintf(stderr, "error: number expected\n");
-		return NULL;
-	}
-	if (list_len(args) == 1)
-		return isint(n1) ? int_(-get_int(n1)) : float_(-get_float(n1));
-	n2 = prim_add(cdr(args));
-	if (!n2)
-		return NULL;
-	gc_push(&n2);
-	n2->data = isint(n2) ?
-		make_int(-get_int(n2)) :
-		make_float(-get_float(n2));
-	n2 = cons(n2, nil);
-	n2 = cons(n1, n2);
-	n2 = prim_add(n2);
-	gc_pop();
-	return n2;
+	n = car(args);
+	num_check(n);
+	if (cdr(args) != nil)
+		return fold('-', n, cdr(args));
+	return isfloat(n) ? float_(-get_float(n)) : arith('-', int_(0), n);
 }
 
 /* TODO; return ints when possible */
 sexp_t *prim_div(sexp_t *args)
 {
-	sexp_t *n1, *n2;
-	if (list_len(args) == 0) {
+	sexp_t *n;
+	double f;
+
+	if (args == nil) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
 	}
-	n1 = car(args);
-	if (!isnum(n1)) {
-		fprintf(stderr, "error: number expected\n");
+	n = car(args);
+	num_check(n);
+	if (cdr(args) == nil)
+		return float_(1.0/num_val(n));
+	f = num_val(n);
+	for (args = cdr(args); args != nil; args = cdr(args)) {
+		n = car(args);
+		num_check(n);
+		f /= num_val(n);
+	}
+	return float_(f);
+}
+
+/* Truncating integer division, the remainder has the sign of a */
+static sexp_t *divide(sexp_t *args, int rem)
+{
+	sexp_t *a, *b;
+
+	if (list_len(args) != 2) {
+		fprintf(stderr, "error: argument count\n");
 		return NULL;
 	}
-	if (list_len(args) == 1)
-		return isint(n1) ? float_(1.0/get_int(n1)) :
-			float_(1.0/get_float(n1));
-	n2 = prim_mul(cdr(args));
-	if (!n2)
+	a = car(args);
+	b = car(cdr(args));
+	if (!a || !b || !isinteger(a) || !isinteger(b)) {
+		fprintf(stderr, "error: integer expected\n");
 		return NULL;
-	gc_push(&n2);
-	n2->data = isint(n2) ?
-		make_float(1.0/get_int(n2)) :
-		make_float(1.0/get_float(n2));
-	n2->type = FLOAT;
-	n2 = cons(n2, nil);
-	n2 = cons(n1, n2);
-	n2 = prim_mul(n2);
-	gc_pop();
-	return n2;
-}
-
-#define num_cmp(F,OP) \
-	sexp_t *n1, *n2;\
-	int test;\
-	if (list_len(args) == 0)\
-		return t;\
-	n1 = car(args);\
-	if (!isnum(n1)) {\
-		fprintf(stderr, "error: number expected\n");\
-		return NULL;\
-	}\
-	if (list_len(args) < 2)\
-		return t;\
-	n2 = car(cdr(args));\
-	if (!isnum(n2)) {\
-		fprintf(stderr, "error: number expected\n");\
-		return NULL;\
-	}\
-	if (isint(n1))\
-		test = isint(n2) ?\
-			(get_int(n1) OP get_int(n2)) :\
-			(get_int(n1) OP get_float(n2));\
-	else {\
-		/* this is necessary because of to sequence points */\
-		double f = get_float(n2);\
-		test = isint(n2) ?\
-			(get_float(n1) OP get_int(n2)) :\
-			(get_float(n1) OP f);\
-	}\
-	if (!test)\
-		return nil;\
-	return F(cdr(args));
-sexp_t *prim_numeq(sexp_t *args) { num_cmp(prim_numeq, ==); }
-sexp_t *prim_numlt(sexp_t *args) { num_cmp(prim_numlt, <); }
-sexp_t *prim_numgt(sexp_t *args) { num_cmp(prim_numgt, >); }
-sexp_t *prim_numle(sexp_t *args) { num_cmp(prim_numle, <=); }
-sexp_t *prim_numge(sexp_t *args) { num_cmp(prim_numge, >=); }
+	}
+	if (isint(a) && isint(b) && get_int(b) != 0 &&
+	    !(get_int(a) == INT32_MIN && get_int(b) == -1))
+		return int_(rem ? get_int(a) % get_int(b) :
+			    get_int(a) / get_int(b));
+	return rem ? big_remainder(a, b) : big_quotient(a, b);
+}
+
+sexp_t *prim_quotient(sexp_t *args)
+{
+	return divide(args, 0);
+}
+
+sexp_t *prim_remainder(sexp_t *args)
+{
+	return divide(args, 1);
+}
+
+#define arith2(F, OP) \
+sexp_t *F(sexp_t *a, sexp_t *b) \
+{ \
+	num_check(a); \
+	num_check(b); \
+	return arith(OP, a, b); \
+}
+arith2(num_add, '+')
+arith2(num_sub, '-')
+arith2(num_mul, '*')
+#undef arith2
+
+sexp_t *num_div(sexp_t *a, sexp_t *b)
+{
+	num_check(a);
+	num_check(b);
+	return float_(num_val(a) / num_val(b));
+}
+
+/* Integers compare exactly, a float and another number as doubles */
+#define compare(a, b, OP) (isint(a) && isint(b) ? \
+	get_int(a) OP get_int(b) : isfloat(a) || isfloat(b) ? \
+	num_val(a) OP num_val(b) : big_cmp(a, b) OP 0)
+
+#define num_cmp(OP) \
+	sexp_t *n1, *n2; \
+	if (args == nil) \
+		return t; \
+	n1 = car(args); \
+	num_check(n1); \
+	for (args = cdr(args); args != nil; args = cdr(args), n1 = n2) { \
+		n2 = car(args); \
+		num_check(n2); \
+		if (!compare(n1, n2, OP)) \
+			return nil; \
+	} \
+	return t;
+sexp_t *prim_numeq(sexp_t *args) { num_cmp(==); }
+sexp_t *prim_numlt(sexp_t *args) { num_cmp(<); }
+sexp_t *prim_numgt(sexp_t *args) { num_cmp(>); }
+sexp_t *prim_numle(sexp_t *args) { num_cmp(<=); }
+sexp_t *prim_numge(sexp_t *args) { num_cmp(>=); }
 #undef num_cmp
 
+#define cmp2(F, OP) \
+sexp_t *F(sexp_t *a, sexp_t *b) \
+{ \
+	num_check(a); \
+	num_check(b); \
+	return compare(a, b, OP) ? t : nil; \
+}
+cmp2(num_eq, ==)
+cmp2(num_lt, <)
+cmp2(num_gt, >)
+cmp2(num_le, <=)
+cmp2(num_ge, >=)
+#undef cmp2
+#undef compare
+#undef float_op
+#undef num_check
+
+/* Like print, but strings are written as they are */
 sexp_t *prim_display(sexp_t *args)
 {
 	for (; args != nil; args = cdr(args)) {
-		print_sexp(car(args), stdout);
-		putc(' ', stdout);
+		if (car(args) && isstring(car(args)))
+			print_write(string_chars(car(args)),
+				    string_len(car(args)), stdout);
+		else
+			print_put(car(args), stdout);
+		print_putc(' ', stdout);
 	}
+	print_flush(stdout);
 	return NULL;
 }
 
@@ -279,7 +350,511 @@ sexp_t *prim_print(sexp_t *args)
 
 sexp_t *prim_read()
 {
-	return read_sexp(stdin);
+	return read_sexp(std_in);
+}
+
+/* The file named by the symbol or string x, or NULL after complaining */
+static const char *file_name(sexp_t *x)
+{
+	if (x && issym(x))
+		return get_symname(x);
+	if (x && isstring(x) && !memchr(string_chars(x), '\0', string_len(x)))
+		return string_chars(x);
+	fprintf(stderr, "error: file name expected\n");
+	return NULL;
+}
+
+/* (save-image file) */
+sexp_t *prim_save_image(sexp_t *args)
+{
+	const char *file;
+
+	if (!(file = file_name(iscons(args) ? car(args) : NULL)))
+		return NULL;
+	return image_save(file) ? nil : t;
+}
+
+/* (fasl-write x file) */
+sexp_t *prim_fasl_write(sexp_t *args)
+{
+	const char *file;
+
+	if (!(file = file_name(iscons(args) && iscons(cdr(args)) ?
+			       car(cdr(args)) : NULL)))
+		return NULL;
+	return fasl_write(car(args), file) ? nil : t;
+}
+
+/* (fasl-read file) */
+sexp_t *prim_fasl_read(sexp_t *args)
+{
+	const char *file;
+
+	if (!(file = file_name(iscons(args) ? car(args) : NULL)))
+		return NULL;
+	return fasl_read(file);
+}
+
+/* (profile-start [calls | samples]) */
+sexp_t *prim_profile_start(sexp_t *args)
+{
+	int mode = PROFILE_CALLS;
+
+	if (iscons(args)) {
+		if (car(args) && issym(car(args)) &&
+		    strcmp(get_symname(car(args)), "samples") == 0)
+			mode = PROFILE_SAMPLES;
+		else if (!car(args) || !issym(car(args)) ||
+			 strcmp(get_symname(car(args)), "calls") != 0) {
+			fprintf(stderr, "error: calls or samples expected\n");
+			return NULL;
+		}
+	}
+	return profile_start(mode) ? NULL : t;
+}
+
+/* (profile-report [file]), writing the collapsed stacks to file */
+sexp_t *prim_profile_report(sexp_t *args)
+{
+	const char *file = NULL;
+
+	if (iscons(args) && !(file = file_name(car(args))))
+		return NULL;
+	return profile_report(stdout, file) ? nil : t;
+}
+
+/* A counter, a bignum once it outgrows a fixnum */
+static sexp_t *count_(uint64_t n)
+{
+	uint32_t d[2];
+
+	d[0] = (uint32_t)n;
+	d[1] = (uint32_t)(n >> 32);
+	return big_from_limbs(d, 2, 0);
+}
+
+sexp_t *prim_gc()
+{
+	return count_(gc_collect());
+}
+
+/* (gc-tune [key value]...), returns the settings as an alist */
+sexp_t *prim_gc_tune(sexp_t *args)
+{
+	sexp_t *ret, *pair, *key;
+	double val;
+	int n;
+	gc_frame();
+
+	if (list_len(args) % 2) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	for (; args != nil; args = cdr(cdr(args))) {
+		if (!issym(car(args)) || !isnum(car(cdr(args)))) {
+			fprintf(stderr, "error: symbol and number expected\n");
+			return NULL;
+		}
+		val = num_val(car(cdr(args)));
+		if (gc_tune(get_symname(car(args)), val)) {
+			fprintf(stderr, "error: bad gc setting %s\n",
+				get_symname(car(args)));
+			return NULL;
+		}
+	}
+
+	ret = nil;
+	gc_push(&ret);
+	for (n = 0; gc_tune_keys[n]; n++)
+		;
+	while (n--) {
+		val = gc_tune_get(gc_tune_keys[n]);
+		key = NULL;
+		/* whole numbers as integers, checked before the cast */
+		pair = val >= 0 && val < 18446744073709551616.0 &&
+			val == (uint64_t)val ? count_(val) : float_(val);
+		gc_push2(&pair, &key);
+		key = find_symbol(gc_tune_keys[n]);
+		pair = cons(key, pair);
+		ret = cons(pair, ret);
+		gc_popn(2);
+	}
+	gc_pop();
+	return ret;
+}
+
+/* (key . val) consed onto alist */
+static sexp_t *stat_cons(sexp_t *key, sexp_t *val, sexp_t *alist)
+{
+	gc_frame();
+
+	gc_push3(&key, &val, &alist);
+	val = cons(key, val);
+	alist = cons(val, alist);
+	gc_popn(3);
+	return alist;
+}
+
+static sexp_t *stat(const char *key, sexp_t *val, sexp_t *alist)
+{
+	gc_frame();
+
+	gc_push2(&val, &alist);
+	alist = stat_cons(find_symbol(key), val, alist);
+	gc_popn(2);
+	return alist;
+}
+
+/* ((type . count)...) of the types counted */
+static sexp_t *type_counts(unsigned long *count)
+{
+	sexp_t *ret = nil;
+	int i;
+	gc_frame();
+
+	gc_push(&ret);
+	for (i = NTYPES; i--; )
+		if (count[i])
+			ret = stat(gc_type_names[i], count_(count[i]), ret);
+	gc_pop();
+	return ret;
+}
+
+/* ((us . count)...), count pauses under us microseconds */
+static sexp_t *hist_counts(unsigned long *hist)
+{
+	sexp_t *ret = nil;
+	int n;
+	gc_frame();
+
+	gc_push(&ret);
+	for (n = GC_HIST; n--; )
+		if (hist[n])
+			ret = stat_cons(int_(1 << n), count_(hist[n]), ret);
+	gc_pop();
+	return ret;
+}
+
+/*
+ * (gc-stats), the collector's counters as an alist: allocations by
+ * type since startup, the heap by type, which after a (gc) is what is
+ * live, and the mark and sweep pauses of all cycles.
+ */
+sexp_t *prim_gc_stats()
+{
+	unsigned long heap[NTYPES], objs = 0;
+	size_t bytes = gc_stats.charged;
+	sexp_t *ret = nil, *sub = NULL;
+	int i;
+	gc_frame();
+
+	gc_census(heap);
+	for (i = 0; i < NTYPES; i++) {
+		objs += gc_stats.allocs[i];
+		bytes += gc_stats.alloc_bytes[i];
+	}
+	gc_push2(&ret, &sub);
+	sub = hist_counts(gc_stats.sweep_hist);
+	ret = stat("sweep-pauses", sub, ret);
+	sub = hist_counts(gc_stats.mark_hist);
+	ret = stat("mark-pauses", sub, ret);
+	sub = type_counts(heap);
+	ret = stat("heap", sub, ret);
+	sub = type_counts(gc_stats.allocs);
+	ret = stat("allocations", sub, ret);
+	ret = stat("roots-peak", count_(gc_roots_peak()), ret);
+	ret = stat("roots", count_(gc_roots()), ret);
+	ret = stat("promoted", count_(gc_stats.promoted), ret);
+	ret = stat("live-bytes", count_(gc_stats.live_bytes), ret);
+	ret = stat("live", count_(gc_stats.live), ret);
+	ret = stat("freed-bytes", count_(gc_stats.freed_bytes), ret);
+	ret = stat("freed", count_(gc_stats.freed), ret);
+	ret = stat("charged-bytes", count_(gc_stats.charged), ret);
+	ret = stat("allocated-bytes", count_(bytes), ret);
+	ret = stat("allocated", count_(objs), ret);
+	ret = stat("minor-pause-max", float_(gc_stats.minor_pause_max), ret);
+	ret = stat("minor-pause", float_(gc_stats.minor_pause), ret);
+	ret = stat("pause-max", float_(gc_stats.pause_max), ret);
+	ret = stat("pause", float_(gc_stats.pause), ret);
+	ret = stat("minor-cycles", count_(gc_stats.minors), ret);
+	ret = stat("cycles", count_(gc_stats.cycles), ret);
+	gc_popn(2);
+	return ret;
+}
+
+/* Expansion of form if it is a macro call, else form itself */
+static sexp_t *macroexpand_1(sexp_t *form, env_t *env)
+{
+	sexp_t **slot;
+	if (!iscons(form) || !issym(car(form)) ||
+	    !(slot = env_find(env, car(form))) || type(*slot) != MACRO)
+		return form;
+	return macro_expansion(form, *slot);
+}
+
+sexp_t *prim_macroexpand_1(sexp_t *args, env_t *env)
+{
+	if (list_len(args) != 1) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	return macroexpand_1(car(args), env);
+}
+
+sexp_t *prim_macroexpand(sexp_t *args, env_t *env)
+{
+	sexp_t *form, *exp;
+	gc_frame();
+	if (list_len(args) != 1) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	for (form = car(args); form; form = exp) {
+		gc_push(&form);
+		exp = macroexpand_1(form, env);
+		gc_pop();
+		if (exp == form)
+			break;
+	}
+	return form;
+}
+
+/* (macro-cache-stats), returns ((hits . n) (misses . n)) */
+sexp_t *prim_macro_cache_stats()
+{
+	sexp_t *ret = nil, *pair = NULL, *key = NULL;
+	int i;
+	gc_frame();
+
+	gc_push3(&ret, &pair, &key);
+	for (i = 1; i >= 0; i--) {
+		pair = count_(i ? macro_cache_misses : macro_cache_hits);
+		key = find_symbol(i ? "misses" : "hits");
+		pair = cons(key, pair);
+		ret = cons(pair, ret);
+	}
+	gc_popn(3);
+	return ret;
+}
+
+/*
+ * Vectors and strings
+ */
+
+sexp_t *prim_vectorp(sexp_t *args)
+{
+	if (list_len(args) != 1) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	return car(args) && isvector(car(args)) ? t : nil;
+}
+
+/* Sets *i to x if it is an integer from 0 up to n, else complains */
+static int get_index(sexp_t *x, size_t n, size_t *i)
+{
+	if (!x || !isint(x) || get_int(x) < 0 || (size_t)get_int(x) >= n) {
+		fprintf(stderr, "error: index out of range\n");
+		return -1;
+	}
+	*i = get_int(x);
+	return 0;
+}
+
+/* (make-vector n [fill]) */
+sexp_t *prim_make_vector(sexp_t *args)
+{
+	size_t n;
+
+	if (list_len(args) != 1 && list_len(args) != 2) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	if (get_index(car(args), UINT32_MAX, &n))
+		return NULL;
+	return new_vector(n, cdr(args) != nil ? car(cdr(args)) : nil);
+}
+
+/* (vector x...) */
+sexp_t *prim_vector(sexp_t *args)
+{
+	sexp_t *v;
+	size_t i;
+
+	v = new_vector(list_len(args), nil);
+	for (i = 0; args != nil; args = cdr(args))
+		vector_elems(v)[i++] = car(args);
+	return v;
+}
+
+sexp_t *prim_vector_length(sexp_t *args)
+{
+	if (list_len(args) != 1) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	if (!car(args) || !isvector(car(args))) {
+		fprintf(stderr, "error: vector expected\n");
+		return NULL;
+	}
+	return int_(vector_len(car(args)));
+}
+
+/* (vector-ref v i), the two argument entry point */
+sexp_t *vector_ref(sexp_t *v, sexp_t *i)
+{
+	size_t n;
+
+	if (!v || !isvector(v)) {
+		fprintf(stderr, "error: vector expected\n");
+		return NULL;
+	}
+	if (get_index(i, vector_len(v), &n))
+		return NULL;
+	return vector_elems(v)[n];
+}
+
+sexp_t *prim_vector_ref(sexp_t *args)
+{
+	if (list_len(args) != 2) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	return vector_ref(car(args), car(cdr(args)));
+}
+
+/* (vector-set! v i x), returns x */
+sexp_t *prim_vector_set(sexp_t *args)
+{
+	sexp_t *v, *x;
+	size_t n;
+
+	if (list_len(args) != 3) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	v = car(args);
+	x = car(cdr(cdr(args)));
+	if (!v || !isvector(v)) {
+		fprintf(stderr, "error: vector expected\n");
+		return NULL;
+	}
+	if (get_index(car(cdr(args)), vector_len(v), &n))
+		return NULL;
+	vector_elems(v)[n] = x;
+	gc_write(v, x);
+	return x;
+}
+
+sexp_t *prim_stringp(sexp_t *args)
+{
+	if (list_len(args) != 1) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	return car(args) && isstring(car(args)) ? t : nil;
+}
+
+sexp_t *prim_string_length(sexp_t *args)
+{
+	if (list_len(args) != 1) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	if (!car(args) || !isstring(car(args))) {
+		fprintf(stderr, "error: string expected\n");
+		return NULL;
+	}
+	return int_(string_len(car(args)));
+}
+
+/* (concat s...), a new string of them all */
+sexp_t *prim_concat(sexp_t *args)
+{
+	sexp_t *l, *s;
+	size_t len = 0;
+	char *p;
+
+	for (l = args; l != nil; l = cdr(l)) {
+		if (!car(l) || !isstring(car(l))) {
+			fprintf(stderr, "error: string expected\n");
+			return NULL;
+		}
+		len += string_len(car(l));
+	}
+	if (len > UINT32_MAX) {
+		fprintf(stderr, "error: string too long\n");
+		return NULL;
+	}
+	s = new_string(NULL, len);
+	for (p = string_chars(s), l = args; l != nil; l = cdr(l)) {
+		memcpy(p, string_chars(car(l)), string_len(car(l)));
+		p += string_len(car(l));
+	}
+	return s;
+}
+
+/* (substring s start [end]), end defaulting to the length of s */
+sexp_t *prim_substring(sexp_t *args)
+{
+	sexp_t *s;
+	size_t start, end;
+
+	if (list_len(args) != 2 && list_len(args) != 3) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	s = car(args);
+	if (!s || !isstring(s)) {
+		fprintf(stderr, "error: string expected\n");
+		return NULL;
+	}
+	end = string_len(s);
+	if (get_index(car(cdr(args)), end + 1, &start) ||
+	    (cdr(cdr(args)) != nil &&
+	     get_index(car(cdr(cdr(args))), end + 1, &end)))
+		return NULL;
+	if (end < start) {
+		fprintf(stderr, "error: index out of range\n");
+		return NULL;
+	}
+	return new_string(string_chars(s) + start, end - start);
+}
+
+/*
+ * (string-search needle s [start]), the index of the first needle in s
+ * from start on, or nil
+ */
+sexp_t *prim_string_search(sexp_t *args)
+{
+	sexp_t *needle, *s;
+	const char *p, *end;
+	size_t start = 0, n;
+
+	if (list_len(args) != 2 && list_len(args) != 3) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	needle = car(args);
+	s = car(cdr(args));
+	if (!needle || !s || !isstring(needle) || !isstring(s)) {
+		fprintf(stderr, "error: string expected\n");
+		return NULL;
+	}
+	if (cdr(cdr(args)) != nil &&
+	    get_index(car(cdr(cdr(args))), string_len(s) + 1, &start))
+		return NULL;
+	n = string_len(needle);
+	if (n > string_len(s) - start)
+		return nil;
+	if (!n)
+		return int_(start);
+	end = string_chars(s) + string_len(s) - n + 1;
+	for (p = string_chars(s) + start;
+	     (p = memchr(p, *string_chars(needle), end - p)); p++)
+		if (!memcmp(p, string_chars(needle), n))
+			return int_(p - string_chars(s));
+	return nil;
 }
 
 /*
@@ -293,40 +868,35 @@ sexp_t *spec_quote(sexp_t *args)
 
 sexp_t *backquote_recur(sexp_t *arg, env_t *env)
 {
-	sexp_t *head, *tail;
+	sexp_t *head = NULL, *tail = NULL;
+	gc_frame();
 	if (isatom(arg))
 		return arg;
 	if (iscons(car(arg)) && issym(car(car(arg)))) {
 		if (strcmp(get_symname(car(car(arg))), "unquote") == 0) {
+			gc_push2(&head, &tail);
 			head = eval(car(cdr(car(arg))), env);
-			gc_push(&head);
 			tail = backquote_recur(cdr(arg), env);
-			gc_push(&tail);
 			tail = cons(head, tail);
-			gc_pop();
-			gc_pop();
+			gc_popn(2);
 			return tail;
 		}
 		if (strcmp(get_symname(car(car(arg))), "unquote-splice") == 0) {
+			gc_push2(&head, &tail);
 			head = eval(car(cdr(car(arg))), env);
-			gc_push(&head);
 			tail = backquote_recur(cdr(arg), env);
-			gc_push(&tail);
 			tail = cons(tail, nil);
 			tail = cons(head, tail);
 			tail = prim_append(tail);
-			gc_pop();
-			gc_pop();
+			gc_popn(2);
 			return tail;
 		}
 	}
+	gc_push2(&head, &tail);
 	head = backquote_recur(car(arg), env);
-	gc_push(&head);
 	tail = backquote_recur(cdr(arg), env);
-	gc_push(&tail);
 	tail = cons(head, tail);
-	gc_pop();
-	gc_pop();
+	gc_popn(2);
 	return tail;
 }
 
@@ -335,54 +905,65 @@ sexp_t *spec_backquote(sexp_t *arg, env_t *env)
 	return backquote_recur(car(arg), env);
 }
 
+/*
+ * eval runs cond, and and or itself so that their last expression is
+ * in tail position; these are only reached through apply.
+ */
 sexp_t *spec_cond(sexp_t *args, env_t *env)
 {
-	if (args == nil)
-		return NULL;
-	if (eval(car(car(args)), env) != nil)
-		return eval(car(cdr(car(args))), env);
-	return spec_cond(cdr(args), env);
+	for (; args != nil; args = cdr(args))
+		if (eval(car(car(args)), env) != nil)
+			return eval(car(cdr(car(args))), env);
+	return NULL;
 }
 
 sexp_t *spec_and(sexp_t *args, env_t *env)
 {
-	if (list_len(args) == 0)
+	if (args == nil)
 		return t;
-	if (list_len(args) == 1)
-		return eval(car(args), env);
-	if (eval(car(args), env) == nil)
-		return nil;
-	return spec_and(cdr(args), env);
+	for (; cdr(args) != nil; args = cdr(args))
+		if (eval(car(args), env) == nil)
+			return nil;
+	return eval(car(args), env);
 }
 
 sexp_t *spec_or(sexp_t *args, env_t *env)
 {
 	sexp_t *ret;
-	if (list_len(args) == 0)
+	if (args == nil)
 		return nil;
-	if (list_len(args) == 1)
-		return eval(car(args), env);
-	if ((ret = eval(car(args), env)) != nil)
-		return ret;
-	return spec_or(cdr(args), env);
+	for (; cdr(args) != nil; args = cdr(args))
+		if ((ret = eval(car(args), env)) != nil)
+			return ret;
+	return eval(car(args), env);
 }
 
 sexp_t *spec_lambda(sexp_t *args, env_t *env)
 {
+	gc_frame();
 	if (list_len(args) < 2) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
 	}
-	return lambda(args, env);
+	args = analyze_lambda(args, env);
+	gc_push(&args);
+	args = lambda(args, env);
+	gc_pop();
+	return args;
 }
 
 sexp_t *spec_macro(sexp_t *args, env_t *env)
 {
+	gc_frame();
 	if (list_len(args) < 2) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
 	}
-	return macro(args, env);
+	args = analyze_lambda(args, env);
+	gc_push(&args);
+	args = macro(args, env);
+	gc_pop();
+	return args;
 }
 
 sexp_t *spec_label(sexp_t *args, env_t *env)
@@ -395,7 +976,7 @@ sexp_t *spec_label(sexp_t *args, env_t *env)
 		fprintf(stderr, "error: symbol expected\n");
 		return NULL;
 	}
-	env_bind(toplevel, get_symname(car(args)),
+	env_bind(toplevel, car(args),
 	         eval(car(cdr(args)), env));
 	return NULL;
 }
@@ -410,13 +991,14 @@ sexp_t *spec_set(sexp_t *args, env_t *env)
 		fprintf(stderr, "error: symbol expected\n");
 		return NULL;
 	}
-	env_set(env, get_symname(car(args)), eval(car(cdr(args)), env));
+	env_set(env, car(args), eval(car(cdr(args)), env));
 	return NULL;
 }
 
 sexp_t *spec_setcar(sexp_t *args, env_t *env)
 {
 	sexp_t *cs;
+	gc_frame();
 	if (list_len(args) < 2) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
@@ -427,7 +1009,7 @@ sexp_t *spec_setcar(sexp_t *args, env_t *env)
 		return NULL;
 	}
 	gc_push(&cs);
-	cs->data = make_cons(eval(car(cdr(args)), env), cdr(cs));
+	set_car(cs, eval(car(cdr(args)), env));
 	gc_pop();
 	return NULL;
 }
@@ -435,6 +1017,7 @@ sexp_t *spec_setcar(sexp_t *args, env_t *env)
 sexp_t *spec_setcdr(sexp_t *args, env_t *env)
 {
 	sexp_t *cs;
+	gc_frame();
 	if (list_len(args) < 2) {
 		fprintf(stderr, "error: argument count\n");
 		return NULL;
@@ -445,7 +1028,7 @@ sexp_t *spec_setcdr(sexp_t *args, env_t *env)
 		return NULL;
 	}
 	gc_push(&cs);
-	cs->data = make_cons(car(cs), eval(car(cdr(args)), env));
+	set_cdr(cs, eval(car(cdr(args)), env));
 	gc_pop();
 	return NULL;
 }
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lisp.h"
+
+/*
+ * Print
+ *
+ * Output goes into a buffer that is written out when PRINT_CHUNK is
+ * full and by print_flush, which print_sexp and display call when done,
+ * so a value costs one stdio call per chunk rather than one per atom.
+ * Numbers are converted by hand.  Lists are walked with an explicit
+ * stack, so only nested procedures and vectors make print_value
+ * recurse.  Vectors print as #(a b c), strings in double quotes with
+ * the escapes the reader takes.
+ *
+ * When *print-circle* is true a first pass finds the conses and vectors
+ * reached more than once, and those are printed once as #n=... and
+ * afterwards as #n#, which also makes circular lists printable.
+ */
+
+#define PRINT_CHUNK	(1 << 16)
+
+static char *obuf = NULL;
+static size_t olen = 0, osize = 0;
+
+struct binding *print_circle;
+
+static void out_of_memory(void)
+{
+	fprintf(stderr, "error: out of memory\n");
+	exit(1);
+}
+
+void print_flush(FILE *out)
+{
+	if (olen)
+		fwrite(obuf, 1, olen, out);
+	olen = 0;
+}
+
+/* Room for n more characters, writing out a full buffer first */
+static char *room(size_t n, FILE *out)
+{
+	if (olen + n > osize && olen >= PRINT_CHUNK)
+		print_flush(out);
+	if (olen + n > osize) {
+		while (olen + n > osize)
+			osize = osize ? osize * 2 : PRINT_CHUNK;
+		if (!(obuf = realloc(obuf, osize)))
+			out_of_memory();
+	}
+	return obuf + olen;
+}
+
+void print_write(const char *s, size_t n, FILE *out)
+{
+	memcpy(room(n, out), s, n);
+	olen += n;
+}
+
+void print_putc(int c, FILE *out)
+{
+	*room(1, out) = c;
+	olen++;
+}
+
+#define put_str(s, out)	print_write((s), strlen(s), (out))
+#define put_char(c, out)	(olen < osize ? (void)(obuf[olen++] = (c)) :\
+				 print_putc((c), (out)))
+
+/* Writes the digits of n backwards ending at end, returns the first */
+static char *utoa(uint64_t n, char *end)
+{
+	do
+		*--end = '0' + n % 10;
+	while (n /= 10);
+	return end;
+}
+
+static void put_int(int64_t i, FILE *out)
+{
+	char buf[24], *s;
+	uint64_t n = i < 0 ? -(uint64_t)i : (uint64_t)i;
+
+	s = utoa(n, buf + sizeof(buf));
+	if (i < 0)
+		*--s = '-';
+	print_write(s, buf + sizeof(buf) - s, out);
+}
+
+static void put_hex(PTRT n, FILE *out)
+{
+	char buf[2 + 2*sizeof(n)], *s = buf + sizeof(buf);
+
+	do
+		*--s = "0123456789abcdef"[n & 0xF];
+	while (n >>= 4);
+	*--s = 'x';
+	*--s = '0';
+	print_write(s, buf + sizeof(buf) - s, out);
+}
+
+/*
+ * Writes f as printf's %f would, with six decimals.  Below 1e18 the
+ * integer part fits a uint64_t and the fraction is taken exactly as 96
+ * bits of fixed point, in three 32 bit limbs that are multiplied by 10^6
+ * one at a time; what is left below the decimals decides the rounding,
+ * half to even like printf.  A fraction needing more than 96 bits is
+ * under 2^-21 and rounds to zero anyway.  Anything else goes through
+ * snprintf.
+ */
+static void put_float(double f, FILE *out)
+{
+	char buf[400], *s, *end = buf + sizeof(buf);
+	union { double f; uint64_t i; } bits;
+	uint64_t ip, l[3], a, b, c, q, r;
+	int i, n;
+
+	bits.f = f;
+	if (!(f > -1e18 && f < 1e18)) {
+		n = snprintf(buf, sizeof(buf), "%f", f);
+		print_write(buf, n, out);
+		return;
+	}
+	if (f < 0)
+		f = -f;
+	ip = (uint64_t)f;
+	f -= ip;
+	for (i = 0; i < 3; i++) {
+		f *= 4294967296.0;	/* exact, a power of two */
+		l[i] = (uint64_t)f;
+		f -= l[i];
+	}
+
+	c = l[2] * 1000000;
+	b = l[1] * 1000000 + (c >> 32);
+	a = l[0] * 1000000 + (b >> 32);
+	q = a >> 32;
+	r = a << 32 | (b & 0xFFFFFFFF);
+	if (r > 1ull << 63 ||
+	    (r == 1ull << 63 && ((c & 0xFFFFFFFF) || (q & 1))))
+		q++;
+	if (q == 1000000) {
+		q = 0;
+		ip++;
+	}
+
+	s = utoa(q + 1000000, end);	/* the leading 1 pads with zeros */
+	*s = '.';
+	s = utoa(ip, s);
+	if (bits.i >> 63)
+		*--s = '-';
+	print_write(s, end - s, out);
+}
+
+/*
+ * Labels for *print-circle*: every cons or vector met is in an open
+ * addressing table, with label 0 when met once, -1 when met again and
+ * n once #n= has been printed for it.
+ */
+struct label {
+	sexp_t *cell;
+	long label;
+};
+
+static struct label *labels = NULL;
+static size_t nlabels = 0, labels_size = 0;
+static long last_label;
+static int circle;	/* labels are in use */
+
+#define label_hash(p)	((size_t)(((PTRT)(p) >> 3) * 0x9E3779B1u))
+
+/* The entry of cell, or the free one it would go in */
+static struct label *label_find(sexp_t *cell)
+{
+	size_t i, mask = labels_size - 1;
+
+	for (i = label_hash(cell) & mask; labels[i].cell; i = (i+1) & mask)
+		if (labels[i].cell == cell)
+			break;
+	return &labels[i];
+}
+
+/* Adds cell, or marks it shared and returns 1 if it was there */
+static int label_seen(sexp_t *cell)
+{
+	struct label *old = labels, *l;
+	size_t i, size = labels_size;
+
+	if (2 * (nlabels + 1) > labels_size) {
+		labels_size = size ? 2 * size : 1024;
+		if (!(labels = calloc(labels_size, sizeof(*labels))))
+			out_of_memory();
+		for (i = 0; i < size; i++)
+			if (old[i].cell)
+				*label_find(old[i].cell) = old[i];
+		free(old);
+	}
+	l = label_find(cell);
+	if (l->cell) {
+		l->label = -1;
+		return 1;
+	}
+	l->cell = cell;
+	nlabels++;
+	return 0;
+}
+
+/* Print stack, of the lists whose elements are being printed */
+struct pframe {
+	sexp_t *cell;		/* element printed last */
+	int dotted;		/* printing the tail after " . " */
+};
+
+static struct pframe *pstack = NULL;
+static size_t pdepth = 0, pstack_size = 0;
+
+static void pstack_push(sexp_t *cell)
+{
+	if (pdepth == pstack_size) {
+		pstack_size = pstack_size ? 2 * pstack_size : 64;
+		pstack = realloc(pstack, pstack_size * sizeof(*pstack));
+		if (!pstack)
+			out_of_memory();
+	}
+	pstack[pdepth].cell = cell;
+	pstack[pdepth].dotted = 0;
+	pdepth++;
+}
+
+#define compound(x)	(iscons(x) || isvector(x))
+
+/* First pass of *print-circle*: labels what is reached twice */
+static void find_shared(sexp_t *exp)
+{
+	size_t base = pdepth, i;
+
+	if (labels)
+		memset(labels, 0, labels_size * sizeof(*labels));
+	nlabels = 0;
+	last_label = 0;
+	pstack_push(exp);
+	while (pdepth > base) {
+		exp = pstack[--pdepth].cell;
+		if (isvector(exp)) {
+			if (!label_seen(exp))
+				for (i = 0; i < vector_len(exp); i++)
+					if (compound(vector_elems(exp)[i]))
+						pstack_push(vector_elems(exp)[i]);
+			continue;
+		}
+		for (; iscons(exp); exp = cdr(exp)) {
+			if (label_seen(exp))
+				break;
+			if (compound(car(exp)))
+				pstack_push(car(exp));
+		}
+		if (isvector(exp))
+			pstack_push(exp);
+	}
+}
+
+/* Whether the cons or vector exp is to be printed as #n= or #n# */
+#define shared(exp)	(circle && label_find(exp)->label)
+
+static void print_value(sexp_t *exp, FILE *out);
+
+/* Writes the len bytes at s in double quotes, escaped for the reader */
+static void put_string(const char *s, size_t len, FILE *out)
+{
+	const char *end = s + len;
+
+	put_char('"', out);
+	for (; s < end; s++)
+		switch (*s) {
+		case '"':
+		case '\\':
+			put_char('\\', out);
+			put_char(*s, out);
+			break;
+		case '\n':
+			put_str("\\n", out);
+			break;
+		case '\t':
+			put_str("\\t", out);
+			break;
+		default:
+			put_char(*s, out);
+		}
+	put_char('"', out);
+}
+
+static void print_atom(sexp_t *atm, FILE *out)
+{
+	size_t i;
+
+	if (atm == nil) {
+		put_str("nil", out);
+		return;
+	}
+	if (atm == t) {
+		put_str("t", out);
+		return;
+	}
+	switch (type(atm)) {
+	case INT:
+		put_int(get_int(atm), out);
+		break;
+	case FLOAT:
+		put_float(get_float(atm), out);
+		break;
+	case BIG:
+		big_print(atm, out);
+		break;
+	case SYM:
+		put_str(get_symname(atm), out);
+		break;
+	case STRING:
+		put_string(string_chars(atm), string_len(atm), out);
+		break;
+	case VECTOR:
+		put_str("#(", out);
+		for (i = 0; i < vector_len(atm); i++) {
+			if (i)
+				put_char(' ', out);
+			print_value(vector_elems(atm)[i], out);
+		}
+		put_char(')', out);
+		break;
+	case LREF:
+	case GREF:
+		put_str(get_symname(car(atm)), out);
+		break;
+	case PARAMS:
+		print_value(params_list(atm), out);
+		break;
+	case LAMBDA:
+		put_str("<#Lambda ", out);
+		print_value(proc_params(atm), out);
+		put_char(' ', out);
+		print_value(proc_body(atm), out);
+		put_char('>', out);
+		break;
+	case CLOSURE:
+		put_str("<#Lambda ", out);
+		print_value(car(closure_code(atm)->src), out);
+		put_char(' ', out);
+		print_value(cdr(closure_code(atm)->src), out);
+		put_char('>', out);
+		break;
+	case MACRO:
+		put_str("<#Macro ", out);
+		print_value(proc_params(atm), out);
+		put_char(' ', out);
+		print_value(proc_body(atm), out);
+		put_char('>', out);
+		break;
+	case PRIM:
+		put_str("<#Primitive ", out);
+		put_hex((PTRT)get_prim(atm), out);
+		put_char('>', out);
+		break;
+	case SPEC:
+		put_str("<#Specialform ", out);
+		put_hex((PTRT)get_prim(atm), out);
+		put_char('>', out);
+		break;
+	case ENV:
+		put_str("<#Environment ", out);
+		put_hex((PTRT)atm, out);
+		put_char('>', out);
+		break;
+	}
+}
+
+/* Writes exp, with an explicit stack for lists */
+static void print_value(sexp_t *exp, FILE *out)
+{
+	struct pframe *f;
+	struct label *l;
+	size_t base = pdepth;
+
+	for (;;) {
+		if (compound(exp) && shared(exp)) {
+			l = label_find(exp);
+			put_char('#', out);
+			if (l->label > 0) {
+				put_int(l->label, out);
+				put_char('#', out);
+				goto next;
+			}
+			put_int(l->label = ++last_label, out);
+			put_char('=', out);
+		}
+		if (iscons(exp)) {
+			put_char('(', out);
+			pstack_push(exp);
+			exp = car(exp);
+			continue;
+		}
+		print_atom(exp, out);
+next:
+		/* exp is done, find what follows it */
+		for (;;) {
+			if (pdepth == base)
+				return;
+			f = &pstack[pdepth - 1];
+			exp = cdr(f->cell);
+			if (f->dotted || isnil(exp)) {
+				put_char(')', out);
+				pdepth--;
+				continue;
+			}
+			put_char(' ', out);
+			if (iscons(exp) && !shared(exp)) {
+				f->cell = exp;
+				exp = car(exp);
+			} else {
+				put_str(". ", out);
+				f->dotted = 1;
+			}
+			break;
+		}
+	}
+}
+
+/* Adds exp to the output without writing it out */
+void print_put(sexp_t *exp, FILE *out)
+{
+	circle = print_circle->val && !isnil(print_circle->val);
+	if (circle)
+		find_shared(exp);
+	print_value(exp, out);
+	circle = 0;
+}
+
+void print_sexp(sexp_t *exp, FILE *out)
+{
+	print_put(exp, out);
+	print_flush(out);
+}
+
+void print_sexpnl(sexp_t *exp, FILE *out)
+{
+	print_put(exp, out);
+	put_char('\n', out);
+	print_flush(out);
+}
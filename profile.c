@@ -0,0 +1,505 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "lisp.h"
+
+/*
+ * Profiler
+ *
+ * eval, apply and the vm tell profile_enter when a LAMBDA, MACRO, PRIM
+ * or compiled closure is called and profile_leave when it is done; a
+ * call in tail position leaves the caller before entering the callee.
+ * The calls on the way make a path in a tree of call stacks, each
+ * node counting the samples or the time spent in it, and every
+ * procedure has an entry with its calls.
+ *
+ * In PROFILE_CALLS mode each call reads the clock going in and out,
+ * which gives inclusive and exclusive time; time in a recursive call
+ * counts once towards the inclusive time.  In PROFILE_SAMPLES mode a
+ * SIGPROF timer ticks PROFILE_HZ times a second of cpu time and the
+ * ticks are charged to the stack as it is at the next call or return,
+ * which is the stack they were taken in.
+ *
+ * The report is a flat profile sorted by exclusive time or samples and,
+ * if asked for, the stacks collapsed one per line, "f;g;h weight",
+ * which flame graph tools read.  Procedures are named after the global
+ * they are bound to, anonymous ones by their parameter list.
+ */
+
+#define PROFILE_HZ	1000
+
+int profiling;
+
+struct pentry {
+	sexp_t *proc;
+	char *name;
+	unsigned long calls;
+	double self, total;	/* seconds */
+	unsigned long samples, in_samples;	/* on top, anywhere */
+	unsigned active;	/* calls under way */
+	unsigned long stamp;
+	unsigned group;		/* first entry of the same name */
+};
+
+/* Node of the call stack tree, node 0 is the toplevel */
+struct pnode {
+	unsigned entry, parent;
+	unsigned long samples;
+	double self;
+};
+
+struct pframe {
+	unsigned node;
+	double start, child;	/* PROFILE_CALLS only */
+};
+
+static struct pentry *entries;
+static size_t nentries, entries_size;
+static struct pnode *nodes;
+static size_t nnodes, nodes_size;
+static struct pframe *frames;
+static size_t depth, frames_size;
+
+/* Entries by proc and nodes by path: indexes + 1, open addressing */
+struct index {
+	unsigned *slot;
+	size_t size;
+};
+
+static struct index by_proc, by_path;
+static volatile sig_atomic_t ticks;
+static unsigned long total_samples;
+static double started;
+
+static void out_of_memory(void)
+{
+	fprintf(stderr, "error: out of memory\n");
+	exit(1);
+}
+
+static void *grow(void *p, size_t *size, size_t need, size_t elem)
+{
+	if (need <= *size)
+		return p;
+	while (*size < need)
+		*size = *size ? 2 * *size : 256;
+	if (!(p = realloc(p, *size * elem)))
+		out_of_memory();
+	return p;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_sigprof(int sig)
+{
+	(void)sig;
+	ticks++;
+}
+
+/* Charges the ticks since the last call or return to the top node */
+static void take_ticks(void)
+{
+	unsigned long n = ticks;
+
+	ticks = 0;
+	nodes[depth ? frames[depth - 1].node : 0].samples += n;
+	total_samples += n;
+}
+
+#define proc_hash(p)	((size_t)(((PTRT)(p) >> 4) * 0x9E3779B1u))
+#define path_hash(parent, entry) \
+	((size_t)((parent) * 0x9E3779B1u ^ (entry) * 0x85EBCA6Bu))
+
+static size_t entry_hash(size_t i)
+{
+	return proc_hash(entries[i].proc);
+}
+
+static size_t node_hash(size_t i)
+{
+	return path_hash(nodes[i].parent, nodes[i].entry);
+}
+
+/* Doubles x and puts the first n items back in by their hash */
+static void reindex(struct index *x, size_t n, size_t (*hash)(size_t))
+{
+	size_t i, j, mask;
+
+	free(x->slot);
+	x->size = x->size ? 2 * x->size : 256;
+	if (!(x->slot = calloc(x->size, sizeof(*x->slot))))
+		out_of_memory();
+	mask = x->size - 1;
+	for (i = 0; i < n; i++) {
+		for (j = hash(i) & mask; x->slot[j]; j = (j+1) & mask)
+			;
+		x->slot[j] = i + 1;
+	}
+}
+
+static unsigned entry_of(sexp_t *proc)
+{
+	size_t i, mask = by_proc.size - 1;
+
+	for (i = proc_hash(proc) & mask; by_proc.slot[i]; i = (i+1) & mask)
+		if (entries[by_proc.slot[i] - 1].proc == proc)
+			return by_proc.slot[i] - 1;
+	entries = grow(entries, &entries_size, nentries + 1,
+		       sizeof(*entries));
+	memset(&entries[nentries], 0, sizeof(*entries));
+	entries[nentries].proc = proc;
+	by_proc.slot[i] = ++nentries;
+	if (2 * nentries > by_proc.size)
+		reindex(&by_proc, nentries, entry_hash);
+	return nentries - 1;
+}
+
+static unsigned node_of(unsigned parent, unsigned entry)
+{
+	size_t i, mask = by_path.size - 1;
+	struct pnode *n;
+
+	for (i = path_hash(parent, entry) & mask; by_path.slot[i];
+	     i = (i+1) & mask) {
+		n = &nodes[by_path.slot[i] - 1];
+		if (n->parent == parent && n->entry == entry)
+			return by_path.slot[i] - 1;
+	}
+	nodes = grow(nodes, &nodes_size, nnodes + 1, sizeof(*nodes));
+	n = &nodes[nnodes];
+	memset(n, 0, sizeof(*n));
+	n->entry = entry;
+	n->parent = parent;
+	by_path.slot[i] = ++nnodes;
+	if (2 * nnodes > by_path.size)
+		reindex(&by_path, nnodes, node_hash);
+	return nnodes - 1;
+}
+
+/*
+ * Notes a call of proc, returns what profile_leave takes to end it or
+ * 0 for a special form or something not callable.  Only called while
+ * profiling, see profile_call.
+ */
+size_t profile_enter(sexp_t *proc)
+{
+	struct pframe *f;
+	unsigned e;
+
+	if (!proc || (type(proc) != PRIM && type(proc) != LAMBDA &&
+		      type(proc) != MACRO && type(proc) != CLOSURE))
+		return 0;
+	if (ticks)
+		take_ticks();
+	e = entry_of(proc);
+	entries[e].calls++;
+	entries[e].active++;
+	frames = grow(frames, &frames_size, depth + 1, sizeof(*frames));
+	f = &frames[depth];
+	f->node = node_of(depth ? frames[depth - 1].node : 0, e);
+	if (profiling == PROFILE_CALLS) {
+		f->start = now();
+		f->child = 0;
+	}
+	return ++depth;
+}
+
+/*
+ * Ends the call profile_enter returned mark for, and any still open
+ * above it.  Marks from before the last profile-start do nothing.
+ */
+void profile_leave(size_t mark)
+{
+	struct pframe *f;
+	struct pentry *e;
+	double t = 0, incl;
+
+	if (!profiling || mark > depth)
+		return;
+	if (ticks)
+		take_ticks();
+	if (profiling == PROFILE_CALLS)
+		t = now();
+	while (depth >= mark) {
+		f = &frames[--depth];
+		e = &entries[nodes[f->node].entry];
+		if (!--e->active && profiling == PROFILE_CALLS)
+			e->total += t - f->start;
+		if (profiling != PROFILE_CALLS)
+			continue;
+		incl = t - f->start;
+		nodes[f->node].self += incl - f->child;
+		e->self += incl - f->child;
+		if (depth)
+			frames[depth - 1].child += incl;
+	}
+}
+
+/* Keeps the procedures profiled alive, their entries need them */
+void profile_mark(void (*mark)(sexp_t *))
+{
+	size_t i;
+
+	for (i = 0; i < nentries; i++)
+		mark(entries[i].proc);
+}
+
+static void profile_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < nentries; i++)
+		free(entries[i].name);
+	nentries = nnodes = depth = 0;
+	if (by_proc.slot)
+		memset(by_proc.slot, 0, by_proc.size * sizeof(unsigned));
+	if (by_path.slot)
+		memset(by_path.slot, 0, by_path.size * sizeof(unsigned));
+	total_samples = 0;
+	ticks = 0;
+}
+
+/* Starts profiling afresh in mode, 0 on success */
+int profile_start(int mode)
+{
+	struct sigaction sa;
+	struct itimerval it;
+
+	profile_stop();
+	profile_clear();
+	if (!by_proc.slot) {
+		reindex(&by_proc, 0, entry_hash);
+		reindex(&by_path, 0, node_hash);
+	}
+	nodes = grow(nodes, &nodes_size, 1, sizeof(*nodes));
+	memset(&nodes[0], 0, sizeof(*nodes));
+	nodes[0].entry = -1;	/* matches no call */
+	nnodes = 1;
+	if (mode == PROFILE_SAMPLES) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_sigprof;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		it.it_interval.tv_sec = 0;
+		it.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+		it.it_value = it.it_interval;
+		if (sigaction(SIGPROF, &sa, NULL) ||
+		    setitimer(ITIMER_PROF, &it, NULL)) {
+			fprintf(stderr, "error: could not start the timer\n");
+			return -1;
+		}
+	}
+	profiling = mode;
+	started = now();
+	return 0;
+}
+
+void profile_stop(void)
+{
+	struct itimerval it;
+
+	if (profiling == PROFILE_SAMPLES) {
+		memset(&it, 0, sizeof(it));
+		setitimer(ITIMER_PROF, &it, NULL);
+		signal(SIGPROF, SIG_IGN);
+	}
+	if (profiling) {
+		if (ticks)
+			take_ticks();
+		profile_leave(1);
+	}
+	profiling = 0;
+}
+
+/*
+ * Reporting
+ */
+
+/* The global proc is bound to, else its parameter list */
+static char *proc_name(sexp_t *proc)
+{
+	struct binding *b;
+	sexp_t *params = NULL;
+	char *s = NULL;
+	size_t i, n;
+	FILE *f;
+
+	for (i = 0; i < toplevel->tab->size; i++)
+		for (b = toplevel->tab->slot[i]; b; b = b->next)
+			if (b->val == proc)
+				return strdup(get_symname(b->sym));
+	switch (type(proc)) {
+	case LAMBDA:
+	case MACRO:
+		params = proc_params(proc);
+		break;
+	case CLOSURE:
+		params = car(closure_code(proc)->src);
+		break;
+	}
+	if (!(f = open_memstream(&s, &n)))
+		out_of_memory();
+	fputs(type(proc) == MACRO ? "(macro " : "(lambda ", f);
+	if (params)
+		print_sexp(params, f);
+	fputc(')', f);
+	fclose(f);
+	return s;
+}
+
+static int by_name(const void *a, const void *b)
+{
+	const struct pentry *x = *(struct pentry **)a;
+	const struct pentry *y = *(struct pentry **)b;
+	int c = strcmp(x->name, y->name);
+
+	return c ? c : (x < y ? -1 : x > y);
+}
+
+static int by_self(const void *a, const void *b)
+{
+	const struct pentry *x = *(struct pentry **)a;
+	const struct pentry *y = *(struct pentry **)b;
+
+	if (x->samples != y->samples)
+		return x->samples < y->samples ? 1 : -1;
+	if (x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+	if (x->calls != y->calls)
+		return x->calls < y->calls ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+/* Writes the path of node n from the toplevel down, ';' between */
+static void put_path(FILE *out, unsigned n)
+{
+	if (nodes[n].parent) {
+		put_path(out, nodes[n].parent);
+		fputc(';', out);
+	}
+	fputs(entries[nodes[n].entry].name, out);
+}
+
+static void put_stacks(FILE *out)
+{
+	unsigned long weight;
+	size_t i;
+
+	for (i = 0; i < nnodes; i++) {
+		weight = profiling == PROFILE_CALLS ?
+			(unsigned long)(nodes[i].self * 1e6 + 0.5) :
+			nodes[i].samples;
+		if (!weight)
+			continue;
+		if (i)
+			put_path(out, i);
+		else
+			fputs("toplevel", out);
+		fprintf(out, " %lu\n", weight);
+	}
+}
+
+/*
+ * Prints the flat profile to out and, if stacks is not NULL, writes the
+ * collapsed stacks to that file.  Profiling stops.  0 on success.
+ */
+int profile_report(FILE *out, const char *stacks)
+{
+	struct pentry **sorted, *e;
+	double elapsed = now() - started;
+	unsigned long stamp = 0;
+	size_t i, n, rows;
+	int mode = profiling, ret = 0;
+	FILE *f;
+
+	if (!mode) {
+		fprintf(stderr, "error: not profiling\n");
+		return -1;
+	}
+	profile_stop();
+	profiling = mode;	/* for put_stacks */
+
+	/*
+	 * Closures made afresh by each call, as a let expansion makes
+	 * them, have an entry each: they are counted as one by name.
+	 */
+	if (!(sorted = malloc((nentries + 1) * sizeof(*sorted))))
+		out_of_memory();
+	for (i = 0; i < nentries; i++) {
+		entries[i].name = proc_name(entries[i].proc);
+		sorted[i] = &entries[i];
+	}
+	qsort(sorted, nentries, sizeof(*sorted), by_name);
+	for (i = 0, n = 0; i < nentries; i++) {
+		if (i && !strcmp(sorted[i]->name, sorted[n - 1]->name)) {
+			sorted[i]->group = sorted[n - 1] - entries;
+			sorted[n - 1]->calls += sorted[i]->calls;
+			sorted[n - 1]->self += sorted[i]->self;
+			sorted[n - 1]->total += sorted[i]->total;
+			continue;
+		}
+		sorted[i]->group = sorted[i] - entries;
+		sorted[n++] = sorted[i];
+	}
+	rows = n;
+	/* a sample counts once towards every procedure on its stack */
+	for (i = 1; i < nnodes; i++) {
+		e = &entries[entries[nodes[i].entry].group];
+		e->samples += nodes[i].samples;
+		stamp++;
+		for (n = i; n; n = nodes[n].parent) {
+			e = &entries[entries[nodes[n].entry].group];
+			if (e->stamp != stamp) {
+				e->stamp = stamp;
+				e->in_samples += nodes[i].samples;
+			}
+		}
+	}
+	qsort(sorted, rows, sizeof(*sorted), by_self);
+
+	if (mode == PROFILE_CALLS) {
+		fprintf(out, "profile: %.3f ms\n", elapsed * 1e3);
+		fprintf(out, "  self%%    self ms   total ms      calls  name\n");
+		for (i = 0; i < rows; i++)
+			fprintf(out, "%6.2f %10.3f %10.3f %10lu  %s\n",
+				100 * sorted[i]->self / elapsed,
+				sorted[i]->self * 1e3, sorted[i]->total * 1e3,
+				sorted[i]->calls, sorted[i]->name);
+	} else {
+		fprintf(out, "profile: %lu samples\n", total_samples);
+		n = total_samples ? total_samples : 1;
+		fprintf(out, "  self%%  total%%    samples      calls  name\n");
+		for (i = 0; i < rows; i++)
+			fprintf(out, "%6.2f %7.2f %10lu %10lu  %s\n",
+				100.0 * sorted[i]->samples / n,
+				100.0 * sorted[i]->in_samples / n,
+				sorted[i]->samples, sorted[i]->calls,
+				sorted[i]->name);
+	}
+	fflush(out);
+	free(sorted);
+
+	if (stacks) {
+		if (!(f = fopen(stacks, "w"))) {
+			fprintf(stderr, "error: could not open %s\n", stacks);
+			ret = -1;
+		} else {
+			put_stacks(f);
+			if (fclose(f)) {
+				fprintf(stderr, "error: could not write %s\n",
+					stacks);
+				ret = -1;
+			}
+		}
+	}
+	profiling = 0;
+	profile_clear();
+	return ret;
+}
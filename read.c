@@ -0,0 +1,463 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lisp.h"
+
+/*
+ * Read
+ *
+ * The reader scans memory rather than a stdio stream: a file is
+ * mmap'd whole, anything else is read in chunks into a buffer that
+ * grows when a token would not fit.  An atom is a slice of that
+ * memory; numbers are parsed and symbols interned straight from it,
+ * so nothing is copied and atoms have no length limit.  Characters
+ * are told apart by a table.
+ */
+
+#define READ_CHUNK	(1 << 16)
+
+struct reader {
+	const char *pos;	/* next character */
+	const char *end;	/* end of what has been read in */
+	char *buf;
+	size_t size;		/* of buf */
+	int fd;			/* refilled from, -1 once mapped */
+};
+
+enum { C_ATOM, C_SPACE, C_DELIM };
+
+/* An atom runs up to whitespace, a parenthesis, a string or a comment */
+static const unsigned char cls[256] = {
+	[' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE,
+	['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE,
+	['('] = C_DELIM, [')'] = C_DELIM, [';'] = C_DELIM, ['"'] = C_DELIM,
+};
+
+#define class(r)	(cls[(unsigned char)*(r)->pos])
+
+struct reader *reader_fd(int fd)
+{
+	struct reader *r;
+
+	if (!(r = malloc(sizeof(*r))) || !(r->buf = malloc(READ_CHUNK))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	r->size = READ_CHUNK;
+	r->pos = r->end = r->buf;
+	r->fd = fd;
+	return r;
+}
+
+/* A reader over the mmap'd file at path, NULL if it cannot be opened */
+struct reader *reader_open(const char *path)
+{
+	struct reader *r;
+	struct stat st;
+	void *map = NULL;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+	}
+	if (!map)
+		return reader_fd(fd);	/* pipes and empty files */
+	close(fd);
+	if (!(r = malloc(sizeof(*r)))) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	r->buf = map;
+	r->size = st.st_size;
+	r->pos = r->buf;
+	r->end = r->buf + r->size;
+	r->fd = -1;
+	return r;
+}
+
+void reader_close(struct reader *r)
+{
+	if (r->fd < 0)
+		munmap(r->buf, r->size);
+	else {
+		if (r->fd > 0)
+			close(r->fd);
+		free(r->buf);
+	}
+	free(r);
+}
+
+/*
+ * Reads more input, keeping what follows *keep, which is moved to the
+ * start of the buffer along with pos.  Returns 0 at the end of input.
+ */
+static int refill(struct reader *r, const char **keep)
+{
+	size_t len = r->end - *keep, at = r->pos - *keep;
+	ssize_t n;
+
+	if (r->fd < 0)
+		return 0;
+	if (len == r->size) {
+		r->size *= 2;
+		if (!(r->buf = realloc(r->buf, r->size))) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+	} else
+		memmove(r->buf, *keep, len);
+	*keep = r->buf;
+	r->pos = r->buf + at;
+	r->end = r->buf + len;
+	do
+		n = read(r->fd, r->buf + len, r->size - len);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return 0;
+	r->end += n;
+	return 1;
+}
+
+/* The next character without taking it, EOF at the end of input */
+static int peek(struct reader *r)
+{
+	const char *keep = r->pos;
+	if (r->pos == r->end && !refill(r, &keep))
+		return EOF;
+	return (unsigned char)*r->pos;
+}
+
+/* Skips whitespace and comments, returns the character after them */
+static int skip(struct reader *r)
+{
+	const char *nl;
+	int c;
+
+	for (;;) {
+		while (r->pos < r->end && class(r) == C_SPACE)
+			r->pos++;
+		if ((c = peek(r)) != ';') {
+			if (c == EOF || cls[c] != C_SPACE)
+				return c;
+			continue;
+		}
+		while (peek(r) != EOF) {
+			nl = memchr(r->pos, '\n', r->end - r->pos);
+			r->pos = nl ? nl : r->end;
+			if (nl)
+				break;
+		}
+	}
+}
+
+/* Scans the atom at pos, returns its length and sets *s to its start */
+static size_t scan_atom(struct reader *r, const char **s)
+{
+	const char *tok = r->pos;
+
+	do
+		while (r->pos < r->end && class(r) == C_ATOM)
+			r->pos++;
+	while (r->pos == r->end && refill(r, &tok));
+	*s = tok;
+	return r->pos - tok;
+}
+
+/*
+ * Reads the string literal at pos, after its opening quote, or returns
+ * NULL if it is not closed.  \n and \t are newline and tab, a backslash
+ * before anything else stands for that character.
+ */
+static sexp_t *read_string(struct reader *r)
+{
+	const char *tok = r->pos, *s, *end;
+	sexp_t *str;
+	char *p;
+
+	for (;;) {
+		while (r->pos < r->end && *r->pos != '"') {
+			if (*r->pos == '\\' && r->pos + 1 == r->end)
+				break;	/* what it escapes is still to come */
+			r->pos += *r->pos == '\\' ? 2 : 1;
+		}
+		if (r->pos < r->end && *r->pos == '"')
+			break;
+		if (!refill(r, &tok))
+			return NULL;
+	}
+	end = r->pos++;
+	str = new_string(NULL, end - tok);
+	p = string_chars(str);
+	for (s = tok; s < end; s++) {
+		if (*s == '\\') {
+			s++;
+			*p++ = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+		} else
+			*p++ = *s;
+	}
+	*p = '\0';
+	string_len(str) = p - string_chars(str);
+	return str;
+}
+
+/* Reads int, float or symbol from the len characters at buf */
+sexp_t *read_atom(const char *buf, size_t len)
+{
+	unsigned char c;
+	const char *s = buf, *end = buf + len;
+	int32_t i = 0;	// integer part
+	int big = 0;	// which did not fit i
+	double ipart = 0.0;
+	double f = 0.0;	// fractional part
+	int base = 10;
+	double div = base;
+	int exp = 0;
+	int haveexp = 0;
+	int expsign = 1;
+	int havenum = 0;
+	int sign = 1;
+	int type = INT;
+
+	if (s < end && *s == '-') {
+		sign = -1;
+		s++;
+	} else if (s < end && *s == '+')
+		s++;
+
+	while (s < end) {
+		c = *s++;
+		if (isdigit(c) && (type == INT || type == FLOAT)) {
+			havenum = 1;
+			if (type == INT) {	// integer part
+				ipart = ipart*base + c-'0';
+				big |= __builtin_mul_overflow(i, base, &i) ||
+					__builtin_add_overflow(i, sign*(c-'0'), &i);
+			} else {			// fractional part
+				f += (c-'0')/div;
+				div *= base;
+			}
+		} else if (c == '.' && type != FLOAT) {
+			type = FLOAT;
+		} else if (c == 'e' && !haveexp && havenum) {
+			havenum = 0;
+			haveexp = 1;
+			type = FLOAT;
+			if (s < end && *s == '-') {
+				expsign = -1;
+				s++;
+			} else if (s < end && *s == '+')
+				s++;
+			for (; s < end && isdigit((unsigned char)*s); s++) {
+				exp = exp*10 + *s-'0';
+				havenum = 1;
+			}
+		} else
+			return find_symboln(buf, len);
+	}
+	if (!havenum)
+		return find_symboln(buf, len);
+	if (type == INT)
+		return big ? big_read(buf, len) : int_(i);
+	f = sign*(ipart+f);
+	while (exp--)
+		f = (expsign > 0) ? f*10.0 : f/10.0;
+	return float_(f);
+}
+
+/*
+ * read_sexp keeps its own stack of the lists and quotes still open, so
+ * nesting is bounded by memory rather than by the C stack.  A frame
+ * holds the slot its next element goes in: the car or cdr of a cell,
+ * or the result.  Lists grow at the tail, one cons per element.  Only
+ * the result and the expression being placed are roots; everything
+ * else hangs off the result.
+ */
+
+enum { W_CAR, W_CDR, W_RET };
+enum { K_TOP, K_QUOTE, K_OPEN, K_LIST, K_DOT, K_DOTTED };
+
+struct frame {
+	sexp_t *cell;
+	unsigned char where;
+	unsigned char kind;
+};
+
+static struct frame *stack = NULL;
+static size_t depth = 0, stack_size = 0;
+
+static void push_frame(sexp_t *cell, int where, int kind)
+{
+	if (depth == stack_size) {
+		stack_size = stack_size ? stack_size * 2 : 64;
+		if (!(stack = realloc(stack, stack_size * sizeof(*stack)))) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+	}
+	stack[depth].cell = cell;
+	stack[depth].where = where;
+	stack[depth].kind = kind;
+	depth++;
+}
+
+static void store(struct frame *f, sexp_t *x, sexp_t **ret)
+{
+	if (f->where == W_RET)
+		*ret = x;
+	else if (f->where == W_CAR)
+		set_car(f->cell, x);
+	else
+		set_cdr(f->cell, x);
+}
+
+/*
+ * Puts x, which the caller keeps rooted, in the innermost frame and
+ * returns the slot it went in.
+ */
+static struct frame place(sexp_t *x, sexp_t **ret)
+{
+	struct frame *f = &stack[depth - 1];
+	struct frame slot = *f;
+
+	switch (f->kind) {
+	case K_OPEN:
+	case K_LIST:
+		x = cons(x, nil);
+		store(f, x, ret);
+		f->cell = x;
+		f->where = W_CDR;
+		f->kind = K_LIST;
+		slot.cell = x;
+		slot.where = W_CAR;
+		break;
+	case K_DOT:
+		f->kind = K_DOTTED;
+		/* fall through */
+	default:
+		store(f, x, ret);
+	}
+	return slot;
+}
+
+/* Pops the quotes an expression just completed, 1 if the read is done */
+static int complete(void)
+{
+	while (stack[depth - 1].kind == K_QUOTE)
+		depth--;
+	return stack[depth - 1].kind == K_TOP;
+}
+
+sexp_t *read_sexp(struct reader *r)
+{
+	const char *s, *name;
+	size_t len, base = depth;
+	int c;
+	struct frame slot;
+	sexp_t *ret = NULL, *x = NULL;
+	gc_frame();
+
+	gc_push2(&ret, &x);
+	push_frame(NULL, W_RET, K_TOP);
+	for (;;) {
+		switch (c = skip(r)) {
+		case EOF:
+			if (depth - base > 1) {
+				fprintf(stderr, "error: unexpected end of input\n");
+				goto fail;
+			}
+			ret = NULL;
+			goto done;
+		case '(':
+			r->pos++;
+			slot = place(nil, &ret);
+			push_frame(slot.cell, slot.where, K_OPEN);
+			continue;
+		case ')':
+			r->pos++;
+			if (stack[depth - 1].kind < K_OPEN) {
+				fprintf(stderr, "error: unexpected \')\'\n");
+				goto fail;
+			}
+			depth--;
+			if (complete())
+				goto done;
+			continue;
+		case '\'':
+		case '`':
+		case ',':
+			r->pos++;
+			if (c == '\'')
+				name = "quote";
+			else if (c == '`')
+				name = "backquote";
+			else if (peek(r) == '@') {
+				r->pos++;
+				name = "unquote-splice";
+			} else
+				name = "unquote";
+			if (stack[depth - 1].kind == K_DOTTED)
+				goto dotted;
+			x = find_symbol(name);
+			x = cons(x, nil);
+			set_cdr(x, cons(nil, nil));
+			place(x, &ret);
+			push_frame(cdr(x), W_CAR, K_QUOTE);
+			continue;
+		case '"':
+			r->pos++;
+			if (!(x = read_string(r))) {
+				fprintf(stderr, "error: unexpected end of input\n");
+				goto fail;
+			}
+			break;
+		case '.':
+			s = r->pos++;
+			if (r->pos == r->end)
+				refill(r, &s);
+			if (r->pos < r->end && class(r) == C_SPACE) {
+				switch (stack[depth - 1].kind) {
+				case K_OPEN:
+					fprintf(stderr, "error: 'dot' not allowed "
+							"at beginning of list\n");
+					goto fail;
+				case K_LIST:
+					stack[depth - 1].kind = K_DOT;
+					continue;
+				case K_DOT:
+				case K_DOTTED:
+					goto dotted;
+				}
+				x = dot;	/* read on its own */
+				break;
+			}
+			r->pos = s;
+			/* fall through */
+		default:
+			len = scan_atom(r, &s);
+			x = read_atom(s, len);
+		}
+		if (stack[depth - 1].kind == K_DOTTED)
+			goto dotted;
+		place(x, &ret);
+		if (complete())
+			goto done;
+	}
+
+dotted:
+	fprintf(stderr, "error: only one expression after 'dot' allowed\n");
+fail:
+	ret = NULL;
+done:
+	depth = base;
+	gc_popn(2);
+	return ret;
+}
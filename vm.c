@@ -0,0 +1,943 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lisp.h"
+
+/*
+ * Bytecode compiler and virtual machine
+ *
+ * vm_eval compiles an expression to bytecode and runs it on a value
+ * stack.  Frames are the same arrays of values the tree walker builds,
+ * so compiled closures and interpreted lambdas capture each other's
+ * frames, and the forms the compiler does not know (backquote, macro)
+ * are handed to eval unchanged.  Macros are expanded once, when the
+ * code using them is compiled.  Calls between compiled closures stay
+ * inside vm_run and do not grow the C stack; calls in tail position
+ * reuse the caller's activation.
+ */
+
+int vm_mode;
+
+/*
+ * Every instruction is one opcode byte followed by 16 bit operands:
+ * constant indices, (depth, index) of a local, jump targets as offsets
+ * from the start of the code, or argument counts; OPCODES lists how
+ * many each takes.  MACRO guards an inlined expansion: when the global
+ * operator of the call no longer holds the macro that made it, the call
+ * is handed to eval and the expansion skipped.  FN loads the global
+ * operator of any other call and, should it hold a macro by then, hands
+ * the call to eval and skips it, before the arguments are evaluated.
+ * The CAR..GE group runs the primitive inline while the global named by
+ * its constant still holds it, and calls whatever it holds otherwise.
+ */
+#define OPCODES(X) \
+	X(CONST,1) X(VOID,0) X(LREF0,1) X(LREF,2) X(GREF,1) X(SETL,2) \
+	X(SETG,1) X(LABEL,1) X(POP,0) X(JMP,1) X(JNIL,1) X(ANDJ,1) \
+	X(ORJ,1) X(CLOSURE,1) X(EVAL,1) X(CALL,1) X(TCALL,1) X(RET,0) \
+	X(SETCAR,0) X(SETCDR,0) X(MACRO,3) X(FN,3) \
+	X(CAR,1) X(CDR,1) X(CONS,1) X(EQ,1) X(ATOM,1) X(CONSP,1) \
+	X(ADD,1) X(SUB,1) X(MUL,1) X(NUMEQ,1) X(LT,1) X(GT,1) X(LE,1) X(GE,1)
+
+#define OP_ENUM(op,n)	OP_##op,
+enum { OPCODES(OP_ENUM) OP_COUNT };
+#undef OP_ENUM
+
+#define OP_OPERANDS(op,n)	n,
+static const uint8_t operands[] = { OPCODES(OP_OPERANDS) };
+#undef OP_OPERANDS
+
+#define OPERAND_MAX	0xFFFF
+#define get16(p)	((unsigned)(p)[0] | (unsigned)(p)[1] << 8)
+
+/*
+ * Compiler
+ */
+
+struct comp {
+	uint8_t *ops;
+	size_t len, cap;
+	sexp_t *consts;		/* newest first, rooted while compiling */
+	unsigned nconsts;
+	unsigned depth, maxdepth;
+	struct scope *sc;
+	env_t *env;		/* frames the code will run under */
+	int fail;		/* an operand does not fit */
+};
+
+static void compile(struct comp *c, sexp_t *x, int tail);
+
+static void emit(struct comp *c, int byte)
+{
+	if (c->len == c->cap) {
+		c->cap = c->cap ? 2*c->cap : 64;
+		if (!(c->ops = realloc(c->ops, c->cap))) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(1);
+		}
+	}
+	c->ops[c->len++] = byte;
+}
+
+static void emit16(struct comp *c, unsigned v)
+{
+	if (v > OPERAND_MAX)
+		c->fail = 1;
+	emit(c, v & 0xFF);
+	emit(c, v >> 8 & 0xFF);
+}
+
+/* Accounts for n values pushed (or popped, if negative) */
+static void stack(struct comp *c, int n)
+{
+	c->depth += n;
+	if (c->depth > c->maxdepth)
+		c->maxdepth = c->depth;
+}
+
+/*
+ * Emits a jump to be patched later.  Jumps to the same place are
+ * chained through their operands, chain being the previous one.
+ */
+static size_t emit_jump(struct comp *c, int op, size_t chain)
+{
+	emit(c, op);
+	emit16(c, chain);
+	return c->len - 2;
+}
+
+/* Points a chain of jumps to the current end of the code */
+static void patch(struct comp *c, size_t chain)
+{
+	size_t next;
+
+	if (c->len > OPERAND_MAX)
+		c->fail = 1;
+	for (; chain; chain = next) {
+		next = get16(c->ops + chain);
+		c->ops[chain] = c->len & 0xFF;
+		c->ops[chain+1] = c->len >> 8 & 0xFF;
+	}
+}
+
+/* Index of x among the constants, adding it if it is new */
+static unsigned constant(struct comp *c, sexp_t *x)
+{
+	sexp_t *l;
+	unsigned i = c->nconsts;
+
+	for (l = c->consts; l != nil; l = cdr(l)) {
+		i--;
+		if (car(l) == x || (type(x) == GREF && type(car(l)) == GREF &&
+				    gref_binding(car(l)) == gref_binding(x)))
+			return i;
+	}
+	c->consts = cons(x, c->consts);
+	return c->nconsts++;
+}
+
+static void emit_const(struct comp *c, int op, sexp_t *x)
+{
+	unsigned k;
+	gc_frame();
+	gc_push(&x);
+	k = constant(c, x);
+	gc_pop();
+	emit(c, op);
+	emit16(c, k);
+}
+
+/* Emits op with the global binding of sym as operand */
+static void emit_global(struct comp *c, int op, sexp_t *sym)
+{
+	emit_const(c, op, gref(sym, env_slot(c->env, sym)));
+}
+
+static void compile_ref(struct comp *c, int lop, int gop, sexp_t *sym)
+{
+	unsigned depth;
+	int index;
+
+	if (!scope_lookup(sym, c->sc, c->env, &depth, &index)) {
+		emit_global(c, gop, sym);
+	} else if (depth == 0 && lop == OP_LREF) {
+		emit(c, OP_LREF0);
+		emit16(c, index);
+	} else {
+		emit(c, lop);
+		emit16(c, depth);
+		emit16(c, index);
+	}
+}
+
+/* Global value of the operator of x, unless a local shadows it */
+static sexp_t *global_op(struct comp *c, sexp_t *op)
+{
+	struct binding *b;
+	unsigned depth;
+	int index;
+
+	if (!issym(op) || scope_lookup(op, c->sc, c->env, &depth, &index) ||
+	    !(b = env_global(c->env, op)))
+		return NULL;
+	return b->val;
+}
+
+/* Turns what c compiled into a code object, NULL if it does not fit */
+static sexp_t *make_code(struct comp *c, sexp_t *params, sexp_t *body)
+{
+	code_t *code;
+	sexp_t *src = nil;
+	unsigned i;
+	gc_frame();
+
+	emit(c, OP_RET);
+	if (c->fail || c->maxdepth >= OPERAND_MAX) {
+		free(c->ops);
+		return NULL;
+	}
+	gc_push(&src);
+	if (body)
+		src = cons(params, body);
+	code = gc_alloc(CODE, sizeof(code_t));
+	code->rest = body && list_len(params) < 0;
+	code->nparams = body ? count_params(params) - code->rest : 0;
+	code->maxstack = c->maxdepth + 1;
+	code->nconsts = c->nconsts;
+	code->ops = c->ops;
+	code->consts = malloc(c->nconsts * sizeof(sexp_t*));
+	code->src = src;
+	if (!code->consts && c->nconsts) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	for (i = c->nconsts; i--; c->consts = cdr(c->consts))
+		code->consts[i] = car(c->consts);
+	gc_pop();
+	return (sexp_t*)code;
+}
+
+/* Length of the instructions of code, which end with its only RET */
+size_t code_size(code_t *code)
+{
+	uint8_t *pc = code->ops;
+
+	while (*pc != OP_RET)
+		pc += 1 + 2 * operands[*pc];
+	return pc + 1 - code->ops;
+}
+
+/* Compiles a lambda made in scope, NULL if it cannot be */
+static sexp_t *compile_lambda(struct scope *sc, env_t *env,
+			      sexp_t *params, sexp_t *body)
+{
+	struct comp c;
+	struct scope inner;
+	sexp_t *code;
+	gc_frame();
+
+	if (type(params) == PARAMS)
+		params = params_list(params);
+	if (count_params(params) < 0)
+		return NULL;
+	memset(&c, 0, sizeof(c));
+	c.consts = nil;
+	inner.params = params;
+	inner.up = sc;
+	c.sc = &inner;
+	c.env = env;
+	gc_push(&c.consts);
+	for (code = body; cdr(code) != nil; code = cdr(code)) {
+		compile(&c, car(code), 0);
+		emit(&c, OP_POP);
+		stack(&c, -1);
+	}
+	compile(&c, car(code), 1);
+	code = make_code(&c, params, body);
+	gc_pop();
+	return code;
+}
+
+/* Compiles exp to run directly in the frames of env */
+static sexp_t *compile_thunk(sexp_t *exp, env_t *env)
+{
+	struct comp c;
+	sexp_t *code;
+	gc_frame();
+
+	memset(&c, 0, sizeof(c));
+	c.consts = nil;
+	c.env = env;
+	gc_push(&c.consts);
+	compile(&c, exp, 1);
+	code = make_code(&c, nil, NULL);
+	gc_pop();
+	return code;
+}
+
+static void compile_cond(struct comp *c, sexp_t *clauses, int tail)
+{
+	size_t next, end = 0;
+	unsigned depth = c->depth;
+
+	for (; clauses != nil; clauses = cdr(clauses)) {
+		compile(c, car(car(clauses)), 0);
+		next = emit_jump(c, OP_JNIL, 0);
+		stack(c, -1);
+		compile(c, car(cdr(car(clauses))), tail);
+		end = emit_jump(c, OP_JMP, end);
+		c->depth = depth;
+		patch(c, next);
+	}
+	emit(c, OP_VOID);
+	stack(c, 1);
+	patch(c, end);
+}
+
+/* (and) and (or): jump out, keeping the value, once it decides */
+static void compile_andor(struct comp *c, sexp_t *args, int op, int tail)
+{
+	size_t end = 0;
+
+	if (args == nil) {
+		emit_const(c, OP_CONST, op == OP_ANDJ ? t : nil);
+		stack(c, 1);
+		return;
+	}
+	for (; cdr(args) != nil; args = cdr(args)) {
+		compile(c, car(args), 0);
+		end = emit_jump(c, op, end);
+		stack(c, -1);
+	}
+	compile(c, car(args), tail);
+	patch(c, end);
+}
+
+/* Special forms; those without a case are left to eval */
+static void compile_spec(struct comp *c, sexp_t *x, sexp_t *(*f)(), int tail)
+{
+	sexp_t *args = cdr(x), *code = NULL;
+	gc_frame();
+
+	if (f == (sexp_t *(*)())spec_quote && iscons(args)) {
+		emit_const(c, OP_CONST, car(args));
+		stack(c, 1);
+	} else if (f == (sexp_t *(*)())spec_cond) {
+		for (code = args; code != nil; code = cdr(code))
+			if (!iscons(car(code)) || list_len(car(code)) < 2)
+				break;
+		if (code != nil)
+			goto fallback;
+		compile_cond(c, args, tail);
+	} else if (f == (sexp_t *(*)())spec_and) {
+		compile_andor(c, args, OP_ANDJ, tail);
+	} else if (f == (sexp_t *(*)())spec_or) {
+		compile_andor(c, args, OP_ORJ, tail);
+	} else if (f == (sexp_t *(*)())spec_lambda && list_len(args) >= 2) {
+		gc_push(&code);
+		code = compile_lambda(c->sc, c->env, car(args), cdr(args));
+		if (code)
+			emit_const(c, OP_CLOSURE, code);
+		gc_pop();
+		if (!code)
+			goto fallback;
+		stack(c, 1);
+	} else if ((f == (sexp_t *(*)())spec_label ||
+		    f == (sexp_t *(*)())spec_set) &&
+		   list_len(args) >= 2 && issym(car(args))) {
+		compile(c, car(cdr(args)), 0);
+		if (f == (sexp_t *(*)())spec_label)
+			emit_global(c, OP_LABEL, car(args));
+		else
+			compile_ref(c, OP_SETL, OP_SETG, car(args));
+	} else if ((f == (sexp_t *(*)())spec_setcar ||
+		    f == (sexp_t *(*)())spec_setcdr) && list_len(args) >= 2) {
+		compile(c, car(args), 0);
+		compile(c, car(cdr(args)), 0);
+		emit(c, f == (sexp_t *(*)())spec_setcar ? OP_SETCAR : OP_SETCDR);
+		stack(c, -1);
+	} else {
+fallback:
+		emit_const(c, OP_EVAL, x);
+		stack(c, 1);
+	}
+}
+
+/* Primitives with an instruction of their own, by argument count */
+static const struct {
+	sexp_t *(*f)(sexp_t *);
+	int argc;
+	int op;
+} inline_prims[] = {
+	{ prim_car, 1, OP_CAR },	{ prim_cdr, 1, OP_CDR },
+	{ prim_cons, 2, OP_CONS },	{ prim_eq, 2, OP_EQ },
+	{ prim_atom, 1, OP_ATOM },	{ prim_consp, 1, OP_CONSP },
+	{ prim_add, 2, OP_ADD },	{ prim_sub, 2, OP_SUB },
+	{ prim_mul, 2, OP_MUL },	{ prim_numeq, 2, OP_NUMEQ },
+	{ prim_numlt, 2, OP_LT },	{ prim_numgt, 2, OP_GT },
+	{ prim_numle, 2, OP_LE },	{ prim_numge, 2, OP_GE },
+	{ NULL, 0, 0 }
+};
+
+static void compile_form(struct comp *c, sexp_t *x, int tail)
+{
+	sexp_t *op, *fn, *a;
+	unsigned n, i, depth;
+	size_t end = 0;
+	int index;
+	gc_frame();
+
+	op = car(x);
+	if (type(op) == LREF || type(op) == GREF)
+		op = car(op);
+	fn = global_op(c, op);
+	if (fn && type(fn) == MACRO) {
+		size_t end;
+		a = NULL;
+		gc_push2(&x, &a);
+		a = cons(fn, x);
+		emit_global(c, OP_MACRO, op);
+		emit16(c, constant(c, a));
+		end = c->len;
+		emit16(c, 0);
+		a = macro_expansion(x, fn);
+		compile(c, a, tail);
+		patch(c, end);
+		gc_popn(2);
+		return;
+	}
+	if (fn && type(fn) == SPEC) {
+		compile_spec(c, x, get_prim(fn), tail);
+		return;
+	}
+
+	n = list_len(cdr(x));
+	for (i = 0; fn && type(fn) == PRIM && inline_prims[i].f; i++)
+		if (get_prim(fn) == (sexp_t *(*)())inline_prims[i].f &&
+		    (int)n == inline_prims[i].argc)
+			break;
+	if (fn && type(fn) == PRIM && inline_prims[i].f) {
+		for (a = cdr(x); a != nil; a = cdr(a))
+			compile(c, car(a), 0);
+		emit_global(c, inline_prims[i].op, op);
+		stack(c, 1 - (int)n);
+		return;
+	}
+
+	gc_push(&x);
+	if (issym(op) && !scope_lookup(op, c->sc, c->env, &depth, &index)) {
+		emit_global(c, OP_FN, op);
+		emit16(c, constant(c, x));
+		end = c->len;
+		emit16(c, 0);
+		stack(c, 1);
+	} else {
+		compile(c, op, 0);
+	}
+	for (a = cdr(x); a != nil; a = cdr(a))
+		compile(c, car(a), 0);
+	emit(c, tail ? OP_TCALL : OP_CALL);
+	emit16(c, n);
+	stack(c, -(int)n);
+	if (end)
+		patch(c, end);
+	gc_pop();
+}
+
+static void compile(struct comp *c, sexp_t *x, int tail)
+{
+	if (!x) {
+		emit(c, OP_VOID);
+		stack(c, 1);
+		return;
+	}
+	if (type(x) == LREF || type(x) == GREF)
+		x = car(x);
+	if (issym(x)) {
+		compile_ref(c, OP_LREF, OP_GREF, x);
+		stack(c, 1);
+	} else if (!iscons(x)) {
+		emit_const(c, OP_CONST, x);
+		stack(c, 1);
+	} else if (list_len(x) < 0) {
+		emit_const(c, OP_EVAL, x);	/* let eval complain */
+		stack(c, 1);
+	} else {
+		compile_form(c, x, tail);
+	}
+}
+
+/*
+ * Virtual machine
+ *
+ * The value stack and the activation records live in fixed arrays,
+ * reserved once, so that pointers into them stay valid when vm_run
+ * is entered again from a primitive.  vm_sp and vm_fp are only brought
+ * up to date before something that may collect or re-enter; vm_mark
+ * treats everything below them as roots.
+ */
+
+#define VM_STACK	(1 << 22)
+#define VM_FRAMES	(1 << 20)
+
+struct vm_frame {
+	code_t *code;
+	env_t *env;
+	uint8_t *pc;		/* where it resumes after a call */
+	sexp_t **base;		/* its first value stack slot */
+	int entry;		/* returns to C */
+	size_t prof;		/* profile_enter's mark, or 0 */
+};
+
+static sexp_t **vm_stack, **vm_sp, **vm_stack_end;
+static struct vm_frame *vm_frames, *vm_fp, *vm_frames_end;
+
+static void vm_init(void)
+{
+	vm_stack = malloc(VM_STACK * sizeof(sexp_t*));
+	vm_frames = malloc(VM_FRAMES * sizeof(struct vm_frame));
+	if (!vm_stack || !vm_frames) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	vm_sp = vm_stack;
+	vm_stack_end = vm_stack + VM_STACK;
+	vm_fp = vm_frames - 1;
+	vm_frames_end = vm_frames + VM_FRAMES;
+}
+
+void vm_mark(void (*mark)(sexp_t *))
+{
+	struct vm_frame *f;
+	sexp_t **v;
+
+	for (v = vm_stack; v && v < vm_sp; v++)
+		mark(*v);
+	for (f = vm_frames; f && f <= vm_fp; f++) {
+		mark((sexp_t*)f->code);
+		mark((sexp_t*)f->env);
+	}
+}
+
+/*
+ * Builds the frame a call of a closure with code and environment par
+ * runs in, from n arguments on the value stack.  vm_sp must be above
+ * them: the rest list is consed in their slots.
+ */
+static env_t *vm_frame(code_t *code, env_t *par, sexp_t **args, unsigned n)
+{
+	sexp_t *rest = nil;
+	env_t *env;
+	unsigned i;
+
+	if (code->rest ? n < code->nparams : n != code->nparams) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	for (i = n; code->rest && i-- > code->nparams; )
+		rest = args[i] = cons(args[i], rest);
+	env = new_env(par, car(code->src), code->nparams + code->rest);
+	for (i = 0; i < code->nparams; i++)
+		env->vals[i] = args[i];
+	if (code->rest)
+		env->vals[i] = rest;
+	return env;
+}
+
+/* Calls something other than a compiled closure with n stack arguments */
+static sexp_t *vm_call(sexp_t *fn, sexp_t **args, unsigned n, env_t *env)
+{
+	sexp_t *list = nil;
+
+	if (!fn)
+		return NULL;	/* reported where it came from, like eval */
+	while (n--)
+		list = args[n] = cons(args[n], list);
+	return apply(fn, list, env);
+}
+
+static sexp_t *vm_run(code_t *code, env_t *env)
+{
+	uint8_t *pc;
+	sexp_t **sp, **consts, **args, *v, *fn;
+	struct vm_frame *fp;
+	struct binding *b;
+	code_t *callee;
+	env_t *e;
+	unsigned n, d;
+	int32_t r;
+
+#ifdef __GNUC__
+	#define DISPATCH(op,n)	&&L_##op,
+	static void *dispatch[] = { OPCODES(DISPATCH) };
+	#undef DISPATCH
+	#define CASE(op)	L_##op
+	#define NEXT()		goto *dispatch[*pc++]
+#else
+	#define CASE(op)	case OP_##op
+	#define NEXT()		goto next
+#endif
+	#define SAVE()		(vm_sp = sp, vm_fp = fp)
+	#define OPERAND()	(pc += 2, get16(pc-2))
+	#define GLOBAL_IS(f)	((v = gref_binding(consts[get16(pc)])->val) &&\
+				 isprim(v) &&\
+				 get_prim(v) == (sexp_t *(*)())(f))
+
+	if (!vm_stack)
+		vm_init();
+	if (vm_fp + 1 >= vm_frames_end ||
+	    vm_sp + code->maxstack >= vm_stack_end) {
+		fprintf(stderr, "error: stack overflow\n");
+		return NULL;
+	}
+	fp = vm_fp + 1;
+	fp->code = code;
+	fp->env = env;
+	fp->base = vm_sp;
+	fp->entry = 1;
+	fp->prof = 0;
+	sp = vm_sp;
+	consts = code->consts;
+	pc = code->ops;
+
+#ifdef __GNUC__
+	NEXT();
+#else
+next:
+	switch (*pc++) {
+#endif
+	CASE(CONST):
+		*sp++ = consts[OPERAND()];
+		NEXT();
+	CASE(VOID):
+		*sp++ = NULL;
+		NEXT();
+	CASE(LREF0):
+		*sp++ = env->vals[OPERAND()];
+		NEXT();
+	CASE(LREF):
+		for (e = env, d = OPERAND(); d--; e = e->par)
+			;
+		*sp++ = e->vals[OPERAND()];
+		NEXT();
+	CASE(GREF):
+		b = gref_binding(consts[OPERAND()]);
+		if (!(*sp++ = b->val))
+			fprintf(stderr, "error: symbol %s not bound.\n",
+				get_symname(b->sym));
+		NEXT();
+	CASE(SETL):
+		for (e = env, d = OPERAND(); d--; e = e->par)
+			;
+		e->vals[OPERAND()] = sp[-1];
+		gc_write((sexp_t*)e, sp[-1]);
+		sp[-1] = NULL;
+		NEXT();
+	CASE(SETG):
+		b = gref_binding(consts[OPERAND()]);
+		if (b->val) {
+			b->val = sp[-1];
+			gc_write((sexp_t*)toplevel, sp[-1]);
+		}
+		sp[-1] = NULL;
+		NEXT();
+	CASE(LABEL):
+		b = gref_binding(consts[OPERAND()]);
+		b->val = sp[-1];
+		gc_write((sexp_t*)toplevel, sp[-1]);
+		sp[-1] = NULL;
+		NEXT();
+	CASE(POP):
+		sp--;
+		NEXT();
+	CASE(JMP):
+		pc = code->ops + get16(pc);
+		NEXT();
+	CASE(JNIL):
+		if (*--sp == nil)
+			pc = code->ops + get16(pc);
+		else
+			pc += 2;
+		NEXT();
+	CASE(ANDJ):
+		if (sp[-1] == nil)
+			pc = code->ops + get16(pc);
+		else
+			sp--, pc += 2;
+		NEXT();
+	CASE(ORJ):
+		if (sp[-1] != nil)
+			pc = code->ops + get16(pc);
+		else
+			sp--, pc += 2;
+		NEXT();
+	CASE(CLOSURE):
+		SAVE();
+		v = closure(consts[get16(pc)], env);
+		pc += 2;
+		*sp++ = v;
+		NEXT();
+	CASE(EVAL):
+		SAVE();
+		v = eval(consts[get16(pc)], env);
+		pc += 2;
+		*sp++ = v;
+		NEXT();
+	CASE(CALL):
+		n = OPERAND();
+		args = sp - n;
+		fn = args[-1];
+		SAVE();
+		if (!fn || type(fn) != CLOSURE) {
+			v = vm_call(fn, args, n, env);
+			sp = args;
+			sp[-1] = v;
+			NEXT();
+		}
+		callee = closure_code(fn);
+		if (fp + 1 >= vm_frames_end ||
+		    args + callee->maxstack >= vm_stack_end)
+			goto overflow;
+		if (!(e = vm_frame(callee, proc_env(fn), args, n))) {
+			sp = args;
+			sp[-1] = NULL;
+			NEXT();
+		}
+		fp->pc = pc;
+		fp++;
+		fp->code = code = callee;
+		fp->env = env = e;
+		fp->base = sp = args - 1;
+		fp->entry = 0;
+		fp->prof = profile_call(fn);
+		consts = code->consts;
+		pc = code->ops;
+		NEXT();
+	CASE(TCALL):
+		n = OPERAND();
+		args = sp - n;
+		fn = args[-1];
+		SAVE();
+		if (!fn || type(fn) != CLOSURE) {
+			v = vm_call(fn, args, n, env);
+			goto ret;
+		}
+		callee = closure_code(fn);
+		if (fp->base + callee->maxstack >= vm_stack_end)
+			goto overflow;
+		if (!(e = vm_frame(callee, proc_env(fn), args, n))) {
+			v = NULL;
+			goto ret;
+		}
+		fp->code = code = callee;
+		fp->env = env = e;
+		sp = fp->base;
+		if (fp->prof)
+			profile_leave(fp->prof);
+		fp->prof = profile_call(fn);
+		consts = code->consts;
+		pc = code->ops;
+		NEXT();
+	CASE(RET):
+		v = sp[-1];
+	ret:
+		sp = fp->base;
+		if (fp->prof)
+			profile_leave(fp->prof);
+		if (fp->entry) {
+			vm_sp = sp;
+			vm_fp = fp - 1;
+			return v;
+		}
+		fp--;
+		code = fp->code;
+		env = fp->env;
+		consts = code->consts;
+		pc = fp->pc;
+		*sp++ = v;
+		NEXT();
+	CASE(MACRO):
+		v = consts[get16(pc+2)];
+		if (gref_binding(consts[get16(pc)])->val == car(v)) {
+			pc += 6;
+			NEXT();
+		}
+		SAVE();
+		v = eval(cdr(v), env);
+		*sp++ = v;
+		pc = code->ops + get16(pc+4);
+		NEXT();
+	CASE(FN):
+		b = gref_binding(consts[get16(pc)]);
+		if (!(v = b->val) || type(v) != MACRO) {
+			if (!v)
+				fprintf(stderr, "error: symbol %s not bound.\n",
+					get_symname(b->sym));
+			*sp++ = v;
+			pc += 6;
+			NEXT();
+		}
+		SAVE();
+		v = eval(consts[get16(pc+2)], env);
+		*sp++ = v;
+		pc = code->ops + get16(pc+4);
+		NEXT();
+	CASE(SETCAR):
+	CASE(SETCDR):
+		if (!iscons(sp[-2]))
+			fprintf(stderr, "error: cons expected\n");
+		else if (pc[-1] == OP_SETCAR)
+			set_car(sp[-2], sp[-1]);
+		else
+			set_cdr(sp[-2], sp[-1]);
+		*--sp = NULL;
+		sp[-1] = NULL;
+		NEXT();
+
+	#define PRIM1(op, f, test, val) \
+	CASE(op): \
+		if (GLOBAL_IS(f) && (test)) { \
+			sp[-1] = (val); \
+			pc += 2; \
+			NEXT(); \
+		} \
+		n = 1; \
+		goto slow;
+	PRIM1(CAR, prim_car, iscons(sp[-1]), car(sp[-1]))
+	PRIM1(CDR, prim_cdr, iscons(sp[-1]), cdr(sp[-1]))
+	PRIM1(ATOM, prim_atom, 1, isatom(sp[-1]) ? t : nil)
+	PRIM1(CONSP, prim_consp, 1, iscons(sp[-1]) ? t : nil)
+	#undef PRIM1
+
+	CASE(EQ):
+		if (GLOBAL_IS(prim_eq)) {
+			sp--;
+			sp[-1] = eq_atoms(sp[-1], sp[0]) ? t : nil;
+			pc += 2;
+			NEXT();
+		}
+		n = 2;
+		goto slow;
+	CASE(CONS):
+		if (GLOBAL_IS(prim_cons)) {
+			SAVE();
+			v = cons(sp[-2], sp[-1]);
+			*--sp = NULL;
+			sp[-1] = v;
+			pc += 2;
+			NEXT();
+		}
+		n = 2;
+		goto slow;
+
+	/* an unbound variable leaves NULL for the primitive to report */
+	#define INTS(a, b)	((a) && (b) && isint(a) && isint(b))
+	#define ARITH(op, f, overflow) \
+	CASE(op): \
+		if (GLOBAL_IS(f) && INTS(sp[-2], sp[-1]) && \
+		    !overflow(get_int(sp[-2]), get_int(sp[-1]), &r)) { \
+			SAVE(); \
+			v = int_(r); \
+			*--sp = NULL; \
+			sp[-1] = v; \
+			pc += 2; \
+			NEXT(); \
+		} \
+		n = 2; \
+		goto slow;
+	ARITH(ADD, prim_add, __builtin_add_overflow)
+	ARITH(SUB, prim_sub, __builtin_sub_overflow)
+	ARITH(MUL, prim_mul, __builtin_mul_overflow)
+	#undef ARITH
+
+	#define COMPARE(op, f, OP) \
+	CASE(op): \
+		if (GLOBAL_IS(f) && INTS(sp[-2], sp[-1])) { \
+			sp--; \
+			sp[-1] = get_int(sp[-1]) OP get_int(sp[0]) ? t : nil; \
+			pc += 2; \
+			NEXT(); \
+		} \
+		n = 2; \
+		goto slow;
+	COMPARE(NUMEQ, prim_numeq, ==)
+	COMPARE(LT, prim_numlt, <)
+	COMPARE(GT, prim_numgt, >)
+	COMPARE(LE, prim_numle, <=)
+	COMPARE(GE, prim_numge, >=)
+	#undef COMPARE
+	#undef INTS
+
+#ifndef __GNUC__
+	}
+#endif
+
+slow:	/* an inline primitive that does not apply: call the global */
+	b = gref_binding(consts[OPERAND()]);
+	if (!b->val)
+		fprintf(stderr, "error: symbol %s not bound.\n",
+			get_symname(b->sym));
+	args = sp - n;
+	SAVE();
+	if (n == 2 && b->val && type(b->val) == PRIM && get_prim2(b->val))
+		v = get_prim2(b->val)(args[0], args[1]);
+	else
+		v = vm_call(b->val, args, n, env);
+	sp = args;
+	*sp++ = v;
+	NEXT();
+
+overflow:
+	fprintf(stderr, "error: stack overflow\n");
+	for (; !fp->entry; fp--)
+		if (fp->prof)
+			profile_leave(fp->prof);
+	if (fp->prof)
+		profile_leave(fp->prof);
+	vm_sp = fp->base;
+	vm_fp = fp - 1;
+	return NULL;
+
+	#undef CASE
+	#undef NEXT
+	#undef SAVE
+	#undef OPERAND
+	#undef GLOBAL_IS
+}
+
+/* Evaluates exp in env by compiling it first */
+sexp_t *vm_eval(sexp_t *exp, env_t *env)
+{
+	sexp_t *code;
+	gc_frame();
+
+	if (!(code = compile_thunk(exp, env)))
+		return eval(exp, env);
+	gc_push(&code);
+	exp = vm_run((code_t*)code, env);
+	gc_pop();
+	return exp;
+}
+
+/* Calls a compiled closure from C */
+sexp_t *vm_apply(sexp_t *proc, sexp_t *args)
+{
+	sexp_t **base;
+	env_t *env;
+	unsigned n;
+
+	if (!vm_stack)
+		vm_init();
+	if (list_len(args) < 0 ||
+	    vm_sp + list_len(args) + 1 >= vm_stack_end) {
+		fprintf(stderr, "error: argument count\n");
+		return NULL;
+	}
+	base = vm_sp;
+	*vm_sp++ = proc;
+	for (n = 0; args != nil; args = cdr(args), n++)
+		*vm_sp++ = car(args);
+	env = vm_frame(closure_code(proc), proc_env(proc), base + 1, n);
+	vm_sp = base;
+	if (!env)
+		return NULL;
+	return vm_run(closure_code(proc), env);
+}